@@ -24,11 +24,14 @@
 #include "nativedraw_private.h"
 
 #include <assert.h>
+#include <math.h>
 #include <stdio.h>
 #include <string.h>
 
 #include <algorithm>
+#include <list>
 #include <map>
+#include <thread>
 
 #if __APPLE__
 #include <TargetConditionals.h>
@@ -247,6 +250,64 @@ Rect Rect::intersectedWith(const Rect& r) const
     return Rect(xMin, yMin, std::max(PicaPt::kZero, xMax - xMin), std::max(PicaPt::kZero, yMax - yMin));
 }
 
+Rect Rect::unionedWith(const Rect& r) const
+{
+    auto xMin = std::min(this->x, r.x);
+    auto xMax = std::max(this->x + this->width, r.x + r.width);
+    auto yMin = std::min(this->y, r.y);
+    auto yMax = std::max(this->y + this->height, r.y + r.height);
+    return Rect(xMin, yMin, xMax - xMin, yMax - yMin);
+}
+
+//-----------------------------------------------------------------------------
+const AffineTransform AffineTransform::kIdentity;
+
+AffineTransform AffineTransform::rotation(float degrees)
+{
+    // +y is down, so counter-clockwise on the screen is clockwise in the
+    // usual mathematical sense (see DrawContext::rotate()).
+    double rad = double(degrees) * 3.14159265358979323846 / 180.0;
+    float cosT = float(std::cos(rad));
+    float sinT = float(std::sin(rad));
+    return AffineTransform(cosT, -sinT, sinT, cosT, PicaPt::kZero, PicaPt::kZero);
+}
+
+AffineTransform AffineTransform::concatenated(const AffineTransform& rhs) const
+{
+    return AffineTransform(a * rhs.a + c * rhs.b,
+                           b * rhs.a + d * rhs.b,
+                           a * rhs.c + c * rhs.d,
+                           b * rhs.c + d * rhs.d,
+                           a * rhs.tx + c * rhs.ty + tx,
+                           b * rhs.tx + d * rhs.ty + ty);
+}
+
+AffineTransform AffineTransform::inverted() const
+{
+    float det = a * d - b * c;
+    if (det == 0.0f || !std::isfinite(det)) {
+        return kIdentity;
+    }
+    float invDet = 1.0f / det;
+    float ia = d * invDet;
+    float ib = -b * invDet;
+    float ic = -c * invDet;
+    float id = a * invDet;
+    return AffineTransform(ia, ib, ic, id,
+                           -(ia * tx + ic * ty), -(ib * tx + id * ty));
+}
+
+Rect AffineTransform::mapRect(const Rect& r) const
+{
+    Point p[4] = { mapPoint(r.upperLeft()), mapPoint(r.upperRight()),
+                   mapPoint(r.lowerRight()), mapPoint(r.lowerLeft()) };
+    auto xMin = std::min(std::min(p[0].x, p[1].x), std::min(p[2].x, p[3].x));
+    auto xMax = std::max(std::max(p[0].x, p[1].x), std::max(p[2].x, p[3].x));
+    auto yMin = std::min(std::min(p[0].y, p[1].y), std::min(p[2].y, p[3].y));
+    auto yMax = std::max(std::max(p[0].y, p[1].y), std::max(p[2].y, p[3].y));
+    return Rect(xMin, yMin, xMax - xMin, yMax - yMin);
+}
+
 //-----------------------------------------------------------------------------
 const Color Color::kTransparent(0.0f, 0.0f, 0.0f, 0.0f);
 const Color Color::kBlack(0.0f, 0.0f, 0.0f, 1.0f);
@@ -734,36 +795,59 @@ struct Font::Impl
         hash_combine(this->hash, int(this->style));
         hash_combine(this->hash, int(this->weight));
     }
+
+    bool operator==(const Impl& rhs) const
+    {
+        return (this->hash == rhs.hash && this->pointSize == rhs.pointSize
+                && this->style == rhs.style && this->weight == rhs.weight
+                && this->family == rhs.family);
+    }
+
+    // Returns the shared Impl equal to desc. Since all Impls are interned,
+    // two fonts are equal if and only if their Impls are the same pointer.
+    static std::shared_ptr<const Impl> intern(Impl&& desc)
+    {
+        static auto *gTable = new InternTable<Impl>();  // never deleted, see InternTable
+        desc.computeHash();
+        auto hash = desc.hash;
+        return gTable->intern(std::move(desc), hash);
+    }
+
+    // Font() is constructed often (e.g. as members), so avoid the lookup
+    static const std::shared_ptr<const Impl>& defaultImpl()
+    {
+        static auto *gDefault = new std::shared_ptr<const Impl>(Font("", PicaPt::kZero).mImpl);  // never deleted
+        return *gDefault;
+    }
 };
 
 Font::Font()
-    : Font("", PicaPt::kZero)
+    : mImpl(Impl::defaultImpl())
 {}
 
 Font::Font(const Font& f)
-    : mImpl(new Font::Impl())
+    : mImpl(f.mImpl)
 {
-    *mImpl = *f.mImpl;  // copy
 }
 
 Font& Font::operator=(const Font& rhs) noexcept
 {
-    *mImpl = *rhs.mImpl;  // copy
+    mImpl = rhs.mImpl;
     return *this;
 }
 
 Font::Font(const std::string& family, const PicaPt& pointSize,
            FontStyle style /*=kStyleNone*/, FontWeight weight /*=kWeightAuto*/)
-    : mImpl(new Font::Impl())
 {
-    mImpl->family = family;
-    mImpl->pointSize = pointSize;
-    mImpl->style = style;
+    Impl desc;
+    desc.family = family;
+    desc.pointSize = pointSize;
+    desc.style = style;
     if (weight == kWeightAuto) {
         weight = (style & kStyleBold) ? kWeightBold : kWeightRegular;
     }
-    mImpl->weight = weight;
-    mImpl->computeHash();
+    desc.weight = weight;
+    mImpl = Impl::intern(std::move(desc));
 }
 
 Font::~Font() {}
@@ -774,8 +858,11 @@ std::string Font::family() const { return mImpl->family; }
 
 Font& Font::setFamily(const std::string& family)
 {
-    mImpl->family = family;
-    mImpl->computeHash();
+    if (family != mImpl->family) {
+        Impl desc = *mImpl;
+        desc.family = family;
+        mImpl = Impl::intern(std::move(desc));
+    }
     return *this;
 }
 
@@ -783,8 +870,11 @@ PicaPt Font::pointSize() const { return mImpl->pointSize; }
 
 Font& Font::setPointSize(const PicaPt& size)
 {
-    mImpl->pointSize = size;
-    mImpl->computeHash();
+    if (size != mImpl->pointSize) {
+        Impl desc = *mImpl;
+        desc.pointSize = size;
+        mImpl = Impl::intern(std::move(desc));
+    }
     return *this;
 }
 
@@ -792,8 +882,11 @@ FontStyle Font::style() const { return mImpl->style; }
 
 Font& Font::setStyle(FontStyle style)
 {
-    mImpl->style = style;
-    mImpl->computeHash();
+    if (style != mImpl->style) {
+        Impl desc = *mImpl;
+        desc.style = style;
+        mImpl = Impl::intern(std::move(desc));
+    }
     return *this;
 }
 
@@ -806,8 +899,11 @@ Font& Font::setWeight(FontWeight w)
         w = kWeightRegular;
     }
 
-    mImpl->weight = w;
-    mImpl->computeHash();
+    if (w != mImpl->weight) {
+        Impl desc = *mImpl;
+        desc.weight = w;
+        mImpl = Impl::intern(std::move(desc));
+    }
     return *this;
 }
 
@@ -842,6 +938,27 @@ Font::Metrics Font::metrics(const DrawContext& dc) const
     return dc.fontMetrics(*this);
 }
 
+std::string Font::familyForCodePoint(const DrawContext& dc, uint32_t codePoint) const
+{
+    return dc.fontFamilyForCodePoint(*this, codePoint);
+}
+
+void Font::prewarmFallbacks(const DrawContext& dc,
+                            const std::vector<std::string>& utf8Strings) const
+{
+    for (auto &s : utf8Strings) {
+        const char *c = s.c_str();
+        const char *end = c + s.size();
+        while (c < end) {
+            uint32_t utf32;
+            c = nextCodePoint(c, &utf32);
+            if (utf32 >= 0x80) {  // assume fonts have ASCII
+                dc.fontFamilyForCodePoint(*this, utf32);
+            }
+        }
+    }
+}
+
 Font Font::fontWithPointSize(const PicaPt& pointSize) const
 {
     return Font(family(), pointSize, style(), weight());
@@ -885,6 +1002,90 @@ void setTextRun(Text& t, TextRun *run, int start, int len)
     t.setTextRun(*run);
 }
 
+namespace {
+
+inline std::size_t attrValueHash(bool v) { return std::hash<bool>()(v); }
+inline std::size_t attrValueHash(const PicaPt& v) { return std::hash<float>()(v.asFloat()); }
+inline std::size_t attrValueHash(const Color& v) { return v.hash(); }
+inline std::size_t attrValueHash(const Font& v) { return v.hash(); }
+inline std::size_t attrValueHash(UnderlineStyle v) { return std::hash<int>()(int(v)); }
+
+template <typename T>
+bool attrValueEqual(const T& v1, const T& v2) { return (v1 == v2); }
+inline bool attrValueEqual(const Color& v1, const Color& v2)
+{
+    // Color does not have operator==() because approximately equal colors
+    // should usually be equal, but here we need exact equality.
+    return (v1.red() == v2.red() && v1.green() == v2.green()
+            && v1.blue() == v2.blue() && v1.alpha() == v2.alpha());
+}
+
+template <typename T>
+void hashTextAttr(std::size_t& seed, const TextAttr<T>& a)
+{
+    hash_combine(seed, a.isSet);
+    if (a.isSet) {
+        hash_combine(seed, attrValueHash(a.value));
+    }
+}
+
+template <typename T>
+bool textAttrEqual(const TextAttr<T>& a1, const TextAttr<T>& a2)
+{
+    return (a1.isSet == a2.isSet && (!a1.isSet || attrValueEqual(a1.value, a2.value)));
+}
+
+// Compares only the attributes, not the startIndex and length
+struct TextRunAttrsEqual
+{
+    bool operator()(const TextRun& r1, const TextRun& r2) const
+    {
+        return (textAttrEqual(r1.pointSize, r2.pointSize)
+                && textAttrEqual(r1.bold, r2.bold)
+                && textAttrEqual(r1.italic, r2.italic)
+                && textAttrEqual(r1.font, r2.font)
+                && textAttrEqual(r1.backgroundColor, r2.backgroundColor)
+                && textAttrEqual(r1.color, r2.color)
+                && textAttrEqual(r1.underlineColor, r2.underlineColor)
+                && textAttrEqual(r1.strikethroughColor, r2.strikethroughColor)
+                && textAttrEqual(r1.outlineColor, r2.outlineColor)
+                && textAttrEqual(r1.outlineStrokeWidth, r2.outlineStrokeWidth)
+                && textAttrEqual(r1.underlineStyle, r2.underlineStyle)
+                && textAttrEqual(r1.strikethrough, r2.strikethrough)
+                && textAttrEqual(r1.superscript, r2.superscript)
+                && textAttrEqual(r1.subscript, r2.subscript)
+                && textAttrEqual(r1.characterSpacing, r2.characterSpacing));
+    }
+};
+
+std::shared_ptr<const TextRun> internTextRunAttrs(TextRun&& attrs)
+{
+    static auto *gTable = new InternTable<TextRun, TextRunAttrsEqual>();  // never deleted
+
+    attrs.startIndex = 0;
+    attrs.length = -1;
+
+    std::size_t hash = 0;
+    hashTextAttr(hash, attrs.pointSize);
+    hashTextAttr(hash, attrs.bold);
+    hashTextAttr(hash, attrs.italic);
+    hashTextAttr(hash, attrs.font);
+    hashTextAttr(hash, attrs.backgroundColor);
+    hashTextAttr(hash, attrs.color);
+    hashTextAttr(hash, attrs.underlineColor);
+    hashTextAttr(hash, attrs.strikethroughColor);
+    hashTextAttr(hash, attrs.outlineColor);
+    hashTextAttr(hash, attrs.outlineStrokeWidth);
+    hashTextAttr(hash, attrs.underlineStyle);
+    hashTextAttr(hash, attrs.strikethrough);
+    hashTextAttr(hash, attrs.superscript);
+    hashTextAttr(hash, attrs.subscript);
+    hashTextAttr(hash, attrs.characterSpacing);
+    return gTable->intern(std::move(attrs), hash);
+}
+
+} // namespace
+
 Text::Text()
 : Text("", Font(), Color::kBlack)
 {
@@ -894,11 +1095,11 @@ Text::Text(const std::string& utf8, const Font& font, const Color& fgColor)
 {
     mText = utf8;
     mParagraph.lineHeightMultiple = 0.0f;  // platform default
-    mRuns.emplace_back();
-    mRuns.back().startIndex = 0;
-    mRuns.back().length = int(mText.length());
-    mRuns.back().font = font;
-    mRuns.back().color = fgColor;
+    TextRun attrs;
+    attrs.font = font;
+    attrs.color = fgColor;
+    mRuns.push_back({ 0, int(mText.length()), internTextRunAttrs(std::move(attrs)) });
+    mGapStart = mGapEnd = mRuns.size();
 }
 
 const std::string& Text::text() const { return mText; }
@@ -1034,61 +1235,259 @@ Text& Text::setTextRun(const TextRun& run)
     int newRunLength = (run.length >= 0) ? std::min(run.length, int(mText.size()) - run.startIndex)
                                          : (int(mText.size()) - run.startIndex);
     int idx = runIndexFor(newRunStart);
-    while (newRunLength > 0 && idx >= 0) {
-        auto *r = &mRuns[idx];
-        assert(r->startIndex <= newRunStart);
+    // Consecutive runs frequently have the same attributes, so avoid
+    // re-interning the same result.
+    std::shared_ptr<const TextRun> lastOldAttrs, lastNewAttrs;
+    while (newRunLength > 0 && idx >= 0 && idx < int(nRuns())) {
+        auto *r = &this->run(idx);
+        int rStart = runStart(idx);
+        assert(rStart <= newRunStart);
 
         // Split the run if we need to
-        if (newRunStart == r->startIndex && newRunLength >= r->length) {
+        if (newRunStart == rStart && newRunLength >= r->length) {
             // this is the happy path; we do not need to do anything!
-        } else if (newRunStart == r->startIndex) {  // && newRunLength < r->length
-            mRuns.insert(mRuns.begin() + idx, *r);
-            r = &mRuns[idx];  // insert invalidates r (which is essentially an iterator)
+        } else if (newRunStart == rStart) {  // && newRunLength < r->length
+            Run rest = { rStart + newRunLength, r->length - newRunLength, r->attrs };
             r->length = newRunLength;
-            mRuns[idx + 1].length -= newRunLength;
-            mRuns[idx + 1].startIndex += newRunLength;
-        } else {  // newRunStart > r->startIndex
-            mRuns.insert(mRuns.begin() + idx + 1, *r);
-            r = &mRuns[idx];  // insert invalidates r (which is essentially an iterator)
-            r->length = newRunStart - r->startIndex;
+            insertRun(idx + 1, std::move(rest));
+            r = &this->run(idx);  // insert invalidates r (which is essentially an iterator)
+        } else {  // newRunStart > rStart
+            Run rest = { newRunStart, r->length - (newRunStart - rStart), r->attrs };
+            r->length = newRunStart - rStart;
+            insertRun(idx + 1, std::move(rest));
             idx += 1;
-            r = &mRuns[idx];
-            r->length -= newRunStart - r->startIndex;
-            r->startIndex = newRunStart;
             continue;  // loop back around, in case newRunLength < r->length
         }
 
-        // Copy (TextRun::operator=() handles set properties)
-        int oldStart = r->startIndex;
-        int oldLen = r->length;
-        *r = run;
-        r->startIndex = oldStart;  // if we override Text::operator=(), pretty likely
-        r->length = oldLen;        // to forget a field when we add one at some point.
+        if (r->attrs != lastOldAttrs) {
+            lastOldAttrs = r->attrs;
+            TextRun attrs = *r->attrs;  // copy constructor, so nothing is merged...
+            attrs = run;                // ... but TextRun::operator=() handles set properties
+            lastNewAttrs = internTextRunAttrs(std::move(attrs));
+        }
+        r->attrs = lastNewAttrs;
 
         newRunLength -= r->length;
-        newRunStart = r->startIndex + r->length;  // may have continued earlier, can't do 'new += len'
+        newRunStart = runStart(idx) + r->length;  // may have continued earlier, can't do 'new += len'
         idx += 1;
     }
 
+    mTextRuns.runs.reset();
     return *this;
 }
 
 Text& Text::setTextRuns(const std::vector<TextRun>& runs)
 {
-    mRuns = runs;
+    std::vector<Run> newRuns;
+    newRuns.reserve(runs.size());
+    for (auto &r : runs) {
+        TextRun attrs = r;  // copy constructor: does not merge
+        newRuns.push_back({ r.startIndex, r.length, internTextRunAttrs(std::move(attrs)) });
+    }
+    setRuns(std::move(newRuns));
+    return *this;
+}
+
+Text& Text::applyTextRuns(const std::vector<TextRun>& runs)
+{
+    // Clip the runs to the text like setTextRun() does, and make sure that
+    // they are in order.
+    struct Span
+    {
+        int start;
+        int end;
+        const TextRun *run;
+    };
+    std::vector<Span> spans;
+    spans.reserve(runs.size());
+    for (auto &r : runs) {
+        if (r.startIndex < 0 || r.startIndex >= mText.size() || r.length == 0) {
+            continue;
+        }
+        int end = (r.length >= 0) ? std::min(r.startIndex + r.length, int(mText.size()))
+                                  : int(mText.size());
+        if (!spans.empty() && r.startIndex < spans.back().end) {
+            for (auto &run : runs) {
+                setTextRun(run);
+            }
+            return *this;
+        }
+        spans.push_back({ r.startIndex, end, &r });
+    }
+    if (spans.empty()) {
+        return *this;
+    }
+
+    std::vector<Run> newRuns;
+    newRuns.reserve(nRuns() + 2 * spans.size());
+    std::shared_ptr<const TextRun> lastOldAttrs, lastNewAttrs;
+    const TextRun *lastSpanRun = nullptr;
+    size_t spanIdx = 0;
+    for (size_t i = 0;  i < nRuns();  ++i) {
+        auto &r = this->run(i);
+        int pos = runStart(i);
+        int end = pos + r.length;
+        if (pos >= end) {
+            newRuns.push_back({ pos, 0, r.attrs });  // empty run
+            continue;
+        }
+        while (pos < end) {
+            while (spanIdx < spans.size() && spans[spanIdx].end <= pos) {
+                ++spanIdx;
+            }
+            if (spanIdx >= spans.size() || spans[spanIdx].start >= end) {
+                newRuns.push_back({ pos, end - pos, r.attrs });
+                break;
+            }
+            auto &span = spans[spanIdx];
+            if (span.start > pos) {
+                newRuns.push_back({ pos, span.start - pos, r.attrs });
+                pos = span.start;
+            }
+            if (r.attrs != lastOldAttrs || span.run != lastSpanRun) {
+                lastOldAttrs = r.attrs;
+                lastSpanRun = span.run;
+                TextRun attrs = *r.attrs;  // copy constructor, so nothing is merged...
+                attrs = *span.run;         // ... but TextRun::operator=() handles set properties
+                lastNewAttrs = internTextRunAttrs(std::move(attrs));
+            }
+            int spanEnd = std::min(end, span.end);
+            newRuns.push_back({ pos, spanEnd - pos, lastNewAttrs });
+            pos = spanEnd;
+        }
+    }
+
+    setRuns(std::move(newRuns));
+    return *this;
+}
+
+void Text::setRuns(std::vector<Run>&& runs)
+{
+    mRuns = std::move(runs);
+    mGapStart = mGapEnd = mRuns.size();
+    mGapShift = 0;
+    mTextRuns.runs.reset();
+}
+
+void Text::moveGap(size_t i)
+{
+    // Runs that cross the gap change whether mGapShift applies to them
+    if (i < mGapStart) {
+        auto n = mGapStart - i;
+        for (size_t j = i;  j < mGapStart;  ++j) {
+            mRuns[j].startIndex -= mGapShift;
+        }
+        if (mGapEnd > mGapStart) {
+            std::move_backward(mRuns.begin() + i, mRuns.begin() + mGapStart,
+                               mRuns.begin() + mGapEnd);
+        }
+        mGapStart -= n;
+        mGapEnd -= n;
+    } else if (i > mGapStart) {
+        auto n = i - mGapStart;
+        for (size_t j = mGapEnd;  j < mGapEnd + n;  ++j) {
+            mRuns[j].startIndex += mGapShift;
+        }
+        if (mGapEnd > mGapStart) {
+            std::move(mRuns.begin() + mGapEnd, mRuns.begin() + mGapEnd + n,
+                      mRuns.begin() + mGapStart);
+        }
+        mGapStart += n;
+        mGapEnd += n;
+    }
+}
+
+void Text::insertRun(size_t i, Run&& r)
+{
+    if (mGapStart == mGapEnd) {
+        // Grow the gap (at the end, so nothing needs to move), then move it
+        moveGap(mRuns.size());
+        auto n = mRuns.size();
+        mRuns.resize(n + std::max(size_t(16), n));
+        mGapEnd = mRuns.size();
+        mGapShift = 0;
+    }
+    moveGap(i);
+    mRuns[mGapStart++] = std::move(r);
+}
+
+Text& Text::replaceText(int start, int len, const std::string& utf8)
+{
+    start = std::max(0, std::min(start, int(mText.size())));
+    if (len < 0 || start + len > int(mText.size())) {
+        len = int(mText.size()) - start;
+    }
+    int end = start + len;
+    int nInserted = int(utf8.size());
+
+    // The attributes of the run containing start, in case everything is removed
+    int templateIdx = runIndexFor(start);
+    if (templateIdx < 0) {
+        templateIdx = (start >= int(mText.size()) ? int(nRuns()) - 1 : 0);
+    }
+    auto templateAttrs = this->run(templateIdx).attrs;
+    // The inserted text extends the run before start
+    size_t first = (start > 0 ? size_t(runIndexFor(start - 1)) : 0);
+    mText.replace(start, len, utf8);
+
+    // Only the runs overlapping [start, start + len) (and the one before
+    // start) change, so take those out of the gap buffer ...
+    auto removedPos = [start, len](int i) {
+        if (i <= start) {
+            return i;
+        } else if (i < start + len) {
+            return start;
+        }
+        return i - len;
+    };
+    moveGap(first);
+    std::vector<Run> changed;
+    while (mGapEnd < mRuns.size()) {
+        auto &r = mRuns[mGapEnd];
+        int s = r.startIndex + mGapShift;
+        // If start is 0 the inserted text extends the first remaining run
+        if (s >= end && !(start == 0 && changed.empty())) {
+            break;
+        }
+        int newStart = removedPos(s);
+        int newEnd = removedPos(s + r.length);
+        if (newEnd > newStart) {
+            changed.push_back({ newStart, newEnd - newStart, std::move(r.attrs) });
+        }
+        r.attrs.reset();
+        ++mGapEnd;
+    }
+    // ... move all the following runs at once ...
+    mGapShift += nInserted - len;
+
+    // ... and put the changed runs back, extending the first one to cover
+    // the inserted text.
+    if (changed.empty()) {  // everything was removed
+        changed.push_back({ 0, 0, templateAttrs });
+    }
+    changed[0].length += nInserted;
+    for (size_t i = 1;  i < changed.size();  ++i) {
+        changed[i].startIndex += nInserted;
+    }
+    for (auto &r : changed) {
+        insertRun(mGapStart, std::move(r));
+    }
+
+    mTextRuns.runs.reset();
     return *this;
 }
 
-const TextRun& Text::runAt(int index) const
+TextRun Text::runAt(int index) const
 {
+    assert(nRuns() > 0);
     int idx = runIndexFor(index);
     if (idx < 0) {
-        if (index >= mText.size()) {
-            return mRuns.back();
-        }
-        return mRuns[0];
+        idx = (index >= int(mText.size()) ? int(nRuns()) - 1 : 0);
     }
-    return mRuns[idx];
+    TextRun r = *run(size_t(idx)).attrs;  // copy constructor: does not merge
+    r.startIndex = runStart(size_t(idx));
+    r.length = run(size_t(idx)).length;
+    return r;
 }
 
 int Text::runIndexFor(int index) const
@@ -1100,22 +1499,65 @@ int Text::runIndexFor(int index) const
         return -1;
     }
 
-    auto less = [](const TextRun& lhs, const TextRun& rhs) -> bool {
-        return lhs.startIndex < rhs.startIndex;
-    };
-    TextRun r;
-    r.startIndex = index;
-    auto it = std::upper_bound(mRuns.begin(), mRuns.end(), r, less);
-    // 'it' is the iterator pointing to the run greater than index,
-    // that is, the *next* run. So we need to go backwards one.
-    assert(it != mRuns.begin());  // we did this check first thing
-    it--;
-    return int(it - mRuns.begin());
+    // Find the first run greater than index, that is, the *next* run.
+    // So we need to go backwards one.
+    size_t lo = 0, hi = nRuns();
+    while (lo < hi) {
+        auto mid = (lo + hi) / 2;
+        if (runStart(mid) <= index) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    assert(lo > 0);  // we did this check first thing
+    return int(lo) - 1;
 }
 
 const std::vector<TextRun>& Text::runs() const
 {
-    return mRuns;
+    auto textRuns = std::atomic_load(&mTextRuns.runs);
+    if (!textRuns) {
+        std::vector<TextRun> created;
+        created.reserve(nRuns());
+        for (size_t i = 0;  i < nRuns();  ++i) {
+            auto &r = run(i);
+            created.push_back(*r.attrs);  // copy constructor: does not merge
+            created.back().startIndex = runStart(i);
+            created.back().length = r.length;
+        }
+        // If another thread created it first, use that one, since the
+        // caller's reference must stay valid until the text changes.
+        std::shared_ptr<const std::vector<TextRun>> desired = std::make_shared<std::vector<TextRun>>(std::move(created));
+        if (std::atomic_compare_exchange_strong(&mTextRuns.runs, &textRuns, desired)) {
+            textRuns = desired;
+        }
+    }
+    return *textRuns;
+}
+
+std::vector<TextRun> Text::runsInRange(int start, int len) const
+{
+    std::vector<TextRun> inRange;
+    int end = (len < 0 ? int(mText.size()) : std::min(start + len, int(mText.size())));
+    int idx = runIndexFor(start);
+    if (idx < 0 || end <= start) {
+        return inRange;
+    }
+    for (size_t i = size_t(idx);  i < nRuns();  ++i) {
+        int s = runStart(i);
+        if (s >= end) {
+            break;
+        }
+        int e = std::min(s + run(i).length, end);
+        s = std::max(s, start);
+        if (e > s) {
+            inRange.push_back(*run(i).attrs);  // copy constructor: does not merge
+            inRange.back().startIndex = s;
+            inRange.back().length = e - s;
+        }
+    }
+    return inRange;
 }
 
 Text& Text::setLineHeightMultiple(float factor)
@@ -1137,7 +1579,8 @@ const PicaPt& Text::indent() const { return mParagraph.indent; }
 //-----------------------------------------------------------------------------
 const TextLayout::Glyph* TextLayout::glyphAtPoint(const Point& p) const
 {
-    // TODO: can we do binary search?
+    // This does not cache anything, so a linear search is the best we can do.
+    // Implementations should override using createLineIndex().
     for (auto &glyph : glyphs()) {
         if (glyph.frame.contains(p)) {
             return &glyph;
@@ -1146,22 +1589,34 @@ const TextLayout::Glyph* TextLayout::glyphAtPoint(const Point& p) const
     return nullptr;
 }
 
+bool TextLayout::glyphAtPoint(const Point& p, Glyph *glyph) const
+{
+    for (auto g : glyphRange()) {
+        if (g.frame.contains(p)) {
+            *glyph = g;
+            return true;
+        }
+    }
+    return false;
+}
+
 Point TextLayout::pointAtIndex(long index) const
 {
-    auto &glyphs = this->glyphs();
+    auto glyphs = glyphRange();
     if (glyphs.empty()) {
         return Point(PicaPt::kZero, PicaPt::kZero);
     }
 
-    if (index >= glyphs.back().indexOfNext) {
-        return glyphs.back().frame.upperRight();
+    auto last = glyphs[glyphs.size() - 1];
+    if (index >= last.indexOfNext) {
+        return last.frame.upperRight();
     }
     
     if (index < 0) {
         index = 0;
     }
 
-    return glyphAtIndex(index)->frame.upperLeft();
+    return glyphs[glyphIndexAtIndex(index)].frame.upperLeft();
 }
 
 const TextLayout::Glyph* TextLayout::glyphAtIndex(long index) const
@@ -1180,15 +1635,16 @@ long TextLayout::glyphIndexAtIndex(long index) const
         return 0;
     }
 
-    auto &glyphs = this->glyphs();
+    auto glyphs = glyphRange();
     // Binary search (easier this way than to shoehorn into a custom compare for std::binary_search())
     size_t left = 0;
     size_t right = glyphs.size() - 1;
     while (left <= right) {
         auto m = (left + right) / 2;
-        if (glyphs[m].indexOfNext <= index) {
+        auto g = glyphs[m];
+        if (g.indexOfNext <= index) {
             left = m + 1;
-        } else if (glyphs[m].index > index) {
+        } else if (g.index > index) {
             right = m - 1;
         } else {
             return m;
@@ -1197,6 +1653,202 @@ long TextLayout::glyphIndexAtIndex(long index) const
     return -1;
 }
 
+TextLayout::GlyphRange TextLayout::glyphRange() const
+{
+    return GlyphRange(glyphs());
+}
+
+void TextLayout::CompactGlyphs::push_back(const Glyph& g)
+{
+    if (mSegments.empty() || mSegments.back().line != g.line
+        || mSegments.back().y != g.frame.y
+        || mSegments.back().height != g.frame.height) {
+        mSegments.push_back({ long(mIndex.size()), g.line, g.frame.y, g.frame.height });
+    }
+    mX.push_back(g.frame.x);
+    mWidth.push_back(g.frame.width);
+    mIndex.push_back(int(g.index));
+    mEndIndex = g.indexOfNext;
+}
+
+void TextLayout::CompactGlyphs::clear()
+{
+    // clear() does not release memory
+    mSegments.clear();
+    mSegments.shrink_to_fit();
+    mX.clear();
+    mX.shrink_to_fit();
+    mWidth.clear();
+    mWidth.shrink_to_fit();
+    mIndex.clear();
+    mIndex.shrink_to_fit();
+    mEndIndex = 0;
+}
+
+size_t TextLayout::CompactGlyphs::segmentFor(long i) const
+{
+    auto it = std::upper_bound(mSegments.begin(), mSegments.end(), i,
+                               [](long i, const Segment& seg) {
+                                   return i < seg.firstGlyph;
+                               });
+    assert(it != mSegments.begin());
+    return size_t(it - mSegments.begin()) - 1;
+}
+
+TextLayout::Glyph TextLayout::CompactGlyphs::glyph(long i, size_t seg) const
+{
+    auto &s = mSegments[seg];
+    Glyph g(mIndex[i], s.line, Rect(mX[i], s.y, mWidth[i], s.height));
+    g.indexOfNext = (i + 1 < size() ? long(mIndex[i + 1]) : mEndIndex);
+    return g;
+}
+
+TextLayout::Glyph TextLayout::CompactGlyphs::operator[](long i) const
+{
+    return glyph(i, segmentFor(i));
+}
+
+long TextLayout::GlyphRange::size() const
+{
+    return (mCompact ? mCompact->size() : long(mGlyphs->size()));
+}
+
+TextLayout::Glyph TextLayout::GlyphRange::operator[](long i) const
+{
+    return (mCompact ? (*mCompact)[i] : (*mGlyphs)[i]);
+}
+
+TextLayout::GlyphRange::const_iterator::const_iterator(const GlyphRange *range, long idx)
+    : mRange(range), mIdx(idx)
+{
+}
+
+TextLayout::Glyph TextLayout::GlyphRange::const_iterator::operator*() const
+{
+    if (mRange->mCompact) {
+        return mRange->mCompact->glyph(mIdx, mSeg);
+    }
+    return (*mRange->mGlyphs)[mIdx];
+}
+
+TextLayout::GlyphRange::const_iterator& TextLayout::GlyphRange::const_iterator::operator++()
+{
+    ++mIdx;
+    // Iterating sequentially, so the segment is either the same or the next
+    if (auto *compact = mRange->mCompact) {
+        while (mSeg + 1 < compact->nSegments()
+               && compact->segmentStart(mSeg + 1) <= mIdx) {
+            ++mSeg;
+        }
+    }
+    return *this;
+}
+
+bool TextLayout::recolor(const Text& text)
+{
+    return false;
+}
+
+bool TextLayout::drawComposite(DrawContext& dc, const Point& topLeft) const
+{
+    return false;
+}
+
+std::vector<TextLayout::LineIndex> TextLayout::createLineIndex(
+                                        const GlyphRange& glyphs)
+{
+    std::vector<LineIndex> lines;
+    PicaPt maxY;
+    long i = 0;
+    Glyph prev;
+    for (auto g : glyphs) {  // sequential access is fast for compact glyphs
+        if (lines.empty() || g.line != prev.line) {
+            if (!lines.empty()) {
+                maxY = lines.back().maxY;
+            }
+            lines.push_back({ g.frame.minY(), std::max(maxY, g.frame.maxY()),
+                              i, i + 1, true });
+        } else {
+            auto &line = lines.back();
+            line.minY = std::min(line.minY, g.frame.minY());
+            line.maxY = std::max(line.maxY, g.frame.maxY());
+            line.endGlyph = i + 1;
+            if (g.frame.x < prev.frame.x) {
+                line.isSortedByX = false;
+            }
+        }
+        prev = g;
+        ++i;
+    }
+
+    // Lines should be in increasing y, but if not (or if line spacing makes
+    // them overlap) the binary search would miss lines, so use one line
+    // for everything and fall back to a linear search.
+    for (size_t i = 1;  i < lines.size();  ++i) {
+        if (lines[i].minY < lines[i - 1].minY) {
+            LineIndex all = { lines[0].minY, lines.back().maxY, 0, long(glyphs.size()), false };
+            for (auto &line : lines) {
+                all.minY = std::min(all.minY, line.minY);
+            }
+            return { all };
+        }
+    }
+    return lines;
+}
+
+long TextLayout::findGlyphAtPoint(const GlyphRange& glyphs,
+                                  const std::vector<LineIndex>& lines,
+                                  const Point& p)
+{
+    // Lines that might contain p are after the last line whose maxY
+    // (which is cumulative, so increasing) is above p, and before the first
+    // line whose top is below p. This is usually just one line.
+    auto firstLine = std::lower_bound(lines.begin(), lines.end(), p.y,
+                                      [](const LineIndex& line, const PicaPt& y) {
+                                          return line.maxY < y;
+                                      });
+    auto endLine = std::upper_bound(firstLine, lines.end(), p.y,
+                                    [](const PicaPt& y, const LineIndex& line) {
+                                        return y < line.minY;
+                                    });
+    for (auto line = firstLine;  line != endLine;  ++line) {
+        if (!line->isSortedByX) {
+            for (long i = line->firstGlyph;  i < line->endGlyph;  ++i) {
+                if (glyphs[i].frame.contains(p)) {
+                    return i;
+                }
+            }
+            continue;
+        }
+
+        // Find the last glyph starting at or before p.x; since frames share
+        // edges (and zero-width glyphs are at the edge), the previous glyphs
+        // may also contain p, and the earliest one wins.
+        long lo = line->firstGlyph, hi = line->endGlyph;
+        while (lo < hi) {
+            long mid = (lo + hi) / 2;
+            if (p.x < glyphs[mid].frame.x) {
+                hi = mid;
+            } else {
+                lo = mid + 1;
+            }
+        }
+        long found = -1;
+        for (long i = lo - 1;  i >= line->firstGlyph;  --i) {
+            auto g = glyphs[i];
+            if (g.frame.contains(p)) {
+                found = i;
+            } else if (g.frame.maxX() < p.x && g.frame.width > PicaPt::kZero) {
+                break;
+            }
+        }
+        if (found >= 0) {
+            return found;
+        }
+    }
+    return -1;
+}
+
 Font::Metrics TextLayout::calcFirstLineMetrics(
                             const std::vector<Font::Metrics>& runMetrics,
                             const std::vector<TextRun>& runs,
@@ -1228,7 +1880,7 @@ Font::Metrics TextLayout::calcFirstLineMetrics(
     // Ok, we have different size fonts, so we need to get the glyphs so that
     // we know where the line breaks are.
     Font::Metrics firstLineMetrics = runMetrics[0];
-    auto &glyphs = this->glyphs();
+    auto glyphs = glyphRange();
     // we can assume at least two characters (how else can we get two runs?)
     assert(glyphs.size() >= 2);
 
@@ -1237,10 +1889,10 @@ Font::Metrics TextLayout::calcFirstLineMetrics(
         firstLineEndIdx = firstLineLength - 1;
     } else {
         firstLineEndIdx = 0;
-        PicaPt minNewLineY = glyphs[0].frame.maxY();
-        while (firstLineEndIdx < int(glyphs.size())
-                && glyphs[firstLineEndIdx].line == 0) {
+        auto it = glyphs.begin();
+        while (it != glyphs.end() && (*it).line == 0) {
             ++firstLineEndIdx;
+            ++it;
         }
         firstLineEndIdx -= 1;
     }
@@ -1322,38 +1974,705 @@ Point TextLayout::calcOffsetForAlignment(int alignment, const Size &size,
 }
 
 //-----------------------------------------------------------------------------
-BezierPath::BezierPath()
-    : mImpl(new BezierPath::Impl())
-{
-}
-
-BezierPath::~BezierPath()
+struct EditableTextLayout::Impl
 {
-}
+    struct Paragraph
+    {
+        long start = 0;   // index into the text
+        long length = 0;  // does not include the '\n'
+        uint64_t id = 0;  // key into the layout cache
+        bool isMeasured = false;  // if false, the size and nLines are estimates
+        PicaPt width;
+        PicaPt height;
+        int nLines = 1;
+        // These are only valid if the glyphs are valid
+        int firstLine = 0;
+        long firstGlyph = 0;
+        long nGlyphs = 0;
+    };
 
-void BezierPath::moveTo(const Point& p)
-{
-    clearNative();
-    mImpl->commands.emplace_back(BezierPath::Impl::Command::kMoveTo, p);
-}
+    struct CachedLayout
+    {
+        std::shared_ptr<TextLayout> layout;  // of " " if empty, for the height
+        std::list<uint64_t>::iterator lruIt;
+    };
 
-void BezierPath::lineTo(const Point& end)
-{
-    clearNative();
-    mImpl->commands.emplace_back(BezierPath::Impl::Command::kLineTo, end);
-}
+    // The sums of a value of the paragraphs (their heights or line counts),
+    // so that the y of a paragraph and the paragraph at a y take O(log n),
+    // even when an edit or a layout changes a height near the top of long
+    // text. This is a binary tree in an array: paragraph i is the leaf
+    // nLeaves + i, and each node is the sum of its children. So the sums only
+    // depend on the values, not on the order in which they were changed, and
+    // an edited layout has exactly the same y values as a new layout of the
+    // same text.
+    template <typename T, T Paragraph::*kValue>
+    struct SumTree
+    {
+        std::vector<T> sums;
+        size_t nLeaves = 0;
 
-void BezierPath::quadraticTo(const Point& cp1, const Point& end)
-{
-    clearNative();
-    mImpl->commands.emplace_back(BezierPath::Impl::Command::kQuadraticTo, cp1, end);
-}
+        void build(const std::vector<Paragraph>& paras)
+        {
+            nLeaves = 1;
+            while (nLeaves < paras.size()) {
+                nLeaves *= 2;
+            }
+            sums.assign(2 * nLeaves, T());
+            for (size_t i = 0;  i < paras.size();  ++i) {
+                sums[nLeaves + i] = paras[i].*kValue;
+            }
+            for (size_t node = nLeaves - 1;  node >= 1;  --node) {
+                sums[node] = sums[2 * node] + sums[2 * node + 1];
+            }
+        }
 
-void BezierPath::cubicTo(const Point& cp1, const Point& cp2, const Point& end)
-{
-    clearNative();
-    mImpl->commands.emplace_back(BezierPath::Impl::Command::kCubicTo, cp1, cp2, end);
-}
+        void set(size_t i, const T& value)
+        {
+            size_t node = nLeaves + i;
+            sums[node] = value;
+            for (node /= 2;  node >= 1;  node /= 2) {
+                sums[node] = sums[2 * node] + sums[2 * node + 1];
+            }
+        }
+
+        // Returns the sum of the values of paragraphs [0, i)
+        T sumBefore(size_t i) const
+        {
+            T sum = T();
+            size_t node = 1, first = 0, width = nLeaves;
+            while (node < nLeaves) {
+                width /= 2;
+                if (i >= first + width) {
+                    sum += sums[2 * node];
+                    first += width;
+                    node = 2 * node + 1;
+                } else {
+                    node = 2 * node;
+                }
+            }
+            return (i > first ? sum + sums[node] : sum);
+        }
+
+        // Returns the last paragraph i where sumBefore(i) <= value
+        size_t indexAt(const T& value, size_t nParagraphs) const
+        {
+            T before = T();
+            size_t node = 1;
+            while (node < nLeaves) {
+                auto leftEnd = before + sums[2 * node];
+                if (value < leftEnd) {
+                    node = 2 * node;
+                } else {
+                    before = leftEnd;
+                    node = 2 * node + 1;
+                }
+            }
+            return std::min(node - nLeaves, nParagraphs - 1);
+        }
+    };
+
+    const DrawContext *dc;
+    Text text;
+    Size size;
+    int alignment;
+    TextWrapping wrap;
+    int maxLayouts;  // kLayoutAll for no limit
+    uint64_t nextId = 1;
+    PicaPt estLineHeight;
+    PicaPt estCharWidth;
+
+    // Paragraphs are mutable because their size is only known once they are
+    // laid out. heights and lines must be updated whenever a height or number
+    // of lines changes.
+    mutable std::vector<Paragraph> paragraphs;
+    mutable SumTree<PicaPt, &Paragraph::height> heights;
+    mutable SumTree<int, &Paragraph::nLines> lines;
+    mutable std::unordered_map<uint64_t, CachedLayout> layouts;
+    mutable std::list<uint64_t> lru;  // most recently used first
+
+    mutable TextMetrics metrics;
+    mutable bool metricsValid = false;
+    mutable std::vector<Glyph> glyphs;
+    mutable bool glyphsValid = false;
+
+    bool isLazy() const { return (maxLayouts != kLayoutAll); }
+
+    // Splits [start, end) into paragraphs; start must be the start of a
+    // paragraph and end must be the end of one (not including the '\n').
+    std::vector<Paragraph> split(long start, long end)
+    {
+        std::vector<Paragraph> paras;
+        auto &str = text.text();
+        while (true) {
+            auto nl = str.find('\n', start);
+            paras.emplace_back();
+            auto &p = paras.back();
+            p.start = start;
+            p.id = nextId++;
+            if (nl == std::string::npos || long(nl) >= end) {
+                p.length = end - start;
+            } else {
+                p.length = long(nl) - start;
+            }
+            estimate(p);
+            if (p.start + p.length >= end) {
+                break;
+            }
+            start = long(nl) + 1;
+        }
+        return paras;
+    }
+
+    void estimate(Paragraph& p) const
+    {
+        p.isMeasured = false;
+        p.width = float(p.length) * estCharWidth;
+        p.nLines = 1;
+        if (size.width > PicaPt::kZero && wrap != kWrapNone && p.width > size.width) {
+            p.nLines = int(std::ceil(p.width / size.width));
+            p.width = size.width;
+        }
+        p.height = float(p.nLines) * estLineHeight;
+    }
+
+    Text paragraphText(const Paragraph& p) const
+    {
+        std::vector<TextRun> runs;
+        if (p.length == 0) {
+            runs.push_back(text.runAt(int(p.start)));
+            runs.back().startIndex = 0;
+            runs.back().length = 1;
+        } else {
+            runs = text.runsInRange(int(p.start), int(p.length));
+            for (auto &r : runs) {
+                r.startIndex -= int(p.start);
+            }
+        }
+        // Note that assigning runs merges them (see TextAttr), so construct
+        // a new Text rather than assigning to an existing one.
+        Text t((p.length == 0 ? std::string(" ") : text.text().substr(p.start, p.length)),
+               Font(), Color::kBlack);
+        t.setTextRuns(runs);
+        t.setLineHeightMultiple(text.lineHeightMultiple());
+        t.setIndent(text.indent());
+        return t;
+    }
+
+    // Returns the layout of the paragraph, laying it out if it is not cached.
+    std::shared_ptr<TextLayout> layoutFor(int i) const
+    {
+        auto &p = paragraphs[i];
+        auto it = layouts.find(p.id);
+        if (it != layouts.end()) {
+            lru.splice(lru.begin(), lru, it->second.lruIt);
+            return it->second.layout;
+        }
+
+        auto layout = dc->createTextLayout(paragraphText(p), size, alignment, wrap);
+        auto &tm = layout->metrics();
+        auto width = (p.length > 0 ? tm.width : PicaPt::kZero);
+        int nLines = 1;
+        if (p.length > 0) {
+            auto glyphs = layout->glyphRange();
+            if (!glyphs.empty()) {
+                nLines = glyphs[glyphs.size() - 1].line + 1;
+            }
+        }
+        if (!p.isMeasured || p.width != width || p.height != tm.height || p.nLines != nLines) {
+            if (p.height != tm.height) {
+                heights.set(size_t(i), tm.height);
+            }
+            if (p.nLines != nLines) {
+                lines.set(size_t(i), nLines);
+            }
+            p.width = width;
+            p.height = tm.height;
+            p.nLines = nLines;
+            p.isMeasured = true;
+            metricsValid = false;
+        }
+
+        lru.push_front(p.id);
+        layouts[p.id] = { layout, lru.begin() };
+        if (maxLayouts != kLayoutAll) {
+            while (int(layouts.size()) > maxLayouts) {
+                layouts.erase(lru.back());
+                lru.pop_back();
+            }
+        }
+        return layout;
+    }
+
+    void forgetLayout(uint64_t id)
+    {
+        auto it = layouts.find(id);
+        if (it != layouts.end()) {
+            lru.erase(it->second.lruIt);
+            layouts.erase(it);
+        }
+    }
+
+    PicaPt yOf(int i) const
+    {
+        return heights.sumBefore(size_t(i));
+    }
+
+    int paragraphAtY(const PicaPt& y) const
+    {
+        return int(heights.indexAt(y, paragraphs.size()));
+    }
+
+    int firstLineOf(int i) const
+    {
+        return lines.sumBefore(size_t(i));
+    }
+
+    // Returns the first paragraph that may contain a glyph at y: glyphs
+    // contain their edges, so the paragraph above may end exactly at y.
+    int firstParagraphAtY(const PicaPt& y) const
+    {
+        int i = paragraphAtY(y);
+        return ((i > 0 && y <= yOf(i)) ? i - 1 : i);
+    }
+
+    int paragraphAtIndex(long index) const
+    {
+        auto it = std::upper_bound(paragraphs.begin(), paragraphs.end(), index,
+                                   [](long idx, const Paragraph& p) {
+                                       return idx < p.start;
+                                   });
+        if (it == paragraphs.begin()) {
+            return 0;
+        }
+        return int(it - paragraphs.begin()) - 1;
+    }
+
+    // Appends the glyphs of the paragraph, and of its '\n', if it has one.
+    // The paragraph's firstLine must be correct.
+    void appendGlyphs(int i, bool isLast, std::vector<Glyph> *out) const
+    {
+        auto layout = layoutFor(i);
+        auto y = yOf(i);
+        auto &p = paragraphs[i];
+        p.firstGlyph = long(out->size());
+        if (p.length > 0) {
+            // Not glyphs(), which would keep a copy in the paragraph's layout
+            auto pglyphs = layout->glyphRange();
+            for (auto g : pglyphs) {
+                out->push_back(g);
+                auto &newG = out->back();
+                newG.index += p.start;
+                newG.indexOfNext += p.start;
+                newG.line += p.firstLine;
+                newG.frame.y += y;
+            }
+        }
+        if (!isLast) {
+            auto *last = (long(out->size()) > p.firstGlyph ? &out->back() : nullptr);
+            out->push_back(newlineGlyph(i, last, y, p.firstLine));
+        }
+        p.nGlyphs = long(out->size()) - p.firstGlyph;
+    }
+
+    // Returns the glyph for the '\n' at the end of paragraph i, which is after
+    // `last`, the last glyph of the paragraph (or nullptr if it has none).
+    // Like other layouts, newlines have a zero-width glyph at the end of the
+    // line.
+    Glyph newlineGlyph(int i, const Glyph *last, const PicaPt& y, int firstLine) const
+    {
+        auto &p = paragraphs[i];
+        Rect r(PicaPt::kZero, y, PicaPt::kZero, p.height);
+        if (last) {
+            r = last->frame;
+            r.x = r.maxX();
+            r.width = PicaPt::kZero;
+        }
+        Glyph g(p.start + p.length, firstLine + p.nLines - 1, r);
+        g.indexOfNext = p.start + p.length + 1;
+        return g;
+    }
+
+    // Hit-tests only paragraph i (and its '\n'), returning the glyph as it
+    // would be in glyphs(), but without needing them.
+    bool glyphAtPoint(int i, const Point& pt, Glyph *glyph) const
+    {
+        auto layout = layoutFor(i);
+        auto y = yOf(i);
+        auto firstLine = firstLineOf(i);
+        auto &p = paragraphs[i];
+        if (p.length > 0 && layout->glyphAtPoint(Point(pt.x, pt.y - y), glyph)) {
+            glyph->index += p.start;
+            glyph->indexOfNext += p.start;
+            glyph->line += firstLine;
+            glyph->frame.y += y;
+            return true;
+        }
+        if (i < int(paragraphs.size()) - 1) {
+            Glyph last;
+            auto glyphs = layout->glyphRange();
+            if (p.length > 0 && !glyphs.empty()) {
+                last = glyphs[glyphs.size() - 1];
+                last.frame.y += y;
+            }
+            auto nl = newlineGlyph(i, (p.length > 0 && !glyphs.empty() ? &last : nullptr),
+                                   y, firstLine);
+            if (nl.frame.contains(pt)) {
+                *glyph = nl;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void layoutAll()
+    {
+        layouts.clear();
+        lru.clear();
+        if (isLazy()) {
+            // Estimate the size of paragraphs that have not been laid out
+            // from the size of an 'x' in the first run.
+            auto run = text.runAt(0);
+            run.startIndex = 0;
+            run.length = 1;
+            Text x("x", Font(), Color::kBlack);
+            x.setTextRuns({ run });
+            auto tm = dc->createTextLayout(x)->metrics();
+            estLineHeight = tm.height;
+            estCharWidth = tm.width;
+        }
+        paragraphs = split(0, long(text.text().size()));
+        heights.build(paragraphs);
+        lines.build(paragraphs);
+        if (!isLazy()) {
+            for (int i = 0;  i < int(paragraphs.size());  ++i) {
+                layoutFor(i);
+            }
+        }
+        metricsValid = false;
+        glyphs.clear();
+        glyphs.shrink_to_fit();
+        glyphsValid = false;
+    }
+
+    void replace(long start, long len, const std::string& utf8)
+    {
+        long textLen = long(text.text().size());
+        start = std::max(0L, std::min(start, textLen));
+        if (len < 0 || start + len > textLen) {
+            len = textLen - start;
+        }
+
+        int p0 = paragraphAtIndex(start);
+        int p1 = paragraphAtIndex(start + len);
+        bool includesLast = (p1 == int(paragraphs.size()) - 1);
+        long regionStart = paragraphs[p0].start;
+        long regionEnd = paragraphs[p1].start + paragraphs[p1].length;
+        int firstLine = paragraphs[p0].firstLine;
+        long g0 = paragraphs[p0].firstGlyph;
+        long oldGlyphEnd = paragraphs[p1].firstGlyph + paragraphs[p1].nGlyphs;
+        PicaPt oldHeight;
+        int oldLines = 0;
+        for (int i = p0;  i <= p1;  ++i) {
+            oldHeight += paragraphs[i].height;
+            oldLines += paragraphs[i].nLines;
+            forgetLayout(paragraphs[i].id);
+        }
+
+        text.replaceText(int(start), int(len), utf8);
+        long dIndex = long(utf8.size()) - len;
+        for (size_t i = p1 + 1;  i < paragraphs.size();  ++i) {
+            paragraphs[i].start += dIndex;
+        }
+
+        auto newParas = split(regionStart, regionEnd + dIndex);
+        int nNew = int(newParas.size());
+        paragraphs.erase(paragraphs.begin() + p0, paragraphs.begin() + p1 + 1);
+        paragraphs.insert(paragraphs.begin() + p0, newParas.begin(), newParas.end());
+        if (nNew == p1 - p0 + 1) {  // usual case when typing
+            for (int i = p0;  i < p0 + nNew;  ++i) {
+                heights.set(size_t(i), paragraphs[i].height);
+                lines.set(size_t(i), paragraphs[i].nLines);
+            }
+        } else {
+            // Adding or removing paragraphs already moves all the following
+            // ones, so rebuilding is not any worse.
+            heights.build(paragraphs);
+            lines.build(paragraphs);
+        }
+        metricsValid = false;
+
+        // Lay out the new paragraphs (lazy layouts wait until they are needed,
+        // unless the glyphs need updating).
+        if (isLazy() && !glyphsValid) {
+            return;
+        }
+        PicaPt newHeight;
+        int line = firstLine;
+        std::vector<Glyph> newGlyphs;
+        for (int i = p0;  i < p0 + nNew;  ++i) {
+            layoutFor(i);
+            if (glyphsValid) {
+                paragraphs[i].firstLine = line;
+                appendGlyphs(i, includesLast && i == p0 + nNew - 1, &newGlyphs);
+                paragraphs[i].firstGlyph += g0;
+                line += paragraphs[i].nLines;
+            }
+            newHeight += paragraphs[i].height;
+        }
+
+        if (glyphsValid) {
+            PicaPt dy = newHeight - oldHeight;
+            int dLines = line - (firstLine + oldLines);
+            long dGlyphs = long(newGlyphs.size()) - (oldGlyphEnd - g0);
+            glyphs.erase(glyphs.begin() + g0, glyphs.begin() + oldGlyphEnd);
+            glyphs.insert(glyphs.begin() + g0, newGlyphs.begin(), newGlyphs.end());
+            for (size_t i = size_t(g0 + long(newGlyphs.size()));  i < glyphs.size();  ++i) {
+                auto &g = glyphs[i];
+                g.index += dIndex;
+                g.indexOfNext += dIndex;
+                g.line += dLines;
+                g.frame.y += dy;
+            }
+            for (size_t i = p0 + nNew;  i < paragraphs.size();  ++i) {
+                paragraphs[i].firstLine += dLines;
+                paragraphs[i].firstGlyph += dGlyphs;
+            }
+        }
+    }
+};
+
+const int EditableTextLayout::kLayoutAll;
+
+EditableTextLayout::EditableTextLayout(const DrawContext& dc, const Text& text,
+                                       const PicaPt& width /*= PicaPt::kZero*/,
+                                       int alignment /*= Alignment::kLeft*/,
+                                       TextWrapping wrap /*= kWrapWord*/,
+                                       int maxLaidOutParagraphs /*= kLayoutAll*/)
+    : mImpl(new EditableTextLayout::Impl())
+{
+    mImpl->dc = &dc;
+    mImpl->text = Text(text);  // move, so that the runs are not merged
+    mImpl->size = Size(width, PicaPt::kZero);
+    mImpl->alignment = (alignment & Alignment::kHorizMask) | Alignment::kTop;
+    mImpl->wrap = wrap;
+    mImpl->maxLayouts = (maxLaidOutParagraphs == kLayoutAll ? kLayoutAll
+                                                            : std::max(1, maxLaidOutParagraphs));
+    mImpl->layoutAll();
+}
+
+EditableTextLayout::~EditableTextLayout()
+{
+}
+
+const Text& EditableTextLayout::text() const { return mImpl->text; }
+
+void EditableTextLayout::setText(const Text& text)
+{
+    mImpl->text = Text(text);  // move, so that the runs are not merged
+    mImpl->layoutAll();
+}
+
+void EditableTextLayout::replace(long start, long len, const std::string& utf8)
+{
+    mImpl->replace(start, len, utf8);
+}
+
+void EditableTextLayout::insert(long index, const std::string& utf8)
+{
+    mImpl->replace(index, 0, utf8);
+}
+
+void EditableTextLayout::remove(long start, long len)
+{
+    mImpl->replace(start, len, "");
+}
+
+int EditableTextLayout::paragraphCount() const
+{
+    return int(mImpl->paragraphs.size());
+}
+
+PicaPt EditableTextLayout::paragraphY(int paragraph) const
+{
+    return mImpl->yOf(paragraph);
+}
+
+PicaPt EditableTextLayout::paragraphHeight(int paragraph) const
+{
+    return mImpl->paragraphs[paragraph].height;
+}
+
+int EditableTextLayout::paragraphAtIndex(long index) const
+{
+    return mImpl->paragraphAtIndex(index);
+}
+
+int EditableTextLayout::paragraphAtY(const PicaPt& y) const
+{
+    return mImpl->paragraphAtY(y);
+}
+
+std::vector<PicaPt> EditableTextLayout::lineYs(int paragraph) const
+{
+    auto layout = mImpl->layoutFor(paragraph);
+    auto y = mImpl->yOf(paragraph);
+    std::vector<PicaPt> ys = { y };
+    if (mImpl->paragraphs[paragraph].length > 0) {
+        int line = 0;
+        for (auto g : layout->glyphRange()) {
+            if (g.line != line) {
+                line = g.line;
+                ys.push_back(y + g.frame.y);
+            }
+        }
+    }
+    return ys;
+}
+
+const TextLayout::Glyph* EditableTextLayout::glyphAtPoint(const Point& p) const
+{
+    // glyphs() lays out everything, which may change the heights, so find
+    // the paragraphs afterwards. Only their glyphs can contain p.
+    auto &glyphs = this->glyphs();
+    int last = paragraphAtY(p.y);
+    for (int i = mImpl->firstParagraphAtY(p.y);  i <= last;  ++i) {
+        auto &para = mImpl->paragraphs[i];
+        for (long g = para.firstGlyph;  g < para.firstGlyph + para.nGlyphs;  ++g) {
+            if (glyphs[g].frame.contains(p)) {
+                return &glyphs[g];
+            }
+        }
+    }
+    return nullptr;
+}
+
+bool EditableTextLayout::glyphAtPoint(const Point& p, Glyph *glyph) const
+{
+    if (mImpl->glyphsValid) {
+        auto *g = glyphAtPoint(p);
+        if (g) {
+            *glyph = *g;
+        }
+        return (g != nullptr);
+    }
+
+    // Only lay out the paragraphs at p
+    int last = paragraphAtY(p.y);
+    for (int i = mImpl->firstParagraphAtY(p.y);  i <= last;  ++i) {
+        if (mImpl->glyphAtPoint(i, p, glyph)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+const TextMetrics& EditableTextLayout::metrics() const
+{
+    if (!mImpl->metricsValid) {
+        auto &paras = mImpl->paragraphs;
+        auto &tm = mImpl->metrics;
+        tm.width = PicaPt::kZero;
+        for (auto &p : paras) {
+            tm.width = std::max(tm.width, p.width);
+        }
+        tm.height = mImpl->yOf(int(paras.size()) - 1) + paras.back().height;
+        tm.advanceX = tm.width;
+        if (paras.size() > 1 || mImpl->layoutFor(0)->metrics().advanceY > PicaPt::kZero) {
+            tm.advanceY = tm.height;
+        } else {
+            tm.advanceY = PicaPt::kZero;
+        }
+        mImpl->metricsValid = true;
+    }
+    return mImpl->metrics;
+}
+
+const std::vector<TextLayout::Glyph>& EditableTextLayout::glyphs() const
+{
+    if (!mImpl->glyphsValid) {
+        auto &paras = mImpl->paragraphs;
+        int line = 0;
+        for (size_t i = 0;  i < paras.size();  ++i) {
+            paras[i].firstLine = line;
+            mImpl->appendGlyphs(int(i), (i == paras.size() - 1), &mImpl->glyphs);
+            line += paras[i].nLines;
+        }
+        mImpl->glyphsValid = true;
+    }
+    return mImpl->glyphs;
+}
+
+void EditableTextLayout::draw(DrawContext& dc, const Point& topLeft) const
+{
+    for (int i = 0;  i < paragraphCount();  ++i) {
+        if (mImpl->paragraphs[i].length > 0) {
+            auto layout = mImpl->layoutFor(i);
+            dc.drawText(*layout, Point(topLeft.x, topLeft.y + mImpl->yOf(i)));
+        }
+    }
+}
+
+void EditableTextLayout::draw(DrawContext& dc, const Point& topLeft,
+                              const Rect& visible) const
+{
+    int n = paragraphCount();
+    for (int i = paragraphAtY(visible.minY());  i < n;  ++i) {
+        // Note that laying out a paragraph may change its height (if it was
+        // estimated), which moves the following paragraphs.
+        auto y = mImpl->yOf(i);
+        if (y >= visible.maxY()) {
+            break;
+        }
+        auto layout = mImpl->layoutFor(i);
+        if (mImpl->paragraphs[i].length > 0) {
+            dc.drawText(*layout, Point(topLeft.x, topLeft.y + y));
+        }
+    }
+}
+
+bool EditableTextLayout::drawComposite(DrawContext& dc, const Point& topLeft) const
+{
+    draw(dc, topLeft);
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+BezierPath::BezierPath()
+    : mImpl(new BezierPath::Impl())
+{
+}
+
+BezierPath::~BezierPath()
+{
+}
+
+void BezierPath::moveTo(const Point& p)
+{
+    clearNative();
+    mImpl->invalidateCache();
+    mImpl->commands.emplace_back(BezierPath::Impl::Command::kMoveTo, p);
+}
+
+void BezierPath::lineTo(const Point& end)
+{
+    clearNative();
+    mImpl->invalidateCache();
+    mImpl->commands.emplace_back(BezierPath::Impl::Command::kLineTo, end);
+}
+
+void BezierPath::quadraticTo(const Point& cp1, const Point& end)
+{
+    clearNative();
+    mImpl->invalidateCache();
+    mImpl->commands.emplace_back(BezierPath::Impl::Command::kQuadraticTo, cp1, end);
+}
+
+void BezierPath::cubicTo(const Point& cp1, const Point& cp2, const Point& end)
+{
+    clearNative();
+    mImpl->invalidateCache();
+    mImpl->commands.emplace_back(BezierPath::Impl::Command::kCubicTo, cp1, cp2, end);
+}
 
 void BezierPath::quarterEllipseTo(const Point& forwardCorner, const Point& endPt)
 {
@@ -1368,6 +2687,8 @@ void BezierPath::quarterEllipseTo(const Point& forwardCorner, const Point& endPt
 
     Point cp1 = start + tangentWeight * (forwardCorner - start);
     Point cp2 = endPt - tangentWeight * (endPt - forwardCorner);
+    clearNative();
+    mImpl->invalidateCache();
     mImpl->commands.emplace_back(BezierPath::Impl::Command::kCubicTo, cp1, cp2, endPt);
 }
 
@@ -1375,6 +2696,7 @@ void BezierPath::close()
 {
     mImpl->commands.emplace_back(BezierPath::Impl::Command::kClose);
     clearNative();
+    mImpl->invalidateCache();
 }
 
 void BezierPath::addRect(const Rect& r)
@@ -1469,6 +2791,371 @@ void BezierPath::addCircle(const Point& center, const PicaPt& radius)
     addEllipse(Rect(center.x - radius, center.y - radius, 2.0f * radius, 2.0f * radius));
 }
 
+namespace {
+// Expands [*minV, *maxV] to include the extrema of the 1D cubic bezier in
+// (0, 1). The derivative is 3 * (a*t^2 + b*t + c).
+void expandByCubicExtrema(float p0, float p1, float p2, float p3,
+                          float *minV, float *maxV)
+{
+    const float a = -p0 + 3.0f * p1 - 3.0f * p2 + p3;
+    const float b = 2.0f * (p0 - 2.0f * p1 + p2);
+    const float c = p1 - p0;
+    float roots[2];
+    int nRoots = 0;
+    if (std::abs(a) < 1e-6f) {
+        if (std::abs(b) > 1e-6f) {
+            roots[nRoots++] = -c / b;
+        }
+    } else {
+        float discriminant = b * b - 4.0f * a * c;
+        if (discriminant >= 0.0f) {
+            float sqrtD = std::sqrt(discriminant);
+            roots[nRoots++] = (-b + sqrtD) / (2.0f * a);
+            roots[nRoots++] = (-b - sqrtD) / (2.0f * a);
+        }
+    }
+    for (int i = 0;  i < nRoots;  ++i) {
+        float t = roots[i];
+        if (t > 0.0f && t < 1.0f) {
+            float mt = 1.0f - t;
+            float v = mt * mt * mt * p0 + 3.0f * mt * mt * t * p1
+                      + 3.0f * mt * t * t * p2 + t * t * t * p3;
+            *minV = std::min(*minV, v);
+            *maxV = std::max(*maxV, v);
+        }
+    }
+}
+
+// Quadratics are exactly representable as cubics, so we only need to
+// handle the cubic case in the geometry code.
+void quadraticToCubic(const Point& p0, const Point& cp, const Point& end,
+                      Point *cp1, Point *cp2)
+{
+    *cp1 = p0 + (2.0f / 3.0f) * (cp - p0);
+    *cp2 = end + (2.0f / 3.0f) * (cp - end);
+}
+
+// Appends the points of the cubic (not including p0) such that the
+// polyline is within tolerance of the curve.
+void appendFlattenedCubic(const Point& p0, const Point& p1, const Point& p2,
+                          const Point& p3, float tolerance,
+                          std::vector<Point> *out)
+{
+    const float x0 = p0.x.asFloat(), y0 = p0.y.asFloat();
+    const float x1 = p1.x.asFloat(), y1 = p1.y.asFloat();
+    const float x2 = p2.x.asFloat(), y2 = p2.y.asFloat();
+    const float x3 = p3.x.asFloat(), y3 = p3.y.asFloat();
+
+    // Wang's formula: the number of segments needed so that the distance
+    // from the polyline to the curve is at most the tolerance.
+    float ddx = std::max(std::abs(x0 - 2.0f * x1 + x2), std::abs(x1 - 2.0f * x2 + x3));
+    float ddy = std::max(std::abs(y0 - 2.0f * y1 + y2), std::abs(y1 - 2.0f * y2 + y3));
+    float m = std::sqrt(ddx * ddx + ddy * ddy);
+    int n = int(std::ceil(std::sqrt(0.75f * m / tolerance)));
+    n = std::max(1, std::min(n, 1024));
+
+    // Power basis: B(t) = ((a*t + b)*t + c)*t + d. Points are evaluated in
+    // fixed-size blocks of plain floats, which compilers will vectorize on
+    // all the platforms we support, without needing per-platform intrinsics.
+    const float ax = -x0 + 3.0f * (x1 - x2) + x3, ay = -y0 + 3.0f * (y1 - y2) + y3;
+    const float bx = 3.0f * (x0 - 2.0f * x1 + x2), by = 3.0f * (y0 - 2.0f * y1 + y2);
+    const float cx = 3.0f * (x1 - x0), cy = 3.0f * (y1 - y0);
+    const float dt = 1.0f / float(n);
+    constexpr int kBlockSize = 16;
+    float xs[kBlockSize], ys[kBlockSize];
+    out->reserve(out->size() + n);
+    for (int start = 1;  start < n;  start += kBlockSize) {
+        for (int j = 0;  j < kBlockSize;  ++j) {
+            float t = float(start + j) * dt;
+            xs[j] = ((ax * t + bx) * t + cx) * t + x0;
+            ys[j] = ((ay * t + by) * t + cy) * t + y0;
+        }
+        int count = std::min(kBlockSize, n - start);
+        for (int j = 0;  j < count;  ++j) {
+            out->emplace_back(PicaPt(xs[j]), PicaPt(ys[j]));
+        }
+    }
+    out->push_back(p3);  // exact end point, so that subpaths close exactly
+}
+
+} // namespace
+
+Rect BezierPath::Impl::calcControlBounds() const
+{
+    bool hasPoint = false;
+    PicaPt minX, minY, maxX, maxY;
+    auto addPoint = [&](const Point& p) {
+        if (!hasPoint) {
+            minX = maxX = p.x;
+            minY = maxY = p.y;
+            hasPoint = true;
+        } else {
+            minX = std::min(minX, p.x);
+            maxX = std::max(maxX, p.x);
+            minY = std::min(minY, p.y);
+            maxY = std::max(maxY, p.y);
+        }
+    };
+
+    for (auto &cmd : this->commands) {
+        switch (cmd.cmd) {
+            case Command::kMoveTo:
+            case Command::kLineTo:
+                addPoint(cmd.p1);
+                break;
+            case Command::kQuadraticTo:
+                addPoint(cmd.p1);
+                addPoint(cmd.p2);
+                break;
+            case Command::kCubicTo:
+                addPoint(cmd.p1);
+                addPoint(cmd.p2);
+                addPoint(cmd.p3);
+                break;
+            case Command::kClose:
+                break;
+        }
+    }
+    if (!hasPoint) {
+        return Rect::kZero;
+    }
+    return Rect(minX, minY, maxX - minX, maxY - minY);
+}
+
+Rect BezierPath::Impl::calcBounds() const
+{
+    bool hasPoint = false;
+    float minX = 0.0f, minY = 0.0f, maxX = 0.0f, maxY = 0.0f;
+    auto addPoint = [&](const Point& p) {
+        float x = p.x.asFloat(), y = p.y.asFloat();
+        if (!hasPoint) {
+            minX = maxX = x;
+            minY = maxY = y;
+            hasPoint = true;
+        } else {
+            minX = std::min(minX, x);
+            maxX = std::max(maxX, x);
+            minY = std::min(minY, y);
+            maxY = std::max(maxY, y);
+        }
+    };
+    auto addCubic = [&](const Point& p0, const Point& p1, const Point& p2, const Point& p3) {
+        addPoint(p0);
+        addPoint(p3);
+        expandByCubicExtrema(p0.x.asFloat(), p1.x.asFloat(), p2.x.asFloat(),
+                             p3.x.asFloat(), &minX, &maxX);
+        expandByCubicExtrema(p0.y.asFloat(), p1.y.asFloat(), p2.y.asFloat(),
+                             p3.y.asFloat(), &minY, &maxY);
+    };
+
+    // A moveTo that is not followed by a segment does not draw anything,
+    // so only the points of segments are included.
+    Point start, current;
+    for (auto &cmd : this->commands) {
+        switch (cmd.cmd) {
+            case Command::kMoveTo:
+                start = cmd.p1;
+                current = cmd.p1;
+                break;
+            case Command::kLineTo:
+                addPoint(current);
+                addPoint(cmd.p1);
+                current = cmd.p1;
+                break;
+            case Command::kQuadraticTo: {
+                Point cp1, cp2;
+                quadraticToCubic(current, cmd.p1, cmd.p2, &cp1, &cp2);
+                addCubic(current, cp1, cp2, cmd.p2);
+                current = cmd.p2;
+                break;
+            }
+            case Command::kCubicTo:
+                addCubic(current, cmd.p1, cmd.p2, cmd.p3);
+                current = cmd.p3;
+                break;
+            case Command::kClose:
+                current = start;
+                break;
+        }
+    }
+    if (!hasPoint) {
+        return Rect::kZero;
+    }
+    return Rect(PicaPt(minX), PicaPt(minY), PicaPt(maxX - minX), PicaPt(maxY - minY));
+}
+
+std::vector<std::vector<Point>> BezierPath::Impl::calcFlattened(float tolerance) const
+{
+    std::vector<std::vector<Point>> polys;
+    Point start, current;
+    bool needsNewPoly = true;
+    auto beginPolyIfNeeded = [&]() {
+        if (needsNewPoly) {
+            polys.emplace_back();
+            polys.back().push_back(current);
+            needsNewPoly = false;
+        }
+    };
+
+    for (auto &cmd : this->commands) {
+        switch (cmd.cmd) {
+            case Command::kMoveTo:
+                start = cmd.p1;
+                current = cmd.p1;
+                needsNewPoly = true;
+                break;
+            case Command::kLineTo:
+                beginPolyIfNeeded();
+                polys.back().push_back(cmd.p1);
+                current = cmd.p1;
+                break;
+            case Command::kQuadraticTo: {
+                beginPolyIfNeeded();
+                Point cp1, cp2;
+                quadraticToCubic(current, cmd.p1, cmd.p2, &cp1, &cp2);
+                appendFlattenedCubic(current, cp1, cp2, cmd.p2, tolerance, &polys.back());
+                current = cmd.p2;
+                break;
+            }
+            case Command::kCubicTo:
+                beginPolyIfNeeded();
+                appendFlattenedCubic(current, cmd.p1, cmd.p2, cmd.p3, tolerance, &polys.back());
+                current = cmd.p3;
+                break;
+            case Command::kClose:
+                if (!needsNewPoly && polys.back().back() != start) {
+                    polys.back().push_back(start);
+                }
+                current = start;
+                needsNewPoly = true;
+                break;
+        }
+    }
+    return polys;
+}
+
+const std::vector<std::vector<Point>>& BezierPath::Impl::flattened(float tolerance) const
+{
+    if (cache.flattenTolerance != tolerance) {
+        cache.flattened = calcFlattened(tolerance);
+        cache.flattenTolerance = tolerance;
+    }
+    return cache.flattened;
+}
+
+const std::vector<std::vector<Point>>& BezierPath::Impl::hitTestPolygons() const
+{
+    // 0.05 pt is about 1/5 of a pixel at 288 dpi, which is as precise as
+    // anyone can click.
+    const float kHitTestTolerance = 0.05f;
+    if (!cache.hitTestValid) {
+        cache.hitTestPolygons = calcFlattened(kHitTestTolerance);
+        cache.hitTestValid = true;
+    }
+    return cache.hitTestPolygons;
+}
+
+Rect BezierPath::bounds() const
+{
+    if (!mImpl->cache.boundsValid) {
+        mImpl->cache.bounds = mImpl->calcBounds();
+        mImpl->cache.boundsValid = true;
+    }
+    return mImpl->cache.bounds;
+}
+
+size_t BezierPath::hash() const
+{
+    if (!mImpl->cache.hashValid) {
+        mImpl->cache.hash = mImpl->calcHash();
+        mImpl->cache.hashValid = true;
+    }
+    return mImpl->cache.hash;
+}
+
+size_t BezierPath::Impl::calcHash() const
+{
+    size_t seed = 0;
+    for (auto &cmd : this->commands) {
+        hash_combine(seed, int(cmd.cmd));
+        switch (cmd.cmd) {
+            case Command::kCubicTo:
+                hash_combine(seed, cmd.p3.x.asFloat());
+                hash_combine(seed, cmd.p3.y.asFloat());
+                // fallthrough
+            case Command::kQuadraticTo:
+                hash_combine(seed, cmd.p2.x.asFloat());
+                hash_combine(seed, cmd.p2.y.asFloat());
+                // fallthrough
+            case Command::kMoveTo:
+            case Command::kLineTo:
+                hash_combine(seed, cmd.p1.x.asFloat());
+                hash_combine(seed, cmd.p1.y.asFloat());
+                break;
+            case Command::kClose:
+                break;
+        }
+    }
+    return seed;
+}
+
+Rect BezierPath::controlBounds() const
+{
+    if (!mImpl->cache.controlBoundsValid) {
+        mImpl->cache.controlBounds = mImpl->calcControlBounds();
+        mImpl->cache.controlBoundsValid = true;
+    }
+    return mImpl->cache.controlBounds;
+}
+
+bool BezierPath::contains(const Point& p, FillRule rule /*= kFillWinding*/) const
+{
+    // Most points tested against most paths are outside, so reject those
+    // before doing any real work.
+    if (!controlBounds().contains(p)) {
+        return false;
+    }
+
+    const float px = p.x.asFloat(), py = p.y.asFloat();
+    int winding = 0;
+    int nCrossings = 0;
+    for (auto &poly : mImpl->hitTestPolygons()) {
+        const size_t n = poly.size();
+        if (n < 3) {
+            continue;
+        }
+        // Using (i + 1) % n implicitly closes open subpaths; for closed
+        // subpaths the last edge is degenerate, which is harmless.
+        for (size_t i = 0;  i < n;  ++i) {
+            const float ax = poly[i].x.asFloat(), ay = poly[i].y.asFloat();
+            const auto &b = poly[(i + 1) % n];
+            const float bx = b.x.asFloat(), by = b.y.asFloat();
+            const float side = (bx - ax) * (py - ay) - (px - ax) * (by - ay);
+            if (ay <= py) {
+                if (by > py && side > 0.0f) {  // upward crossing, p is left
+                    ++winding;
+                    ++nCrossings;
+                }
+            } else {
+                if (by <= py && side < 0.0f) {  // downward crossing, p is right
+                    --winding;
+                    ++nCrossings;
+                }
+            }
+        }
+    }
+
+    if (rule == kFillEvenOdd) {
+        return ((nCrossings & 0x1) != 0);
+    }
+    return (winding != 0);
+}
+
+std::vector<std::vector<Point>> BezierPath::flatten(const PicaPt& tolerance) const
+{
+    return mImpl->flattened(std::max(0.001f, tolerance.asFloat()));
+}
+
 //-----------------------------------------------------------------------------
 Gradient::Gradient()
 {
@@ -1478,6 +3165,38 @@ Gradient::~Gradient()
 {
 }
 
+GradientBuilder::GradientBuilder(const std::vector<Gradient::Stop>& stops)
+{
+    for (auto &s : stops) {
+        addStop(s);
+    }
+}
+
+GradientBuilder& GradientBuilder::addStop(const Color& color, float location)
+{
+    return addStop(Gradient::Stop{ color, location });
+}
+
+GradientBuilder& GradientBuilder::addStop(const Gradient::Stop& stop)
+{
+    if (mSize < size_t(kMaxInlineStops)) {
+        mInline[mSize] = stop;
+    } else {
+        if (mOverflow.empty()) {
+            mOverflow.assign(mInline, mInline + mSize);
+        }
+        mOverflow.push_back(stop);
+    }
+    ++mSize;
+    hashGradientStop(mHash, stop);
+    return *this;
+}
+
+std::vector<Gradient::Stop> GradientBuilder::stops() const
+{
+    return std::vector<Gradient::Stop>(begin(), end());
+}
+
 //-----------------------------------------------------------------------------
 int calcPixelBytes(ImageFormat format)
 {
@@ -1627,6 +3346,169 @@ void Image::premultiplyAlpha()
     }
 }
 
+void Image::blur(float radiusPx)
+{
+    if (!isValid() || mImpl->format == kImageEncodedData_internal) {
+        return;
+    }
+    int nChannels = calcPixelBytes(mImpl->format);
+    blurPixels(mImpl->data, mImpl->width, mImpl->height, nChannels * mImpl->width,
+               nChannels, radiusPx);
+}
+
+//-----------------------------------------------------------------------------
+namespace {
+// Calculates the radii of three box blurs whose combination approximates a
+// Gaussian blur with standard deviation sigma. (See P. Kovesi, "Fast Almost-
+// Gaussian Filtering", 2010.)
+void calcBoxBlurRadii(float sigma, int radii[3])
+{
+    const int n = 3;
+    float wIdeal = std::sqrt(12.0f * sigma * sigma / float(n) + 1.0f);
+    int wl = int(std::floor(wIdeal));
+    if (wl % 2 == 0) {
+        wl -= 1;
+    }
+    int wu = wl + 2;
+    float mIdeal = (12.0f * sigma * sigma - float(n * wl * wl + 4 * n * wl + 3 * n))
+                   / float(-4 * wl - 4);
+    int m = int(std::round(mIdeal));
+    for (int i = 0;  i < n;  ++i) {
+        int w = (i < m ? wl : wu);
+        radii[i] = std::max(0, (w - 1) / 2);
+    }
+}
+
+// Blurs one row of pixels from src into dst with a box of width 2r + 1.
+// The running sum makes the cost independent of the radius.
+void boxBlurRow(const uint8_t *src, uint8_t *dst, int width, int nChannels, int r)
+{
+    const float inv = 1.0f / float(2 * r + 1);
+    const int last = width - 1;
+    for (int c = 0;  c < nChannels;  ++c) {
+        int sum = (r + 1) * int(src[c]);
+        for (int i = 1;  i <= r;  ++i) {
+            sum += int(src[std::min(i, last) * nChannels + c]);
+        }
+        for (int x = 0;  x < width;  ++x) {
+            dst[x * nChannels + c] = uint8_t(float(sum) * inv + 0.5f);
+            sum += int(src[std::min(x + r + 1, last) * nChannels + c]) -
+                   int(src[std::max(x - r, 0) * nChannels + c]);
+        }
+    }
+}
+
+// Blurs the bytes [begin, end) of each row vertically from src into dst.
+// This goes row by row, rather than column by column, so that memory is
+// accessed in order, and the inner loop is simple enough to vectorize.
+void boxBlurColumns(const uint8_t *src, uint8_t *dst, int height, int stride,
+                    int begin, int end, int r, std::vector<int>& sums)
+{
+    const float inv = 1.0f / float(2 * r + 1);
+    const int n = end - begin;
+    const int last = height - 1;
+    auto row = [src, stride, begin](int y) { return src + y * stride + begin; };
+
+    sums.resize(size_t(n));
+    const uint8_t *first = row(0);
+    for (int i = 0;  i < n;  ++i) {
+        sums[i] = (r + 1) * int(first[i]);
+    }
+    for (int y = 1;  y <= r;  ++y) {
+        const uint8_t *add = row(std::min(y, last));
+        for (int i = 0;  i < n;  ++i) {
+            sums[i] += int(add[i]);
+        }
+    }
+    for (int y = 0;  y < height;  ++y) {
+        uint8_t *out = dst + y * stride + begin;
+        const uint8_t *add = row(std::min(y + r + 1, last));
+        const uint8_t *sub = row(std::max(y - r, 0));
+        for (int i = 0;  i < n;  ++i) {
+            out[i] = uint8_t(float(sums[i]) * inv + 0.5f);
+            sums[i] += int(add[i]) - int(sub[i]);
+        }
+    }
+}
+
+// Calls f(begin, end) for ranges covering [0, n), on multiple threads if
+// there is enough work. Each range has at least minPerThread items.
+void parallelFor(int n, int minPerThread, const std::function<void(int, int)>& f)
+{
+#if defined(__EMSCRIPTEN__)
+    // Threads require SharedArrayBuffer, which is not always available
+    f(0, n);
+#else
+    int nThreads = std::min(int(std::thread::hardware_concurrency()),
+                            n / std::max(1, minPerThread));
+    if (nThreads <= 1) {
+        f(0, n);
+        return;
+    }
+    int chunk = (n + nThreads - 1) / nThreads;
+    std::vector<std::thread> threads;
+    threads.reserve(size_t(nThreads - 1));
+    for (int begin = chunk;  begin < n;  begin += chunk) {
+        threads.emplace_back(f, begin, std::min(n, begin + chunk));
+    }
+    f(0, std::min(n, chunk));
+    for (auto &t : threads) {
+        t.join();
+    }
+#endif
+}
+} // namespace
+
+int blurExtentPx(float radiusPx)
+{
+    int radii[3];
+    calcBoxBlurRadii(0.5f * radiusPx, radii);
+    return radii[0] + radii[1] + radii[2];
+}
+
+void blurPixels(uint8_t *pixels, int width, int height, int stride,
+                int nChannels, float radiusPx)
+{
+    int radii[3];
+    calcBoxBlurRadii(0.5f * radiusPx, radii);
+    if (width <= 0 || height <= 0 || radii[0] + radii[1] + radii[2] == 0) {
+        return;
+    }
+    // Small images are not worth the cost of starting threads
+    const int kMinPixelsForThreads = 256 * 256;
+    const bool useThreads = (width * height >= kMinPixelsForThreads);
+
+    // Horizontal passes: each row is independent
+    const int rowBytes = width * nChannels;
+    parallelFor(height, (useThreads ? 32 : height), [=](int begin, int end) {
+        std::vector<uint8_t> a(rowBytes), b(rowBytes);
+        for (int y = begin;  y < end;  ++y) {
+            uint8_t *row = pixels + y * stride;
+            boxBlurRow(row, a.data(), width, nChannels, radii[0]);
+            boxBlurRow(a.data(), b.data(), width, nChannels, radii[1]);
+            boxBlurRow(b.data(), row, width, nChannels, radii[2]);
+        }
+    });
+
+    // Vertical passes: each column is independent, so split the columns
+    std::vector<uint8_t> tmp(size_t(stride) * size_t(height));
+    uint8_t *tmpData = tmp.data();
+    const int kBytesPerUnit = 64;
+    int nUnits = (rowBytes + kBytesPerUnit - 1) / kBytesPerUnit;
+    parallelFor(nUnits, (useThreads ? 4 : nUnits), [=](int beginUnit, int endUnit) {
+        int begin = beginUnit * kBytesPerUnit;
+        int end = std::min(rowBytes, endUnit * kBytesPerUnit);
+        std::vector<int> sums;
+        boxBlurColumns(pixels, tmpData, height, stride, begin, end, radii[0], sums);
+        boxBlurColumns(tmpData, pixels, height, stride, begin, end, radii[1], sums);
+        boxBlurColumns(pixels, tmpData, height, stride, begin, end, radii[2], sums);
+        for (int y = 0;  y < height;  ++y) {
+            memcpy(pixels + y * stride + begin, tmpData + y * stride + begin,
+                   size_t(end - begin));
+        }
+    });
+}
+
 //-----------------------------------------------------------------------------
 uint8_t* createBGRAFromABGR(const uint8_t *src, int width, int height)
 {
@@ -1825,6 +3707,40 @@ Image readImage(const uint8_t *imgdata, int size)
     return Image();
 }
 
+//-----------------------------------------------------------------------------
+Layer::Layer(std::shared_ptr<DrawContext> bitmap)
+    : mBitmap(bitmap)
+{
+}
+
+Size Layer::size() const
+{
+    return Size(PicaPt::fromPixels(float(mBitmap->width()), mBitmap->dpi()),
+                PicaPt::fromPixels(float(mBitmap->height()), mBitmap->dpi()));
+}
+
+DrawContext& Layer::beginDraw()
+{
+    mBitmap->beginDraw();
+    mBitmap->clearRect(Rect(PicaPt::kZero, PicaPt::kZero, size().width, size().height));
+    return *mBitmap;
+}
+
+void Layer::endDraw()
+{
+    mBitmap->endDraw();
+    mImage.reset();  // some backends copy the pixels into the image
+    mNeedsRedraw = false;
+}
+
+std::shared_ptr<DrawableImage> Layer::image()
+{
+    if (!mImage) {
+        mImage = mBitmap->copyToImage();
+    }
+    return mImage;
+}
+
 //-----------------------------------------------------------------------------
 DrawContext::DrawContext(void* nativeDC, int width, int height, float dpi, float nativeDPI)
     : mNativeDC(nativeDC), mWidth(width), mHeight(height), mDPI(dpi), mNativeDPI(nativeDPI)
@@ -1877,6 +3793,20 @@ void DrawContext::setInitialState()
     setStrokeDashes({}, PicaPt(0));
 }
 
+void DrawContext::invalidate(const Rect& r)
+{
+}
+
+std::vector<Rect> DrawContext::dirtyRegion() const
+{
+    return { Rect::fromPixels(0.0f, 0.0f, float(mWidth), float(mHeight), mDPI) };
+}
+
+void DrawContext::beginDraw(const std::vector<Rect>& dirtyRegion)
+{
+    beginDraw();
+}
+
 void DrawContext::drawRoundedRect(const Rect& rect, const PicaPt& radius, PaintMode mode)
 {
     auto path = createBezierPath();
@@ -1897,4 +3827,296 @@ void DrawContext::addPage()
 {
 }
 
+int DrawContext::culledDrawCount() const
+{
+    return 0;
+}
+
+int DrawContext::avoidedStateChangeCount() const
+{
+    return 0;
+}
+
+std::shared_ptr<Layer> DrawContext::createLayer(const Size& size)
+{
+    int widthPx = std::max(1, int(std::ceil(size.width.toPixels(mDPI))));
+    int heightPx = std::max(1, int(std::ceil(size.height.toPixels(mDPI))));
+    return std::make_shared<Layer>(createBitmap(kBitmapRGBA, widthPx, heightPx, mDPI));
+}
+
+void DrawContext::drawLayer(std::shared_ptr<Layer> layer, const Point& topLeft,
+                            float opacity /*= 1.0f*/)
+{
+    auto image = layer->image();
+    if (!image) {
+        return;
+    }
+    Rect r(topLeft.x, topLeft.y, image->width(), image->height());
+    if (opacity < 1.0f) {
+        beginLayer(r, opacity);
+        drawImage(image, r);
+        endLayer();
+    } else {
+        drawImage(image, r);
+    }
+}
+
+void DrawContext::beginLayer(const Rect& bounds, float opacity /*= 1.0f*/)
+{
+    save();
+    clipToRect(bounds);
+}
+
+void DrawContext::endLayer()
+{
+    restore();
+}
+
+void DrawContext::drawShadow(std::shared_ptr<BezierPath> path, const Size& offset,
+                             const PicaPt& blurRadius, const Color& color)
+{
+    // This rasterizes the path with contains(), which is slow and ignores
+    // the transform when rasterizing, but works everywhere. Backends that
+    // can access their pixels should override this.
+    float radiusPx = blurRadius.toPixels(mDPI);
+    int extent = blurExtentPx(radiusPx);
+    auto bounds = path->bounds();
+    int x0 = int(std::floor(bounds.x.toPixels(mDPI))) - extent;
+    int y0 = int(std::floor(bounds.y.toPixels(mDPI))) - extent;
+    int width = int(std::ceil(bounds.maxX().toPixels(mDPI))) + extent - x0;
+    int height = int(std::ceil(bounds.maxY().toPixels(mDPI))) + extent - y0;
+    if (width <= 0 || height <= 0) {
+        return;
+    }
+
+    std::vector<uint8_t> alpha(size_t(width * height));
+    for (int y = 0;  y < height;  ++y) {
+        for (int x = 0;  x < width;  ++x) {
+            auto p = Point::fromPixels(float(x0 + x) + 0.5f, float(y0 + y) + 0.5f, mDPI);
+            alpha[y * width + x] = (path->contains(p) ? 255 : 0);
+        }
+    }
+    blurPixels(alpha.data(), width, height, width, 1, radiusPx);
+
+    Image shadow(width, height, kImageBGRA32_Premultiplied, mDPI);
+    uint8_t *bgra = shadow.data();
+    for (size_t i = 0;  i < alpha.size();  ++i) {
+        float a = color.alpha() * float(alpha[i]) / 255.0f;
+        bgra[4 * i    ] = uint8_t(255.0f * a * color.blue() + 0.5f);
+        bgra[4 * i + 1] = uint8_t(255.0f * a * color.green() + 0.5f);
+        bgra[4 * i + 2] = uint8_t(255.0f * a * color.red() + 0.5f);
+        bgra[4 * i + 3] = uint8_t(255.0f * a + 0.5f);
+    }
+    drawImage(createDrawableImage(shadow),
+              Rect::fromPixels(float(x0), float(y0), float(width), float(height), mDPI)
+                  .translated(offset.width, offset.height));
+}
+
+AffineTransform DrawContext::currentTransform() const
+{
+    // Backends that do not keep track of the transform can still report
+    // it by mapping a few points. Use points far apart so that the result
+    // is not dominated by rounding.
+    const PicaPt kUnit(72.0f);
+    auto *self = const_cast<DrawContext*>(this);
+    float x0, y0, x1, y1, x2, y2;
+    self->calcContextPixel(Point(PicaPt::kZero, PicaPt::kZero), &x0, &y0);
+    self->calcContextPixel(Point(kUnit, PicaPt::kZero), &x1, &y1);
+    self->calcContextPixel(Point(PicaPt::kZero, kUnit), &x2, &y2);
+    float unitPx = kUnit.toPixels(mDPI);
+    return AffineTransform((x1 - x0) / unitPx, (y1 - y0) / unitPx,
+                           (x2 - x0) / unitPx, (y2 - y0) / unitPx,
+                           PicaPt::fromPixels(x0, mDPI),
+                           PicaPt::fromPixels(y0, mDPI));
+}
+
+void DrawContext::setTransform(const AffineTransform& t)
+{
+    concatTransform(currentTransform().inverted().concatenated(t));
+}
+
+void DrawContext::concatTransform(const AffineTransform& t)
+{
+    // Any affine transform can be decomposed into
+    // translate * rotate * scale * rotate (this is the singular value
+    // decomposition of the linear part), which the backends all support.
+    // Note that AffineTransform::rotation(deg) is a rotation of -deg in the
+    // mathematical sense, since +y is down.
+    double e = 0.5 * double(t.a + t.d);
+    double f = 0.5 * double(t.a - t.d);
+    double g = 0.5 * double(t.b + t.c);
+    double h = 0.5 * double(t.b - t.c);
+    double q = std::sqrt(e * e + h * h);
+    double r = std::sqrt(f * f + g * g);
+    double a1 = std::atan2(g, f);
+    double a2 = std::atan2(h, e);
+    double theta = 0.5 * (a2 - a1);
+    double phi = 0.5 * (a2 + a1);
+    const double kRadToDeg = 180.0 / 3.14159265358979323846;
+
+    if (t.tx != PicaPt::kZero || t.ty != PicaPt::kZero) {
+        translate(t.tx, t.ty);
+    }
+    if (phi != 0.0) {
+        rotate(float(-phi * kRadToDeg));
+    }
+    if (q + r != 1.0 || q - r != 1.0) {
+        scale(float(q + r), float(q - r));
+    }
+    if (theta != 0.0) {
+        rotate(float(-theta * kRadToDeg));
+    }
+}
+
+Rect DrawContext::clipBounds() const
+{
+    // Without knowing the clip, the whole context is the best we can do.
+    auto context = Rect::fromPixels(0.0f, 0.0f, float(mWidth), float(mHeight), mDPI);
+    return currentTransform().inverted().mapRect(context);
+}
+
+std::string DrawContext::fontFamilyForCodePoint(const Font& font, uint32_t codePoint) const
+{
+    return font.family();
+}
+
+namespace {
+Color gradientColorAt(const std::vector<Gradient::Stop>& stops, float t)
+{
+    assert(!stops.empty());
+    if (t <= stops.front().location) {
+        return stops.front().color;
+    }
+    for (size_t i = 1;  i < stops.size();  ++i) {
+        if (t < stops[i].location) {
+            auto &s0 = stops[i - 1];
+            auto &s1 = stops[i];
+            return s0.color.blend(s1.color, (t - s0.location) / (s1.location - s0.location));
+        }
+    }
+    return stops.back().color;
+}
+
+// Filling adjacent pieces of an approximated gradient leaves faint seams
+// where their antialiased edges meet, so also stroke them with a thin line.
+void fillGradientPiece(DrawContext& dc, std::shared_ptr<BezierPath> piece,
+                       const Color& color)
+{
+    dc.setFillColor(color);
+    dc.setStrokeColor(color);
+    dc.drawPath(piece, kPaintStrokeAndFill);
+}
+} // namespace
+
+void DrawContext::drawConicGradientPath(std::shared_ptr<BezierPath> path,
+                                        Gradient& gradient,
+                                        const Point& center,
+                                        float startAngleDeg)
+{
+    // Backends without native conic gradients approximate it with wedges,
+    // each filled with the color at its middle. The stops are in the order
+    // they were given, which need not be sorted.
+    auto stops = gradient.stops();
+    std::stable_sort(stops.begin(), stops.end(),
+                     [](const Gradient::Stop& a, const Gradient::Stop& b) {
+                         return a.location < b.location;
+                     });
+    if (stops.empty()) {
+        return;
+    }
+    auto bounds = path->controlBounds();
+    float radius = 0.0f;
+    for (auto &p : { Point(bounds.x, bounds.y), Point(bounds.maxX(), bounds.y),
+                     Point(bounds.maxX(), bounds.maxY()), Point(bounds.x, bounds.maxY()) }) {
+        auto dx = (p.x - center.x).asFloat(), dy = (p.y - center.y).asFloat();
+        radius = std::max(radius, std::sqrt(dx * dx + dy * dy));
+    }
+    radius += 2.0f * onePixel().asFloat();
+
+    const int kNWedges = 360;
+    const float kPi = 3.14159265358979323846f;
+    auto pointAt = [&center, radius, startAngleDeg, kPi](float t) {
+        float rad = (startAngleDeg + 360.0f * t) * kPi / 180.0f;
+        // +y is down, but the angle is counterclockwise on the screen
+        return Point(center.x + PicaPt(radius * std::cos(rad)),
+                     center.y - PicaPt(radius * std::sin(rad)));
+    };
+
+    save();
+    clipToPath(path);
+    setStrokeWidth(0.5f * onePixel());
+    for (int i = 0;  i < kNWedges;  ++i) {
+        float t0 = float(i) / float(kNWedges);
+        float t1 = float(i + 1) / float(kNWedges);
+        auto wedge = createBezierPath();
+        wedge->moveTo(center);
+        wedge->lineTo(pointAt(t0));
+        wedge->lineTo(pointAt(t1));
+        wedge->close();
+        fillGradientPiece(*this, wedge, gradientColorAt(stops, 0.5f * (t0 + t1)));
+    }
+    restore();
+}
+
+void DrawContext::drawMeshGradientPath(std::shared_ptr<BezierPath> path,
+                                       const std::vector<GradientMeshPatch>& patches)
+{
+    // Backends without native mesh gradients approximate each patch with a
+    // grid of quads, each filled with the color at its middle.
+    const int kNSteps = 16;
+    save();
+    clipToPath(path);
+    setStrokeWidth(0.5f * onePixel());
+    for (auto &patch : patches) {
+        auto pointAt = [&patch](float u, float v) {
+            auto top = (1.0f - u) * patch.corners[0] + u * patch.corners[1];
+            auto bottom = (1.0f - u) * patch.corners[3] + u * patch.corners[2];
+            return (1.0f - v) * top + v * bottom;
+        };
+        auto colorAt = [&patch](float u, float v) {
+            auto top = patch.colors[0].blend(patch.colors[1], u);
+            auto bottom = patch.colors[3].blend(patch.colors[2], u);
+            return top.blend(bottom, v);
+        };
+        for (int j = 0;  j < kNSteps;  ++j) {
+            float v0 = float(j) / float(kNSteps), v1 = float(j + 1) / float(kNSteps);
+            for (int i = 0;  i < kNSteps;  ++i) {
+                float u0 = float(i) / float(kNSteps), u1 = float(i + 1) / float(kNSteps);
+                auto quad = createBezierPath();
+                quad->moveTo(pointAt(u0, v0));
+                quad->lineTo(pointAt(u1, v0));
+                quad->lineTo(pointAt(u1, v1));
+                quad->lineTo(pointAt(u0, v1));
+                quad->close();
+                fillGradientPiece(*this, quad, colorAt(0.5f * (u0 + u1), 0.5f * (v0 + v1)));
+            }
+        }
+    }
+    restore();
+}
+
+void DrawContext::setGradientMode(GradientMode mode)
+{
+}
+
+GradientMode DrawContext::gradientMode() const
+{
+    return kGradientNative;
+}
+
+Gradient& DrawContext::getGradient(const GradientBuilder& stops)
+{
+    auto it = mGradientIds.find(stops.hash());
+    if (it != mGradientIds.end()) {
+        auto &gradient = getGradient(it->second);
+        if (gradient.id() == it->second) {
+            return gradient;
+        }
+    }
+
+    auto &gradient = getGradient(stops.stops());
+    mGradientIds[stops.hash()] = gradient.id();
+    return gradient;
+}
+
 } // namespace $ND_NAMESPACE
@@ -32,6 +32,7 @@
 #include <cmath>
 #include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 namespace ND_NAMESPACE {
@@ -240,6 +241,8 @@ struct Rect
     }
 
     Rect intersectedWith(const Rect& r) const;
+    /// Returns the smallest rect containing both rects.
+    Rect unionedWith(const Rect& r) const;
 
     Rect operator+(const Point& rhs) const
         { return Rect(x + rhs.x, y + rhs.y, width, height); }
@@ -256,6 +259,70 @@ struct Rect
     PicaPt height;
 };
 
+/// An affine transform, which maps (x, y) to
+///     (a * x + c * y + tx, b * x + d * y + ty).
+/// This is the same layout as CoreGraphics, Direct2D, and Cairo. The
+/// functions compose the same way as the DrawContext functions do:
+/// t.translated(dx, dy) translates the coordinates and then applies t.
+/// Like the DrawContext functions, rotation(+deg) is counter-clockwise.
+struct AffineTransform
+{
+    static const AffineTransform kIdentity;
+
+    AffineTransform() {}
+    AffineTransform(float a_, float b_, float c_, float d_,
+                    const PicaPt& tx_, const PicaPt& ty_)
+        : a(a_), b(b_), c(c_), d(d_), tx(tx_), ty(ty_)
+    {}
+
+    static AffineTransform translation(const PicaPt& dx, const PicaPt& dy)
+        { return AffineTransform(1.0f, 0.0f, 0.0f, 1.0f, dx, dy); }
+    static AffineTransform rotation(float degrees);
+    static AffineTransform scaling(float sx, float sy)
+        { return AffineTransform(sx, 0.0f, 0.0f, sy, PicaPt::kZero, PicaPt::kZero); }
+
+    bool isIdentity() const { return (*this == kIdentity); }
+    /// Returns true if rects map to rects (that is, there is no rotation
+    /// other than multiples of 90 degrees, and no skew).
+    bool isAxisAligned() const
+        { return ((b == 0.0f && c == 0.0f) || (a == 0.0f && d == 0.0f)); }
+
+    /// Returns the transform that applies rhs and then this.
+    AffineTransform concatenated(const AffineTransform& rhs) const;
+    AffineTransform translated(const PicaPt& dx, const PicaPt& dy) const
+        { return concatenated(translation(dx, dy)); }
+    AffineTransform rotated(float degrees) const
+        { return concatenated(rotation(degrees)); }
+    AffineTransform scaled(float sx, float sy) const
+        { return concatenated(scaling(sx, sy)); }
+    /// Returns the inverse transform. If the transform is not invertible
+    /// (for instance, scale(0, 1)) returns the identity.
+    AffineTransform inverted() const;
+
+    Point mapPoint(const Point& p) const
+    {
+        return Point(a * p.x + c * p.y + tx, b * p.x + d * p.y + ty);
+    }
+    /// Returns the bounding box of the transformed rect. This is exact
+    /// if isAxisAligned() and conservative otherwise.
+    Rect mapRect(const Rect& r) const;
+
+    bool operator==(const AffineTransform& rhs) const
+    {
+        return (a == rhs.a && b == rhs.b && c == rhs.c && d == rhs.d &&
+                tx == rhs.tx && ty == rhs.ty);
+    }
+    bool operator!=(const AffineTransform& rhs) const
+        { return !(*this == rhs); }
+
+    float a = 1.0f;
+    float b = 0.0f;
+    float c = 0.0f;
+    float d = 1.0f;
+    PicaPt tx;
+    PicaPt ty;
+};
+
 class Color
 {
 public:
@@ -536,13 +603,19 @@ public:
     // Returns available font families (sorted alphabetically).
     static std::vector<std::string> availableFontFamilies();
 
+    // Fonts are immutable, shared descriptions: identical fonts share the
+    // same description, so copying a Font does not allocate, and the setters
+    // replace the description rather than modifying it.
     Font();
     Font(const Font& f);
     Font(const std::string& family, const PicaPt& pointSize,
          FontStyle style = kStyleNone, FontWeight weight = kWeightAuto);
-    ~Font();  // for unique_ptr
+    ~Font();
     Font& operator=(const Font& rhs) noexcept;
 
+    bool operator==(const Font& rhs) const { return (mImpl == rhs.mImpl); }
+    bool operator!=(const Font& rhs) const { return (mImpl != rhs.mImpl); }
+
     std::string family() const;
     Font& setFamily(const std::string& family);
     PicaPt pointSize() const;
@@ -559,6 +632,15 @@ public:
 
     Metrics metrics(const DrawContext& dc) const;
 
+    /// Returns the family of the font that will draw the code point: family()
+    /// if this font has a glyph for it, otherwise the fallback font's family.
+    std::string familyForCodePoint(const DrawContext& dc, uint32_t codePoint) const;
+    /// Looks up the fallback fonts for any characters in the strings that
+    /// this font does not have, so that text layouts do not need to search
+    /// for them. This is useful at startup for UIs with CJK text or emoji.
+    void prewarmFallbacks(const DrawContext& dc,
+                          const std::vector<std::string>& utf8Strings) const;
+
     Font fontWithPointSize(const PicaPt& pointSize) const;
     Font fontWithScaledPointSize(float scaling) const;
     Font fontWithStyle(FontStyle style) const;
@@ -568,7 +650,7 @@ public:
 
 private:
     struct Impl;
-    std::unique_ptr<Impl> mImpl;
+    std::shared_ptr<const Impl> mImpl;
 };
 
 enum UnderlineStyle
@@ -668,6 +750,16 @@ public:
     Text& setOutlineColor(const Color& c, int start = 0, int len = -1);
     Text& setTextRun(const TextRun& run);
     Text& setTextRuns(const std::vector<TextRun>& runs);
+    /// Applies each run as if by setTextRun(), but in one pass through the
+    /// text, which is much faster for many runs (e.g. syntax highlighting).
+    /// The runs should be sorted by startIndex and not overlap; if they are
+    /// not, this is equivalent to calling setTextRun() for each run.
+    Text& applyTextRuns(const std::vector<TextRun>& runs);
+
+    /// Replaces len bytes starting at start with utf8. The inserted text
+    /// takes the attributes of the character before start (or of the first
+    /// remaining character, if start is 0). If len is -1, replaces to the end.
+    Text& replaceText(int start, int len, const std::string& utf8);
 
     // Sets the line height as a multiple of the natural font line height.
     // Default: 0.0 (unset: platform default)
@@ -679,8 +771,16 @@ public:
     Text& setIndent(const PicaPt& indent);
     const PicaPt& indent() const;
 
-    const TextRun& runAt(int index) const;
+    /// Returns the run containing the byte at index. This does not need
+    /// runs(), so it is fast even right after the text changed.
+    TextRun runAt(int index) const;
+    /// Returns all the runs. This is created on the first call after the
+    /// text changed, and is valid until the text changes again.
     const std::vector<TextRun>& runs() const;
+    /// Returns the runs that intersect [start, start + len), clipped to that
+    /// range. Unlike runs(), this only looks at those runs, so it is fast for
+    /// a small part of long text (for example, after each edit).
+    std::vector<TextRun> runsInRange(int start, int len) const;
 
 private:
     struct ParagraphStyle {
@@ -688,11 +788,59 @@ private:
         PicaPt indent;
     };
 
+    // Runs store only their position; the attributes are interned, so runs
+    // with the same attributes share them (and copying a run is cheap).
+    struct Run
+    {
+        int startIndex;
+        int length;
+        std::shared_ptr<const TextRun> attrs;  // startIndex, length are unused
+    };
+
     std::string mText;
-    std::vector<TextRun> mRuns;
+    // This is a gap buffer: the runs are mRuns[0, mGapStart) followed by
+    // mRuns[mGapEnd, size()). Splits insert at the gap, so setting attributes
+    // in order through the text (e.g. syntax highlighting) does not need to
+    // move all the following runs each time. Runs after the gap start at
+    // startIndex + mGapShift, so that editing the text at the gap (e.g.
+    // typing) does not need to change the index of all the following runs.
+    std::vector<Run> mRuns;
+    size_t mGapStart = 0;
+    size_t mGapEnd = 0;
+    int mGapShift = 0;
     ParagraphStyle mParagraph;
+    // Created by runs() on demand. This is not modified once created, so
+    // copies of the Text can share it. Since runs() is const, threads that
+    // only read the Text may call it (or copy the Text) at the same time, so
+    // the pointer is only loaded and stored atomically. (As usual, changing
+    // the Text requires that nothing else is using it.)
+    struct TextRunsCache
+    {
+        std::shared_ptr<const std::vector<TextRun>> runs;
+
+        TextRunsCache() {}
+        TextRunsCache(const TextRunsCache& rhs) : runs(std::atomic_load(&rhs.runs)) {}
+        TextRunsCache& operator=(const TextRunsCache& rhs)
+        {
+            std::atomic_store(&runs, std::atomic_load(&rhs.runs));
+            return *this;
+        }
+    };
+    mutable TextRunsCache mTextRuns;
 
     int runIndexFor(int index) const;
+    size_t nRuns() const { return mRuns.size() - (mGapEnd - mGapStart); }
+    Run& run(size_t i) { return mRuns[i < mGapStart ? i : i + (mGapEnd - mGapStart)]; }
+    const Run& run(size_t i) const { return mRuns[i < mGapStart ? i : i + (mGapEnd - mGapStart)]; }
+    // Use this instead of run(i).startIndex
+    int runStart(size_t i) const
+    {
+        return (i < mGapStart ? mRuns[i].startIndex
+                              : mRuns[i + (mGapEnd - mGapStart)].startIndex + mGapShift);
+    }
+    void moveGap(size_t i);
+    void insertRun(size_t i, Run&& r);
+    void setRuns(std::vector<Run>&& runs);
 };
 
 struct TextMetrics
@@ -719,8 +867,89 @@ public:
         Glyph(long i, int ln, const Rect& r) : index(i), line(ln), frame(r) {}
     };
 
+    /// Compact storage for glyphs, using about a third of the memory of
+    /// std::vector<Glyph>. Each glyph stores only its x, width, and index;
+    /// the line, y, and height are stored once for each run of glyphs that
+    /// share them (usually a whole line). The glyphs must be contiguous in the
+    /// text, that is, a glyph's indexOfNext is the next glyph's index.
+    class CompactGlyphs
+    {
+    public:
+        long size() const { return long(mIndex.size()); }
+        bool empty() const { return mIndex.empty(); }
+        Glyph operator[](long i) const;
+        Glyph back() const { return (*this)[size() - 1]; }
+
+        /// The glyph's indexOfNext is ignored unless it is the last glyph
+        void push_back(const Glyph& g);
+        /// Sets indexOfNext for the last glyph.
+        void setEndIndex(long indexOfNext) { mEndIndex = indexOfNext; }
+        void clear();
+
+        // For sequential access without searching for the segment each time.
+        // Segments are numbered from 0, and segmentFor(i) is the segment
+        // containing glyph i.
+        size_t nSegments() const { return mSegments.size(); }
+        long segmentStart(size_t seg) const { return mSegments[seg].firstGlyph; }
+        size_t segmentFor(long i) const;
+        Glyph glyph(long i, size_t seg) const;
+
+    private:
+        struct Segment
+        {
+            long firstGlyph;
+            int line;
+            PicaPt y;
+            PicaPt height;
+        };
+        std::vector<Segment> mSegments;
+        std::vector<PicaPt> mX;
+        std::vector<PicaPt> mWidth;
+        std::vector<int> mIndex;
+        long mEndIndex = 0;
+    };
+
+    /// Read-only view of the glyphs, which creates each Glyph as it is
+    /// accessed, rather than requiring all the glyphs to exist in memory.
+    class GlyphRange
+    {
+    public:
+        class const_iterator
+        {
+        public:
+            Glyph operator*() const;
+            const_iterator& operator++();
+            bool operator==(const const_iterator& rhs) const { return mIdx == rhs.mIdx; }
+            bool operator!=(const const_iterator& rhs) const { return mIdx != rhs.mIdx; }
+        private:
+            friend class GlyphRange;
+            const_iterator(const GlyphRange *range, long idx);
+            const GlyphRange *mRange;
+            long mIdx;
+            size_t mSeg = 0;
+        };
+
+        explicit GlyphRange(const std::vector<Glyph>& glyphs) : mGlyphs(&glyphs) {}
+        explicit GlyphRange(const CompactGlyphs& glyphs) : mCompact(&glyphs) {}
+
+        long size() const;
+        bool empty() const { return size() == 0; }
+        Glyph operator[](long i) const;
+        const_iterator begin() const { return const_iterator(this, 0); }
+        const_iterator end() const { return const_iterator(this, size()); }
+
+    private:
+        const std::vector<Glyph> *mGlyphs = nullptr;
+        const CompactGlyphs *mCompact = nullptr;
+    };
+
     virtual ~TextLayout() {}
+    /// Returns the glyph in glyphs() containing p, or nullptr.
     virtual const Glyph* glyphAtPoint(const Point& p) const;
+    /// Copies the glyph containing p to `glyph` and returns true, or returns
+    /// false if there is none. Unlike glyphAtPoint(p), this does not need
+    /// glyphs(), so it is much faster the first time for large text.
+    virtual bool glyphAtPoint(const Point& p, Glyph *glyph) const;  // has impl
     virtual Point pointAtIndex(long index) const;
     virtual const Glyph* glyphAtIndex(long index) const;
     virtual long glyphIndexAtIndex(long index) const;
@@ -730,6 +959,19 @@ public:
     /// by string index, since a glyph may correspond to multiple bytes of
     /// UTF-8. Use glyphAtIndex() if you need to index by string index.
     virtual const std::vector<Glyph>& glyphs() const = 0;
+    /// Returns the glyphs without requiring a Glyph object for each one to
+    /// be in memory, which is much smaller (and faster) than glyphs() for
+    /// large text. The range is invalidated if the layout is changed.
+    virtual GlyphRange glyphRange() const;  // has impl
+
+    /// Changes the colors (text, background, underline, strikethrough, and
+    /// outline colors) to the ones in `text` without laying out the text
+    /// again, which is much faster than creating a new layout (for example,
+    /// for hover or selection highlighting). `text` must have the same string
+    /// and the same runs as the Text this layout was created from, differing
+    /// only in colors. Returns false if the layout cannot be recolored, in
+    /// which case it is unchanged and a new layout must be created.
+    virtual bool recolor(const Text& text);  // has impl
 
 protected:
     // This *may* call glyphs(). Note that if glyphs are cached, which is wise
@@ -749,11 +991,107 @@ protected:
                 int firstLineLength = -1) const;
     Point calcOffsetForAlignment(int alignment, const Size& size,
                                  const Font::Metrics& firstLineMetrics);
+
+    // Index of the glyphs by line, so that glyphAtPoint() can binary search
+    // instead of checking every glyph. Implementations that cache their
+    // glyphs should cache this alongside them, and clear it when the glyphs
+    // are cleared.
+    struct LineIndex
+    {
+        PicaPt minY;
+        PicaPt maxY;  // largest maxY of this line and all previous lines
+        long firstGlyph;
+        long endGlyph;
+        bool isSortedByX;  // false for some bidirectional text
+    };
+    static std::vector<LineIndex> createLineIndex(const GlyphRange& glyphs);
+    // Returns the index of the glyph containing p, or -1 if there is none
+    static long findGlyphAtPoint(const GlyphRange& glyphs,
+                                 const std::vector<LineIndex>& lines,
+                                 const Point& p);
+
+    friend class DrawContext;
+    // Layouts that are made of other layouts (such as EditableTextLayout)
+    // draw themselves with the context and return true. Layouts created by a
+    // DrawContext return false, and the context draws them natively.
+    virtual bool drawComposite(DrawContext& dc, const Point& topLeft) const;  // has impl
+};
+
+/// A layout for text that is edited, such as in a text editor. The text is
+/// laid out by paragraph (separated by '\n'), so that an edit only needs to
+/// lay out the paragraphs it touches; the glyphs and positions of the other
+/// paragraphs are offset rather than recalculated. Paragraphs are laid out
+/// with the DrawContext passed to the constructor, which must outlive the
+/// layout. Draw using DrawContext::drawText(), or draw() with the visible
+/// area for long text.
+/// Vertical alignment is not supported, as the height changes with editing.
+///
+/// For very long text (e.g. a log viewer), pass maxLaidOutParagraphs. The
+/// paragraphs are then laid out only when they are drawn or queried, and only
+/// that many layouts are kept (least recently used are discarded). Until a
+/// paragraph has been laid out its height is estimated, so the y values of
+/// later paragraphs may change as paragraphs are laid out (as may the line
+/// numbers of glyphs). Note that glyphs() needs to lay out everything, so
+/// use glyphAtPoint(const Point&, Glyph*) for hit-testing.
+class EditableTextLayout : public TextLayout
+{
+public:
+    static const int kLayoutAll = -1;
+
+    EditableTextLayout(const DrawContext& dc, const Text& text,
+                       const PicaPt& width = PicaPt::kZero,
+                       int alignment = Alignment::kLeft,
+                       TextWrapping wrap = kWrapWord,
+                       int maxLaidOutParagraphs = kLayoutAll);
+    ~EditableTextLayout();
+
+    const Text& text() const;
+    /// Replaces the text, laying out everything again.
+    void setText(const Text& text);
+
+    /// Replaces len bytes of the text at start with utf8 (see
+    /// Text::replaceText()), and lays out the affected paragraphs.
+    void replace(long start, long len, const std::string& utf8);
+    void insert(long index, const std::string& utf8);
+    void remove(long start, long len);
+
+    int paragraphCount() const;
+    /// Returns the y-coordinate of the top of the paragraph.
+    PicaPt paragraphY(int paragraph) const;
+    PicaPt paragraphHeight(int paragraph) const;
+    /// Returns the index of the paragraph containing the text index.
+    int paragraphAtIndex(long index) const;
+    /// Returns the index of the paragraph containing y (for scrolling).
+    int paragraphAtY(const PicaPt& y) const;
+    /// Returns the y-coordinates of the tops of the lines in the paragraph.
+    /// This lays out the paragraph.
+    std::vector<PicaPt> lineYs(int paragraph) const;
+
+    const Glyph* glyphAtPoint(const Point& p) const override;
+    bool glyphAtPoint(const Point& p, Glyph *glyph) const override;
+    const TextMetrics& metrics() const override;
+    const std::vector<Glyph>& glyphs() const override;
+
+    /// Draws all the paragraphs; DrawContext::drawText() calls this.
+    void draw(DrawContext& dc, const Point& topLeft) const;
+    /// Draws only the paragraphs that intersect `visible`, which is in
+    /// layout coordinates (that is, relative to topLeft). This only lays
+    /// out the visible paragraphs.
+    void draw(DrawContext& dc, const Point& topLeft, const Rect& visible) const;
+
+protected:
+    bool drawComposite(DrawContext& dc, const Point& topLeft) const override;
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> mImpl;
 };
 
 enum JoinStyle { kJoinMiter = 0, kJoinRound = 1, kJoinBevel = 2 };
 enum EndCapStyle { kEndCapButt = 0, kEndCapRound = 1, kEndCapSquare = 2 };
 enum PaintMode { kPaintStroke = (1 << 0), kPaintFill = (1 << 1), kPaintStrokeAndFill = 3 };
+enum FillRule { kFillWinding = 0, kFillEvenOdd = 1 };
+enum GradientMode { kGradientNative = 0, kGradientLookupTable = 1 };
 
 class BezierPath
 {
@@ -761,6 +1099,28 @@ public:
     BezierPath();
     virtual ~BezierPath();
 
+    /// Returns the smallest rectangle containing the path, including the
+    /// extrema of any curves. Does not include the stroke width.
+    /// The result is cached until the path is changed.
+    Rect bounds() const;
+    /// Returns the rectangle containing all the points of the path,
+    /// including the control points. This is cheaper to compute than
+    /// bounds() and always contains it. Cached until the path is changed.
+    Rect controlBounds() const;
+    /// Returns true if the point is inside the filled area of the path.
+    /// Subpaths that are not closed are treated as closed, as when filling.
+    /// This is intended for hit-testing, so the curves are approximated
+    /// to a small fraction of a pixel.
+    bool contains(const Point& p, FillRule rule = kFillWinding) const;
+    /// Returns the path approximated by line segments, such that no point on
+    /// a curve is further away than `tolerance` from the segments. Each
+    /// subpath is returned as a separate polyline; closed subpaths end with
+    /// their starting point. The last result is cached.
+    std::vector<std::vector<Point>> flatten(const PicaPt& tolerance) const;
+    /// Returns a hash of the path's commands, which is useful as a key for
+    /// caching things derived from the path. Cached until the path is changed.
+    size_t hash() const;
+
     virtual void moveTo(const Point& p);
     virtual void lineTo(const Point& end);
     virtual void quadraticTo(const Point& cp1, const Point& end);
@@ -803,11 +1163,59 @@ public:
     /// DrawContext in the future.
     virtual Id id() const = 0;
 
+    virtual const std::vector<Stop>& stops() const = 0;
+
 protected:
     Gradient();
     Gradient& operator=(const Gradient& rhs) = delete;
 };
 
+/// Collects gradient stops for DrawContext::getGradient(). The hash of the
+/// stops is updated as each stop is added, so a builder can be stored and
+/// used to look up its gradient without hashing or copying the stops again.
+/// Gradients with up to kMaxInlineStops stops (which is nearly all of them)
+/// are stored inline and do not allocate.
+///     auto stops = GradientBuilder().addStop(Color::kBlack, 0.0f)
+///                                   .addStop(Color::kWhite, 1.0f);
+class GradientBuilder
+{
+public:
+    static constexpr int kMaxInlineStops = 4;
+
+    GradientBuilder() {}
+    explicit GradientBuilder(const std::vector<Gradient::Stop>& stops);
+
+    GradientBuilder& addStop(const Color& color, float location);
+    GradientBuilder& addStop(const Gradient::Stop& stop);
+
+    size_t size() const { return mSize; }
+    bool empty() const { return (mSize == 0); }
+    const Gradient::Stop& operator[](size_t i) const { return begin()[i]; }
+    const Gradient::Stop* begin() const
+        { return (mOverflow.empty() ? mInline : mOverflow.data()); }
+    const Gradient::Stop* end() const { return begin() + mSize; }
+
+    std::vector<Gradient::Stop> stops() const;
+
+    /// Returns the hash of the stops; this is computed as stops are added.
+    size_t hash() const { return mHash; }
+
+private:
+    Gradient::Stop mInline[kMaxInlineStops];
+    std::vector<Gradient::Stop> mOverflow;  // holds all the stops if non-empty
+    size_t mSize = 0;
+    size_t mHash = 0;
+};
+
+/// One patch of a mesh gradient: a quadrilateral whose color at each point is
+/// interpolated from the colors at its corners. The corners should go around
+/// the patch (either clockwise or counterclockwise).
+struct GradientMeshPatch
+{
+    Point corners[4];
+    Color colors[4];
+};
+
 enum ImageFormat {
     kImageRGBA32 = 1,
     kImageRGBA32_Premultiplied,
@@ -916,6 +1324,13 @@ public:
     /// creating the data with format as *_Premultiply.
     void premultiplyAlpha();
 
+    /// Blurs the image in place, approximating a Gaussian blur that extends
+    /// radiusPx beyond edges (the standard deviation is radiusPx / 2, like
+    /// CSS box shadows). Pixels outside the image are taken to be the same
+    /// as the edge pixels. Channels are blurred independently, so images
+    /// with alpha should be premultiplied. Ignored for encoded data.
+    void blur(float radiusPx);
+
 protected:
     // Takes ownership of bytes, which should be in a native format.
     // Caller should not use the pointer afterwards, and the destructor will
@@ -959,6 +1374,47 @@ protected:
 
 enum BitmapType { kBitmapRGB = 0, kBitmapRGBA, kBitmapGreyscale, kBitmapAlpha };
 
+/// An offscreen surface that keeps its contents between frames, for content
+/// that is expensive to draw but rarely changes (charts, shadows). Only
+/// redraw it when needed; drawing it with DrawContext::drawLayer() is a
+/// single image draw:
+///     if (layer->needsRedraw()) {
+///         auto &ldc = layer->beginDraw();  // (0, 0) is the upper left
+///         ...
+///         layer->endDraw();
+///     }
+///     dc.drawLayer(layer, topLeft);
+/// Create with DrawContext::createLayer().
+class Layer
+{
+public:
+    explicit Layer(std::shared_ptr<DrawContext> bitmap);
+    virtual ~Layer() {}
+
+    Size size() const;
+
+    /// Returns true if the contents have not been drawn yet, or have been
+    /// invalidated since.
+    bool needsRedraw() const { return mNeedsRedraw; }
+    /// Marks the contents as out of date (for instance, the chart's data
+    /// changed), so that needsRedraw() returns true.
+    void invalidate() { mNeedsRedraw = true; }
+
+    /// Clears the layer to transparent and returns the context to draw
+    /// the contents with.
+    DrawContext& beginDraw();
+    void endDraw();
+
+    /// Returns the contents as an image. This is normally only needed by
+    /// DrawContext::drawLayer().
+    std::shared_ptr<DrawableImage> image();
+
+protected:
+    std::shared_ptr<DrawContext> mBitmap;
+    std::shared_ptr<DrawableImage> mImage;  // created from mBitmap on demand
+    bool mNeedsRedraw = true;
+};
+
 /// Implements an abstract drawable:
 /// - Origin (0, 0) is in the upper left, +x is to the right, +y is down.
 /// - (x, y) is the upper left of the pixel
@@ -1042,6 +1498,16 @@ public:
     static std::shared_ptr<DrawContext> fromX11(
                 void* display, const void* window, int width, int height,
                 float dpi);
+    /// Like fromX11(), but draws into a client-side back buffer, which is
+    /// copied to the window in endDraw(). Only the dirty region is copied if
+    /// drawing was started with beginDraw(dirtyRegion). The window never
+    /// shows partially drawn frames, and drawing does not generate X traffic.
+    /// The buffer is in shared memory if the X server supports MIT-SHM (that
+    /// is, it is local), otherwise it is sent over the connection. Windows
+    /// with unusual visuals fall back to the unbuffered context.
+    static std::shared_ptr<DrawContext> fromX11DoubleBuffered(
+                void* display, const void* window, int width, int height,
+                float dpi);
     static std::shared_ptr<DrawContext> createCairoX11Bitmap(
                 void* display, BitmapType type, int width, int height,
                 float dpi = 72.0f);
@@ -1086,15 +1552,19 @@ public:
     /// object's lifetime, we give out a reference. This reference should NOT
     /// be chached! (This is why it is a reference instead of a pointer, to
     /// make that harder.) The gradient will be created and cached, so future
-    /// calls should return the same gradient. You can also call cache
-    /// Gradient::getId() and call getGradient(); this will be marginally
-    /// faster since it is otherwise necessary to iterate over all the stops
-    /// to compute the cache id.
+    /// calls should return the same gradient. This needs to iterate over all
+    /// the stops to compute the cache id, so for gradients drawn frequently
+    /// prefer getGradient(const GradientBuilder&) or cache Gradient::id().
     virtual Gradient& getGradient(const std::vector<Gradient::Stop>& stops) = 0;
 
     /// Returns a reference to a gradient.
     virtual Gradient& getGradient(size_t id) const = 0;
 
+    /// Returns the gradient for the stops, as above. Since the builder has
+    /// already hashed its stops, once the gradient has been created this is
+    /// a hash table lookup and does not allocate.
+    Gradient& getGradient(const GradientBuilder& stops);
+
     /// Creates a text layout. If width is non-zero, the text will wrap to the
     /// width, and the horizontal alignment will be applied. If height
     /// is non-zero the vertical alignment will be applied. Note that, despite
@@ -1148,6 +1618,22 @@ public:
     virtual void beginDraw() = 0;
     virtual void endDraw() = 0;
 
+    /// Marks the area as needing to be redrawn. The rect is in context
+    /// coordinates, unaffected by any transform. Typically called from
+    /// the window system's expose handler, or when a widget changes.
+    virtual void invalidate(const Rect& r);  // has impl
+    /// Returns the areas invalidated since the last beginDraw(dirtyRegion),
+    /// in context coordinates. Widgets that do not intersect any of the
+    /// rects do not need to be drawn. Contexts that do not track damage
+    /// return the entire context.
+    virtual std::vector<Rect> dirtyRegion() const;  // has impl
+    /// Begins drawing clipped to the union of the rects (normally the
+    /// value of dirtyRegion()), and clears the dirty region. Draw calls
+    /// outside the rects are cheap, so it is acceptable to draw everything,
+    /// although skipping widgets outside the region is cheaper still.
+    /// Contexts that do not track damage draw without clipping.
+    virtual void beginDraw(const std::vector<Rect>& dirtyRegion);  // has impl
+
     virtual void save() = 0;
     virtual void restore() = 0;
 
@@ -1157,6 +1643,22 @@ public:
     /// forgetting that +y is not up in bitmaps.
     virtual void rotate(float degrees) = 0;
     virtual void scale(float sx, float sy) = 0;
+    /// Returns the transform from the current user coordinates to context
+    /// coordinates (that is, the coordinates before any transforms). This is
+    /// the product of all the translate(), rotate(), and scale() calls.
+    virtual AffineTransform currentTransform() const;  // has impl
+    /// Replaces the current transform; setTransform(AffineTransform::kIdentity)
+    /// resets to context coordinates. Like translate(), this is undone by
+    /// restore(), and it does not affect the clip region.
+    virtual void setTransform(const AffineTransform& t);  // has impl
+    /// Applies t to the user coordinates; translate(dx, dy) is the same as
+    /// concatTransform(AffineTransform::translation(dx, dy)).
+    virtual void concatTransform(const AffineTransform& t);  // has impl
+    /// Returns the bounding box of the current clip region in the current
+    /// user coordinates, which is useful for skipping content that cannot
+    /// be visible. This may be larger than the actual clip region (e.g. if
+    /// clipped to a path or the transform is rotated), but never smaller.
+    virtual Rect clipBounds() const;  // has impl
 
     virtual void setFillColor(const Color& color) = 0;
     virtual void setStrokeColor(const Color& color) = 0;
@@ -1196,6 +1698,27 @@ public:
                                         const Point& center,
                                         const PicaPt& startRadius,
                                         const PicaPt& endRadius) = 0;
+    /// Fills the path with a conic (sweep) gradient around center: the stops
+    /// go counterclockwise a full turn, starting at startAngleDeg (0 is to
+    /// the right). Useful for gauges and color wheels.
+    virtual void drawConicGradientPath(std::shared_ptr<BezierPath> path,
+                                       Gradient& gradient,
+                                       const Point& center,
+                                       float startAngleDeg);  // has impl
+    /// Fills the path with a mesh gradient. Areas of the path not covered by
+    /// a patch are not drawn. This replaces drawing many small paths to
+    /// approximate a smooth two-dimensional color change.
+    virtual void drawMeshGradientPath(std::shared_ptr<BezierPath> path,
+                                      const std::vector<GradientMeshPatch>& patches);  // has impl
+
+    /// kGradientNative (the default) lets the platform compute the color of
+    /// each pixel of a gradient. kGradientLookupTable uses a table of colors
+    /// computed once per gradient instead, which is faster when drawing many
+    /// gradients into bitmaps, at the cost of small differences from the
+    /// platform's rendering. Backends that do not support lookup tables
+    /// ignore this.
+    virtual void setGradientMode(GradientMode mode);  // has impl
+    virtual GradientMode gradientMode() const;  // has impl
 
     /// Note that the text sits ON the baseline, which will be aligned with
     /// the vertical pixel boundary. As a result, if the baseline is at y=16,
@@ -1228,6 +1751,32 @@ public:
     virtual void drawImage(std::shared_ptr<DrawableImage> image,
                            const Rect& destRect) = 0;
 
+    /// Creates a layer for content that should be drawn once and then
+    /// reused across frames. The layer's resolution is the same as this
+    /// context's.
+    virtual std::shared_ptr<Layer> createLayer(const Size& size);  // has impl
+    /// Draws the layer's contents with its upper left at topLeft.
+    virtual void drawLayer(std::shared_ptr<Layer> layer, const Point& topLeft,
+                           float opacity = 1.0f);  // has impl
+
+    /// Draws everything until the matching endLayer() into a temporary
+    /// surface, clipped to bounds, which is then composited onto the context
+    /// with the given opacity. Unlike drawing each shape with a translucent
+    /// color, overlapping shapes do not show through each other. beginLayer()
+    /// calls save() and endLayer() calls restore(), and layers may be nested.
+    /// Keep bounds as small as possible, since the surface covers all of it.
+    /// Backends that cannot composite draw directly, ignoring the opacity.
+    virtual void beginLayer(const Rect& bounds, float opacity = 1.0f);  // has impl
+    virtual void endLayer();  // has impl
+
+    /// Draws the shadow that filling the path would cast: the path filled
+    /// with color, offset, and blurred by blurRadius (as in CSS box-shadow).
+    /// This only draws the shadow, so fill the path afterwards. Backends may
+    /// cache the blurred shadow, so reuse the path (positioning it with
+    /// translate()) rather than creating it each frame.
+    virtual void drawShadow(std::shared_ptr<BezierPath> path, const Size& offset,
+                            const PicaPt& blurRadius, const Color& color);  // has impl
+
     virtual void clipToRect(const Rect& rect) = 0;
 
     /// The path will be retained; the caller may let its copy go out of scope.
@@ -1247,6 +1796,11 @@ public:
 
     virtual Font::Metrics fontMetrics(const Font& font) const = 0;
 
+    /// Returns the family of the font that draws codePoint for this font.
+    /// Backends that cache font fallbacks should override this so that
+    /// Font::prewarmFallbacks() fills the cache.
+    virtual std::string fontFamilyForCodePoint(const Font& font, uint32_t codePoint) const;  // has impl
+
     /// Returns the metrics for a single line of text
     virtual TextMetrics textMetrics(const char *textUTF8, const Font& font,
                                     PaintMode mode = kPaintFill) const = 0;
@@ -1261,11 +1815,30 @@ public:
     /// printing calls draw once for each page.
     virtual void addPage();
 
+    /// Returns the number of draw calls since beginDraw() that were skipped
+    /// because they could not affect any pixel inside the current clip
+    /// region (for instance, rows of a list that are scrolled out of view).
+    /// This is intended for debugging and performance tuning. Backends that
+    /// do not cull return 0.
+    virtual int culledDrawCount() const;  // has impl
+
+    /// Returns the number of times since beginDraw() that a draw call did
+    /// not need to give the underlying graphics system a fill or stroke
+    /// setting (color, stroke width, end cap, join style, dashes) because it
+    /// already had that value. This is intended for debugging and
+    /// performance tuning. Backends that do not track this return 0.
+    virtual int avoidedStateChangeCount() const;  // has impl
+
 protected:
     DrawContext(void *nativeDC, int width, int height, float dpi, float nativeDPI);
 
     void setInitialState();
 
+    // Implementations of drawText(const TextLayout&, ...) must call this
+    // first, and return if it returns true (the layout drew itself).
+    bool drawCompositeText(const TextLayout& layout, const Point& topLeft)
+        { return layout.drawComposite(*this, topLeft); }
+
 protected:
     // This is void* so that we don't pull in platform header files.
     void *mNativeDC;
@@ -1273,6 +1846,9 @@ protected:
     float mNativeDPI;
     int mWidth;
     int mHeight;
+
+private:
+    std::unordered_map<size_t, Gradient::Id> mGradientIds;  // GradientBuilder::hash() -> id
 };
 
 } // namespace $ND_NAMESPACE
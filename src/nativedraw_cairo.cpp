@@ -25,16 +25,24 @@
 #include "nativedraw_private.h"
 
 #include <X11/Xlib.h>
+#include <X11/Xutil.h>
 #include <X11/extensions/Xrender.h>
+#include <X11/extensions/XShm.h>
 #include <cairo/cairo.h>
 #include <cairo/cairo-xlib.h>
 #include <cairo/cairo-xlib-xrender.h>
 #include <pango/pangocairo.h>
+#if PANGO_VERSION_CHECK(1, 44, 0)
+#include <hb-ot.h>  // for cap-height and x-height
+#endif
 
 #include <algorithm>
 #include <iostream>
+#include <list>
 
 #include <assert.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
 
 #define kDebugDraw	0
 
@@ -223,6 +231,10 @@ public:
             cairo_pattern_destroy(mLinearGradient);
             mLinearGradient = nullptr;
         }
+        if (mConicGradient) {
+            cairo_pattern_destroy(mConicGradient);
+            mConicGradient = nullptr;
+        }
         for (auto &g : mRadialGradients) {
             cairo_pattern_destroy(g.second);
         }
@@ -240,6 +252,8 @@ public:
 
     Id id() const override { return mId; }
 
+    const std::vector<Stop>& stops() const override { return mInfo.stops; }
+
     cairo_pattern_t* linearPattern()
     {
         if (!mLinearGradient) {
@@ -286,18 +300,180 @@ public:
         return it->second;
     }
 
+    // The conic gradient is a mesh of pie slices with radius 1 around
+    // (0, 0), going a full turn counterclockwise (on the screen, where +y is
+    // down) from the +x axis.
+    cairo_pattern_t* conicPattern()
+    {
+        if (!mConicGradient) {
+            mConicGradient = cairo_pattern_create_mesh();
+            auto stops = sortedStops();
+            if (!stops.empty()) {
+                // Pad the ends with the first and last colors
+                stops.insert(stops.begin(), { stops.front().color, 0.0f });
+                stops.push_back({ stops.back().color, 1.0f });
+            }
+            for (size_t i = 0;  i + 1 < stops.size();  ++i) {
+                float t0 = stops[i].location;
+                float t1 = stops[i + 1].location;
+                if (t1 <= t0) {
+                    continue;
+                }
+                // Slices need to be at most a quarter turn so that the bezier
+                // approximation of the arc is accurate.
+                int n = std::max(1, int(std::ceil((t1 - t0) / 0.25f - 0.001f)));
+                for (int j = 0;  j < n;  ++j) {
+                    float f0 = float(j) / float(n);
+                    float f1 = float(j + 1) / float(n);
+                    addConicSlice(mConicGradient,
+                                  t0 + f0 * (t1 - t0), t0 + f1 * (t1 - t0),
+                                  stops[i].color.blend(stops[i + 1].color, f0),
+                                  stops[i].color.blend(stops[i + 1].color, f1));
+                }
+            }
+        }
+        return mConicGradient;
+    }
+
+    static constexpr int kColorTableSize = 1024;
+
+    // Returns the colors of the gradient at kColorTableSize evenly spaced
+    // locations from 0 to 1, as premultiplied ARGB32 pixels. Like Cairo, the
+    // colors are interpolated unpremultiplied and the ends are padded.
+    const uint32_t* colorTable()
+    {
+        if (mColorTable.empty()) {
+            auto stops = sortedStops();
+
+            auto toPixel = [](const Color& c) {
+                auto a = std::min(std::max(c.alpha(), 0.0f), 1.0f);
+                auto premult = [a](float v) {
+                    return uint32_t(std::min(std::max(v, 0.0f), 1.0f) * a * 255.0f + 0.5f);
+                };
+                return (uint32_t(a * 255.0f + 0.5f) << 24) | (premult(c.red()) << 16) |
+                       (premult(c.green()) << 8) | premult(c.blue());
+            };
+
+            mColorTable.resize(kColorTableSize, 0);
+            size_t s = 0;
+            for (int i = 0;  i < kColorTableSize && !stops.empty();  ++i) {
+                float t = float(i) / float(kColorTableSize - 1);
+                // Repeated stops are a sharp transition, so use the last one
+                // at or before t.
+                while (s + 1 < stops.size() && stops[s + 1].location <= t) {
+                    ++s;
+                }
+                if (t <= stops[s].location || s + 1 >= stops.size()) {
+                    mColorTable[i] = toPixel(stops[s].color);
+                } else {
+                    float f = (t - stops[s].location) / (stops[s + 1].location - stops[s].location);
+                    mColorTable[i] = toPixel(stops[s].color.blend(stops[s + 1].color, f));
+                }
+            }
+        }
+        return mColorTable.data();
+    }
+
     const GradientInfo& info() const { return mInfo; }
-    
+
 private:
+    // Cairo orders stops by location (keeping the order of equal ones),
+    // so anything that interprets the stops itself needs to as well.
+    std::vector<Stop> sortedStops() const
+    {
+        auto stops = mInfo.stops;
+        std::stable_sort(stops.begin(), stops.end(),
+                         [](const Stop& a, const Stop& b) { return a.location < b.location; });
+        return stops;
+    }
+
+    static void addConicSlice(cairo_pattern_t *mesh, float t0, float t1,
+                              const Color& c0, const Color& c1)
+    {
+        const double kTwoPi = 2.0 * 3.14159265358979323846;
+        double a0 = kTwoPi * double(t0);
+        double a1 = kTwoPi * double(t1);
+        // Points on the arc are (cos a, -sin a), since +y is down, so the
+        // tangent is (-sin a, -cos a).
+        double x0 = std::cos(a0), y0 = -std::sin(a0);
+        double x1 = std::cos(a1), y1 = -std::sin(a1);
+        double k = 4.0 / 3.0 * std::tan(0.25 * (a1 - a0));
+        cairo_mesh_pattern_begin_patch(mesh);
+        cairo_mesh_pattern_move_to(mesh, 0.0, 0.0);
+        cairo_mesh_pattern_line_to(mesh, x0, y0);
+        cairo_mesh_pattern_curve_to(mesh, x0 - k * std::sin(a0), y0 - k * std::cos(a0),
+                                    x1 + k * std::sin(a1), y1 + k * std::cos(a1),
+                                    x1, y1);
+        cairo_mesh_pattern_line_to(mesh, 0.0, 0.0);
+        for (int corner = 0;  corner < 4;  ++corner) {
+            const Color &c = (corner < 2 ? c0 : c1);
+            cairo_mesh_pattern_set_corner_color_rgba(mesh, corner, c.red(), c.green(),
+                                                     c.blue(), c.alpha());
+        }
+        cairo_mesh_pattern_end_patch(mesh);
+    }
+
     static Id gNextId;
 
     Id mId;
     cairo_pattern_t *mLinearGradient = nullptr;
     std::unordered_map<float, cairo_pattern_t *> mRadialGradients;
+    cairo_pattern_t *mConicGradient = nullptr;
+    std::vector<uint32_t> mColorTable;
     GradientInfo mInfo;
 };
 Gradient::Id CairoGradient::gNextId = 1;
 
+// These fill one row of pixels from a gradient's color table, where (x, y)
+// is the center of the first pixel in gradient coordinates and (dx, dy)
+// is the step to the next pixel. The loops are simple enough that the
+// compiler can vectorize the coordinate math.
+void fillLinearGradientRow(uint32_t *row, int n, double x, double dx,
+                           const uint32_t *colors)
+{
+    const float maxIdx = float(CairoGradient::kColorTableSize - 1);
+    float pos = float(x) * maxIdx;
+    float step = float(dx) * maxIdx;
+    for (int i = 0;  i < n;  ++i) {
+        float idx = std::min(std::max(pos + float(i) * step, 0.0f), maxIdx);
+        row[i] = colors[int(idx + 0.5f)];
+    }
+}
+
+void fillRadialGradientRow(uint32_t *row, int n, double x, double y,
+                           double dx, double dy, float startRadius,
+                           const uint32_t *colors)
+{
+    const float maxIdx = float(CairoGradient::kColorTableSize - 1);
+    const float scale = maxIdx / (1.0f - startRadius);
+    for (int i = 0;  i < n;  ++i) {
+        float px = float(x + double(i) * dx);
+        float py = float(y + double(i) * dy);
+        float idx = (std::sqrt(px * px + py * py) - startRadius) * scale;
+        idx = std::min(std::max(idx, 0.0f), maxIdx);
+        row[i] = colors[int(idx + 0.5f)];
+    }
+}
+
+void fillConicGradientRow(uint32_t *row, int n, double x, double y,
+                          double dx, double dy, const uint32_t *colors)
+{
+    const float kTwoPi = 2.0f * 3.14159265358979323846f;
+    const float maxIdx = float(CairoGradient::kColorTableSize - 1);
+    const float scale = maxIdx / kTwoPi;
+    for (int i = 0;  i < n;  ++i) {
+        float px = float(x + double(i) * dx);
+        float py = float(y + double(i) * dy);
+        // Counterclockwise on the screen, where +y is down
+        float angle = std::atan2(-py, px);
+        if (angle < 0.0f) {
+            angle += kTwoPi;
+        }
+        float idx = std::min(angle * scale, maxIdx);
+        row[i] = colors[int(idx + 0.5f)];
+    }
+}
+
 CairoGradient* createGradient(const GradientInfo& info, float /*dpi*/)
 {
     return new CairoGradient(info);
@@ -362,12 +538,226 @@ private:
 };
 TextContext gPangoContext;
 
+// Cap-height and x-height are properties of the face, so they are the same
+// (relative to the em) for all sizes. This is fortunate, since Pango does not
+// provide them, and they are expensive to compute.
+struct FaceMetrics
+{
+    float capHeightEm;
+    float xHeightEm;
+};
+
+#if PANGO_VERSION_CHECK(1, 44, 0)
+// Returns the value from the OS/2 table, if it exists, otherwise the top
+// of the glyph (which should be flat and sit on the baseline). The value is
+// in the font's units.
+static float calcFaceHeight(hb_font_t *font, hb_ot_metrics_tag_t tag,
+                            hb_codepoint_t flatGlyphChar)
+{
+    hb_position_t pos = 0;
+#if HB_VERSION_ATLEAST(2, 6, 0)
+    if (hb_ot_metrics_get_position(font, tag, &pos) && pos > 0) {
+        return float(pos);
+    }
+#endif
+    hb_codepoint_t glyph;
+    hb_glyph_extents_t extents;
+    if (hb_font_get_nominal_glyph(font, flatGlyphChar, &glyph)
+        && hb_font_get_glyph_extents(font, glyph, &extents)) {
+        return float(extents.y_bearing);
+    }
+    return 0.0f;
+}
+#else
+static float calcInkHeight(const char *text, PangoFontDescription *desc)
+{
+    PangoRectangle ink;
+    auto *layout = pango_layout_new(gPangoContext.context());
+    pango_layout_set_text(layout, text, -1 /* null terminated*/);
+    pango_layout_set_font_description(layout, desc);
+    pango_layout_get_extents(layout, &ink, nullptr);
+    g_object_unref(layout);
+    return float(ink.height) / float(PANGO_SCALE);
+}
+#endif
+
+static const FaceMetrics& getFaceMetrics(const Font& font, float dpi,
+                                         PangoFont *pangoFont,
+                                         PangoFontDescription *desc)
+{
+    // Keep the font, since different faces may have the same hash. (Fonts
+    // are interned, so comparing them is cheap.)
+    static std::unordered_multimap<std::size_t, std::pair<Font, FaceMetrics>> gFaceMetrics;
+
+    auto faceFont = font.fontWithPointSize(PicaPt::kZero);
+    auto key = faceFont.hash();
+    auto range = gFaceMetrics.equal_range(key);
+    for (auto it = range.first;  it != range.second;  ++it) {
+        if (it->second.first == faceFont) {
+            return it->second.second;
+        }
+    }
+
+    FaceMetrics face = { 0.0f, 0.0f };
+#if PANGO_VERSION_CHECK(1, 44, 0)
+    // The font Pango gives us is scaled to the size; a new font from the face
+    // uses the face's units, which are what the OS/2 table uses.
+    if (auto *pangoHB = pango_font_get_hb_font(pangoFont)) {
+        auto *hbFace = hb_font_get_face(pangoHB);
+        auto *hbFont = hb_font_create(hbFace);
+        float unitsPerEm = float(hb_face_get_upem(hbFace));
+        if (unitsPerEm > 0.0f) {
+            face.capHeightEm = calcFaceHeight(hbFont, HB_OT_METRICS_TAG_CAP_HEIGHT, 'H') / unitsPerEm;
+            face.xHeightEm = calcFaceHeight(hbFont, HB_OT_METRICS_TAG_X_HEIGHT, 'x') / unitsPerEm;
+        }
+        hb_font_destroy(hbFont);
+    }
+#else
+    // Older Pango does not give access to the font, so measure the ink of
+    // the glyphs. cap-height is for flat letters (H,I but not A,O, etc. which
+    // may extend above), and x-height is obviously height of "x"
+    float emPx = font.pointSize().toPixels(dpi);
+    if (emPx > 0.0f) {
+        face.capHeightEm = calcInkHeight("H", desc) / emPx;
+        face.xHeightEm = calcInkHeight("x", desc) / emPx;
+    }
+#endif
+    return gFaceMetrics.insert({key, {faceFont, face}})->second.second;
+}
+
 struct PangoFontInfo
 {
 public:
     PangoFontDescription *fontDescription = nullptr;
-    bool metricsInitialized = false;
-    Font::Metrics metrics;
+
+    PangoFontInfo(const Font& font, float dpi) : mFont(font), mDPI(dpi) {}
+
+    // Many fonts are only used for drawing, so only compute the metrics
+    // if they are needed.
+    const Font::Metrics& metrics()
+    {
+        if (!mMetricsInitialized) {
+            calcMetrics();
+            mMetricsInitialized = true;
+        }
+        return mMetrics;
+    }
+
+    // Returns the family of the fallback font for the code point, or nullptr
+    // if this font has the code point (or there is no fallback that does).
+    // Pango searches fontconfig for a fallback in each new layout, so this
+    // remembers the result for each block of code points.
+    const std::string* fallbackFamily(uint32_t codePoint)
+    {
+        if (!mCoverage) {
+            auto *pangoFont = pango_context_load_font(gPangoContext.context(),
+                                                      fontDescription);
+            if (!pangoFont) {
+                return nullptr;
+            }
+            mCoverage = pango_font_get_coverage(pangoFont, pango_language_get_default());
+            g_object_unref(pangoFont);
+        }
+        if (!mCoverage || pango_coverage_get(mCoverage, int(codePoint)) == PANGO_COVERAGE_EXACT) {
+            return nullptr;
+        }
+
+        uint32_t block = (codePoint >> 7);
+        auto it = mFallbacks.find(block);
+        if (it == mFallbacks.end()) {
+            Fallback fallback;
+            auto *fontset = pango_context_load_fontset(gPangoContext.context(),
+                                                       fontDescription,
+                                                       pango_language_get_default());
+            if (fontset) {
+                if (auto *pangoFont = pango_fontset_get_font(fontset, codePoint)) {
+                    auto *desc = pango_font_describe(pangoFont);
+                    fallback.family = pango_font_description_get_family(desc);
+                    fallback.coverage = pango_font_get_coverage(pangoFont, pango_language_get_default());
+                    pango_font_description_free(desc);
+                    g_object_unref(pangoFont);
+                }
+                g_object_unref(fontset);
+            }
+            it = mFallbacks.insert({block, fallback}).first;
+        }
+        // The fallback was found for a different code point in the block;
+        // it may not have this one.
+        auto &fallback = it->second;
+        if (!fallback.coverage || fallback.family.empty()
+            || pango_coverage_get(fallback.coverage, int(codePoint)) != PANGO_COVERAGE_EXACT) {
+            return nullptr;
+        }
+        return &fallback.family;
+    }
+
+    void freeFallbacks()
+    {
+        if (mCoverage) {
+            pango_coverage_unref(mCoverage);
+            mCoverage = nullptr;
+        }
+        for (auto &block_fallback : mFallbacks) {
+            if (block_fallback.second.coverage) {
+                pango_coverage_unref(block_fallback.second.coverage);
+            }
+        }
+        mFallbacks.clear();
+    }
+
+private:
+    Font mFont;
+    float mDPI;
+    bool mMetricsInitialized = false;
+    Font::Metrics mMetrics;
+
+    struct Fallback
+    {
+        std::string family;
+        PangoCoverage *coverage = nullptr;
+    };
+    PangoCoverage *mCoverage = nullptr;
+    std::unordered_map<uint32_t, Fallback> mFallbacks;
+
+    void calcMetrics()
+    {
+        // pango_context_get_metrics() loads the fontset and lays out a sample
+        // string, but we only need the metrics of the primary font.
+        auto *pangoFont = pango_context_load_font(gPangoContext.context(),
+                                                  fontDescription);
+        PangoFontMetrics *metrics = nullptr;
+        if (pangoFont) {
+            metrics = pango_font_get_metrics(pangoFont, pango_language_get_default());
+        }
+        if (metrics) {
+            mMetrics.ascent = PicaPt::fromPixels(float(pango_font_metrics_get_ascent(metrics)) / float(PANGO_SCALE), mDPI);
+            mMetrics.descent = PicaPt::fromPixels(float(pango_font_metrics_get_descent(metrics)) / float(PANGO_SCALE), mDPI);
+            mMetrics.underlineOffset = PicaPt::fromPixels(float(-pango_font_metrics_get_underline_position(metrics)) / float(PANGO_SCALE), mDPI);
+            mMetrics.underlineThickness = PicaPt::fromPixels(float(pango_font_metrics_get_underline_thickness(metrics)) / float(PANGO_SCALE), mDPI);
+            pango_font_metrics_unref(metrics);
+
+            // Pango's font metrics only provides ascent and descent, we
+            // need to calculate cap-height, x-height and leading. It's not
+            // clear how to calculate a consistent leading, so just set it
+            // to zero (which many fonts do anyway).
+            mMetrics.leading = PicaPt::kZero;
+
+            auto &face = getFaceMetrics(mFont, mDPI, pangoFont, fontDescription);
+            mMetrics.capHeight = face.capHeightEm * mFont.pointSize();
+            mMetrics.xHeight = face.xHeightEm * mFont.pointSize();
+
+            mMetrics.lineHeight = mMetrics.ascent + mMetrics.descent + mMetrics.leading;
+        } else {
+            mMetrics.ascent = PicaPt::kZero;
+            mMetrics.descent = PicaPt::kZero;
+            mMetrics.leading = PicaPt::kZero;
+            mMetrics.capHeight = PicaPt::kZero;
+            mMetrics.xHeight = PicaPt::kZero;
+        }
+        if (pangoFont) {
+            g_object_unref(pangoFont);
+        }
+    }
 };
 
 static PangoFontInfo* createFont(const Font& font, float dpi)
@@ -384,65 +774,82 @@ static PangoFontInfo* createFont(const Font& font, float dpi)
     // the 72 dpi value by 72/96 = 0.75.
                                     int(std::round(0.75f * font.pointSize().toPixels(dpi) * float(PANGO_SCALE))));
 
-    auto *info = new PangoFontInfo();
+    auto *info = new PangoFontInfo(font, dpi);
     info->fontDescription = desc;
-
-    auto *metrics = pango_context_get_metrics(gPangoContext.context(),
-                                              info->fontDescription,
-                                              pango_language_get_default());
-    if (metrics) {
-        info->metrics.ascent = PicaPt::fromPixels(float(pango_font_metrics_get_ascent(metrics)) / float(PANGO_SCALE), dpi);
-        info->metrics.descent = PicaPt::fromPixels(float(pango_font_metrics_get_descent(metrics)) / float(PANGO_SCALE), dpi);
-        info->metrics.underlineOffset = PicaPt::fromPixels(float(-pango_font_metrics_get_underline_position(metrics)) / float(PANGO_SCALE), dpi);
-        info->metrics.underlineThickness = PicaPt::fromPixels(float(pango_font_metrics_get_underline_thickness(metrics)) / float(PANGO_SCALE), dpi);
-        pango_font_metrics_unref(metrics);
-
-        // Pango's font metrics only provides ascent and descent, we
-        // need to calculate cap-height, x-height and leading. It's not
-        // clear how to calculate a consistent leading, so just set it
-        // to zero (which many fonts do anyway).
-        info->metrics.leading = PicaPt::kZero;
-
-
-        // cap-height is for flat letters (H,I but not A,O, etc. which
-        // may extend above)
-        PangoRectangle ink;
-        auto *layout = pango_layout_new(gPangoContext.context());
-        pango_layout_set_text(layout, "H", -1 /* null terminated*/);
-        pango_layout_set_font_description(layout, info->fontDescription);
-        pango_layout_get_pixel_extents(layout, &ink, nullptr);
-        g_object_unref(layout);
-        info->metrics.capHeight = PicaPt::fromPixels(ink.height, dpi);
-
-        // x-height is obviously height of "x"
-        layout = pango_layout_new(gPangoContext.context());
-        pango_layout_set_text(layout, "x", -1 /* null terminated*/);
-        pango_layout_set_font_description(layout, info->fontDescription);
-        pango_layout_get_pixel_extents(layout, &ink, nullptr);
-        g_object_unref(layout);
-        info->metrics.xHeight = PicaPt::fromPixels(ink.height, dpi);
-
-        info->metrics.lineHeight = info->metrics.ascent + info->metrics.descent + info->metrics.leading;
-
-        info->metricsInitialized = true;
-    } else {
-        info->metrics.ascent = PicaPt::kZero;
-        info->metrics.descent = PicaPt::kZero;
-        info->metrics.leading = PicaPt::kZero;
-        info->metrics.capHeight = PicaPt::kZero;
-        info->metrics.xHeight = PicaPt::kZero;
-    }
     return info;
 }
 
 static void destroyFont(PangoFontInfo *fontResource)
 {
+    fontResource->freeFallbacks();
     pango_font_description_free(fontResource->fontDescription);
     delete fontResource;
 }
 
 static ResourceManager<Font, PangoFontInfo*> gFontMgr(createFont, destroyFont);
 
+// Returns true if the code point is drawn as part of the previous character
+// (combining marks, joiners, variation selectors, etc.), so it needs to use
+// the same font.
+static bool continuesCluster(uint32_t c)
+{
+    return ((c >= 0x0300 && c <= 0x036f) || (c >= 0x1ab0 && c <= 0x1aff)
+            || (c >= 0x1dc0 && c <= 0x1dff) || (c >= 0x20d0 && c <= 0x20ff)
+            || c == 0x200c || c == 0x200d
+            || (c >= 0xfe00 && c <= 0xfe0f) || (c >= 0xfe20 && c <= 0xfe2f)
+            || (c >= 0xe0020 && c <= 0xe007f) || (c >= 0xe0100 && c <= 0xe01ef));
+}
+
+// Adds family attributes for the characters in [start, start + len) that
+// the font does not have, using the cached fallbacks, so that Pango does not
+// need to search for them again.
+static void addFallbackAttrs(const std::string& utf8, int start, int len,
+                             PangoFontInfo *pf, std::vector<PangoAttribute*> *attrs)
+{
+    const char *text = utf8.c_str();
+    const char *c = text + start;
+    const char *end = c + len;
+    const std::string *family = nullptr;
+    int familyStart = 0;
+    auto addAttr = [text, attrs, &family, &familyStart](const char *familyEnd) {
+        auto *a = pango_attr_family_new(family->c_str());
+        a->start_index = familyStart;
+        a->end_index = int(familyEnd - text);
+        attrs->push_back(a);
+        family = nullptr;
+    };
+
+    while (c < end) {
+        if (((*c) & 0x80) == 0) {  // assume fonts have ASCII
+            if (family) {
+                addAttr(c);
+            }
+            ++c;
+            continue;
+        }
+
+        uint32_t utf32;
+        const char *next = nextCodePoint(c, &utf32);
+        // Keep the base character's font, whether or not it is a fallback
+        if (continuesCluster(utf32)) {
+            c = next;
+            continue;
+        }
+        auto *fallback = pf->fallbackFamily(utf32);
+        if (fallback != family) {
+            if (family) {
+                addAttr(c);
+            }
+            family = fallback;
+            familyStart = int(c - text);
+        }
+        c = next;
+    }
+    if (family) {
+        addAttr(end);
+    }
+}
+
 } // namespace
 
 //-------------------------------- Text Obj------------------------------------
@@ -531,6 +938,7 @@ public:
         mCmds.emplace_back();
         mCmds.back().cmd = kStrokedText;
         mCmds.back().arg.stroke.w = pgThickness * kInvPangoScale;
+        mMaxStrokeWidth = std::max(mMaxStrokeWidth, mCmds.back().arg.stroke.w);
         mCmds.emplace_back();
         mCmds.back().cmd = kDrawText;
         mCmds.back().arg.run = run;
@@ -551,6 +959,7 @@ public:
         mCmds.emplace_back();
         mCmds.back().cmd = type;
         mCmds.back().arg.stroke.w = strokeWidth;
+        mMaxStrokeWidth = std::max(mMaxStrokeWidth, strokeWidth);
         mCmds.emplace_back();
         mCmds.back().cmd = kPointData;
         mCmds.back().arg.pt.x = mXOffset + pgX0 * kInvPangoScale;
@@ -561,6 +970,25 @@ public:
         mCmds.back().arg.pt.y = mYOffset + pgY1 * kInvPangoScale + pxYAlign;
     }
 
+    size_t nCommands() const { return mCmds.size(); }
+
+    // Replaces the color of an existing kSetFG command
+    void setColor(size_t cmdIndex, int rgba)
+    {
+        assert(mCmds[cmdIndex].cmd == kSetFG);
+        mCmds[cmdIndex].arg.rgba = rgba;
+    }
+
+    // Removes all the commands (but not the offset)
+    void clear()
+    {
+        mCmds.clear();
+        mMaxStrokeWidth = 0.0f;
+    }
+
+    // The widest stroke (outlines, underlines, strikethroughs), in pixels
+    float maxStrokeWidth() const { return mMaxStrokeWidth; }
+
     void draw(cairo_t *gc) const
     {
 #if kDebugDraw
@@ -714,6 +1142,7 @@ private:
     float mDPI;
     float mXOffset = 0.0f;
     float mYOffset = 0.0f;
+    float mMaxStrokeWidth = 0.0f;
 };
 
 class TextObj : public TextLayout
@@ -764,9 +1193,8 @@ public:
         // letter spacing), and then assign a "color" value that is an index
         // into the array of TextRuns, for later.
         std::vector<Font::Metrics> runMetrics;
-        std::vector<int> runBaselinePangoOffsets;
         runMetrics.reserve(text.runs().size());
-        runBaselinePangoOffsets.reserve(text.runs().size());
+        mRunBaselinePangoOffsets.reserve(text.runs().size());
         std::vector<PangoAttribute*> attrs;
         attrs.reserve(2 * text.runs().size());
         for (size_t i = 0;  i < text.runs().size();  ++i) {
@@ -801,9 +1229,9 @@ public:
                     font = fontSizedForSuperSubscript(font);
                     PangoFontInfo *pfSmall = gFontMgr.get(font, mDPI);
                     if (hasSuperscript) {
-                        baselineOffsetPango = int(std::round((pf->metrics.capHeight - pfSmall->metrics.capHeight).toPixels(mDPI) * float(PANGO_SCALE)));
+                        baselineOffsetPango = int(std::round((pf->metrics().capHeight - pfSmall->metrics().capHeight).toPixels(mDPI) * float(PANGO_SCALE)));
                     } else if (hasSubscript) {
-                        baselineOffsetPango = -int(std::round((pf->metrics.descent- pfSmall->metrics.descent).toPixels(mDPI) * float(PANGO_SCALE)));
+                        baselineOffsetPango = -int(std::round((pf->metrics().descent- pfSmall->metrics().descent).toPixels(mDPI) * float(PANGO_SCALE)));
                     }
                     pf = pfSmall;
                     auto *a = pango_attr_rise_new(baselineOffsetPango);
@@ -815,8 +1243,10 @@ public:
                 a->start_index = run.startIndex;
                 a->end_index = run.startIndex + run.length;
                 attrs.push_back(a);
+
+                addFallbackAttrs(text.text(), run.startIndex, run.length, pf, &attrs);
             }
-            runBaselinePangoOffsets.push_back(baselineOffsetPango);
+            mRunBaselinePangoOffsets.push_back(baselineOffsetPango);
 
             if (run.characterSpacing.isSet && run.characterSpacing.value != PicaPt::kZero) {
                 // TODO: maybe Pango assumes 96 DPI (see Font above)?
@@ -836,7 +1266,7 @@ public:
             attrs.push_back(a);
             }
         }
-        assert(runMetrics.size() == runBaselinePangoOffsets.size());
+        assert(runMetrics.size() == mRunBaselinePangoOffsets.size());
 
         if (text.lineHeightMultiple() > 0.0f) {
 #if PANGO_VERSION_CHECK(1, 44, 0)
@@ -900,172 +1330,22 @@ public:
         mDraw.setOffset(mAlignmentOffset.x.toPixels(mDPI),
                         mAlignmentOffset.y.toPixels(mDPI));
 
-        // Create the draw commands.
-        PangoRectangle lineExtents;
-        int currentColor = 0;  // transparent black
-        PangoLayoutIter *it = pango_layout_get_iter(mLayout);
-        do {
-            PangoLayoutRun *run = pango_layout_iter_get_run(it);
-            if (run) {  // end of line always has a NULL run
-                auto *attrs = run->item->analysis.extra_attrs;
-                unsigned int runIdx = -1;
-                while (attrs) {
-                    auto *attr = (PangoAttribute*)attrs->data;
-                    if (attr->klass->type == PANGO_ATTR_FOREGROUND) {
-                        auto *colorAttr = (PangoAttrColor*)attr;
-                        unsigned int lower = (unsigned int)(colorAttr->color.red);
-                        unsigned int upper = ((unsigned int)(colorAttr->color.green)) << 16;
-                        runIdx = upper | lower;
-                        break;
-                    }
-                    attrs = attrs->next;
-                }
-                assert(runIdx >= 0);
-                auto &textRun = text.runs()[runIdx];
-
-                bool bgSet = (textRun.backgroundColor.isSet
-                              && textRun.backgroundColor.value.alpha() > 0.0f);
-                bool underlineSet = (textRun.underlineStyle.isSet
-                    && textRun.underlineStyle.value != kUnderlineNone
-                    && !(textRun.underlineColor.isSet
-                         && textRun.underlineColor.value.alpha() == 0.0f));
-                bool strikethroughSet = (textRun.strikethrough.isSet
-                                         && textRun.strikethrough.value);
-                PangoRectangle extents;
-                PangoFont *pgfont = run->item->analysis.font;
-                pango_layout_iter_get_run_extents(it, nullptr, &extents);
-                int pgBaseline = pango_layout_iter_get_baseline(it);
-
-                if (underlineSet || strikethroughSet) {
-                    PangoFont *pgfont = run->item->analysis.font;
-                    PangoLanguage *pglang = run->item->analysis.language;
-                }
-
-                // If a background color is set, it needs to be drawn first.
-                if (bgSet) {
-                    auto bgRGBA = textRun.backgroundColor.value.toRGBA();
-                    if (bgRGBA != currentColor) {
-                        mDraw.addColor(bgRGBA);
-                        currentColor = bgRGBA;
-                    }
-                    mDraw.addRect(extents);
-                }
-
-                bool isFgDefault = false;
-                Color fg = textRun.color.value;
-                if ((textRun.color.value.red() == Color::kTextDefault.red() &&
-                     textRun.color.value.green() == Color::kTextDefault.green() &&
-                     textRun.color.value.blue() == Color::kTextDefault.blue())) {
-                    fg = defaultReplacementColor;
-                    fg.setAlpha(textRun.color.value.alpha());
-                }
-                int fgRGBA = fg.toRGBA();
-                if (fgRGBA != currentColor) {
-                    mDraw.addColor(fgRGBA );
-                    currentColor = fgRGBA ;
-                }
-
-                // Draw underline *before* text, so text descenders are on top
-                if (underlineSet) {
-                    if (textRun.underlineColor.isSet) {
-                        int rgba = textRun.underlineColor.value.toRGBA();
-                        if (rgba != currentColor) {
-                            mDraw.addColor(rgba);
-                            currentColor = rgba;
-                        }
-                    }
-                    
-                    PangoFont *pgfont = run->item->analysis.font;
-                    PangoLanguage *pglang = run->item->analysis.language;
-                    PangoFontMetrics *pgmetrics = pango_font_get_metrics(pgfont, pglang);
-                    // Note that underline position is *above* the baseline
-                    // (so usually negative).
-                    auto pgY = pgBaseline - runBaselinePangoOffsets[runIdx] - pango_font_metrics_get_underline_position(pgmetrics);
-                    auto pgWidth = pango_font_metrics_get_underline_thickness(pgmetrics);
-                    DrawPangoText::Cmd cmd = DrawPangoText::kStroke;
-                    switch (textRun.underlineStyle.value) {
-                        case kUnderlineNone: // to make compiler happy about enum
-                        case kUnderlineSingle:
-                            cmd = DrawPangoText::kStroke;
-                            break;
-                        case kUnderlineDouble:
-                            cmd = DrawPangoText::kDoubleStroke;
-                            break;
-                        case kUnderlineDotted:
-                            cmd = DrawPangoText::kDottedStroke;
-                            break;
-                        case kUnderlineWavy:
-                            cmd = DrawPangoText::kWavyStroke;
-                            break;
-                    }
-                    mDraw.addLine(cmd, extents.x, pgY,
-                                  extents.x + extents.width, pgY, pgWidth);
-                }
-
-                // Draw the actual text (unless transparent)
-                if (fgRGBA != currentColor) { // underline might have changed
-                    mDraw.addColor(fgRGBA );
-                    currentColor = fgRGBA ;
-                }
-                int pgTextY = pgBaseline;
-                if (fg.alpha() > 0.0f) {
-                    mDraw.addText(run, extents.x,
-                                  pgBaseline - runBaselinePangoOffsets[runIdx]);
-                }
-
-                // Draw outlined text
-                bool isOutlineSet = (textRun.outlineColor.isSet && textRun.outlineColor.value.alpha() > 0.0f && !(textRun.outlineStrokeWidth.isSet && textRun.outlineStrokeWidth.value == PicaPt::kZero));
-                bool outlineOverrideSet = (strokeWidth > PicaPt::kZero && strokeColor.alpha() > 0.0f);
-                if (isOutlineSet || outlineOverrideSet) {
-                    int rgba;
-                    if (textRun.outlineColor.isSet) {
-                        rgba = textRun.outlineColor.value.toRGBA();
-                    } else {
-                        rgba = strokeColor.toRGBA();
-                    }
-                    if (rgba != currentColor) {
-                        mDraw.addColor(rgba);
-                        currentColor = rgba;
-                    }
-
-                    float thickness;
-                    if (textRun.outlineStrokeWidth.isSet) {
-                        thickness = textRun.outlineStrokeWidth.value.toPixels(mDPI);
-                    } else {
-                        thickness = strokeWidth.toPixels(mDPI);
-                    }
-                    mDraw.addStrokedText(run, extents.x,
-                                   pgBaseline - runBaselinePangoOffsets[runIdx],
-                                   thickness / kInvPangoScale);
-                }
-
-                // Draw strikethroughs *after* text
-                if (textRun.strikethroughColor.isSet && textRun.strikethroughColor.value.alpha() > 0.0f) {
-                    int rgba = textRun.strikethroughColor.value.toRGBA();
-                    if (rgba != currentColor) {
-                        mDraw.addColor(rgba);
-                        currentColor = rgba;
-                    }
-                }
-                if (strikethroughSet) {
-                    PangoFont *pgfont = run->item->analysis.font;
-                    PangoLanguage *pglang = run->item->analysis.language;
-                    PangoFontMetrics *pgmetrics = pango_font_get_metrics(pgfont, pglang);
-                    auto pgY = pgBaseline - runBaselinePangoOffsets[runIdx] - pango_font_metrics_get_strikethrough_position(pgmetrics);
-                    auto pgWidth = pango_font_metrics_get_strikethrough_thickness(pgmetrics);
-                    mDraw.addLine(DrawPangoText::kStroke,
-                                  extents.x, pgY,
-                                  extents.x + extents.width, pgY, pgWidth);
-                }
-            }
-        } while(pango_layout_iter_next_run(it));
-        pango_layout_iter_free(it);
+        mStrokeColor = strokeColor;
+        mStrokeWidth = strokeWidth;
+        mDefaultReplacementColor = defaultReplacementColor;
+        createDrawCommands(text);
 
         // So this is kind of hacky: calcFirstLineMetrics *might* have created
         // the glyphs in order to find line boundaries. We need to deallocate
         // them (see the comment for TextLayout in the header file). Also, they
         // will have been created without any alignment offsets (since that was
         // what we were computing).
+        if (mCompactGlyphsValid) {
+            mCompactGlyphs.clear();
+            mCompactGlyphsValid = false;
+            mLineIndex.clear();
+            mLineIndex.shrink_to_fit();
+        }
         if (mGlyphsValid) {
             mGlyphs.clear();
             mGlyphs.shrink_to_fit();  // clear() does not release memory
@@ -1102,15 +1382,16 @@ public:
                 mMetrics.advanceX = mMetrics.width;
 
                 if (mHasEmptyLastLine) {
-                    auto &chars = glyphs();
+                    auto &chars = compactGlyphs();
                     if (chars.size() <= 1) {
                         mMetrics.height = PicaPt::kZero;
                     } else {
-                        auto &backBack = chars[chars.size() - 2];
-                        if (chars.back().line == backBack.line) {
+                        auto backBack = chars[chars.size() - 2];
+                        auto back = chars.back();
+                        if (back.line == backBack.line) {
                             mMetrics.height = backBack.frame.maxY();
                         } else {
-                            mMetrics.height = chars.back().frame.maxY();
+                            mMetrics.height = back.frame.maxY();
                         }
                     }
                 }
@@ -1126,10 +1407,45 @@ public:
         return mMetrics;
     }
 
+    const Glyph* glyphAtPoint(const Point& p) const override
+    {
+        auto i = glyphIndexAtPoint(p);
+        return (i >= 0 ? &glyphs()[i] : nullptr);
+    }
+
+    bool glyphAtPoint(const Point& p, Glyph *glyph) const override
+    {
+        auto i = glyphIndexAtPoint(p);
+        if (i >= 0) {
+            *glyph = glyphRange()[i];
+        }
+        return (i >= 0);
+    }
+
     const std::vector<Glyph>& glyphs() const override
     {
         if (!mGlyphsValid) {
             assert(mGlyphs.empty());
+            auto glyphs = glyphRange();
+            mGlyphs.reserve(glyphs.size());
+            for (auto g : glyphs) {
+                mGlyphs.push_back(g);
+            }
+            mGlyphsValid = true;
+        }
+        return mGlyphs;
+    }
+
+    GlyphRange glyphRange() const override
+    {
+        return GlyphRange(compactGlyphs());
+    }
+
+    const CompactGlyphs& compactGlyphs() const
+    {
+        auto &glyphs = mCompactGlyphs;
+        if (!mCompactGlyphsValid) {
+            assert(glyphs.empty());
 
             // This is unnecessarily complicated because it is not clear how
             // to get glyph extents out of the run. It might be possible with
@@ -1166,33 +1482,29 @@ public:
                                 // test for trailing CJK spaces.)
                                 if (idx < line->start_index) {
                                     Rect r;
-                                    if (!mGlyphs.empty()) {
-                                        mGlyphs.back().indexOfNext = idx;
-                                    }
-                                    if (!mGlyphs.empty() && idx == lastLineEndIdx) {
-                                        r = mGlyphs.back().frame;
+                                    if (!glyphs.empty() && idx == lastLineEndIdx) {
+                                        r = glyphs.back().frame;
                                         r.x = r.maxX();
                                     } else {
                                         pango_layout_iter_get_cluster_extents(it, nullptr, &logical);
                                         r = Rect(mAlignmentOffset.x, mAlignmentOffset.y, PicaPt::kZero, PicaPt::fromPixels(float(logical.height) * invPangoScale, mDPI));
                                     }
                                     r.width = PicaPt::kZero;
-                                    mGlyphs.emplace_back(lastLineEndIdx, currentLineNo, r);
+                                    glyphs.push_back(Glyph(lastLineEndIdx, currentLineNo, r));
 
-                                    lastY = mGlyphs.back().frame.maxY();
+                                    lastY = glyphs.back().frame.maxY();
                                     idx++;
                                 }
                                 while (idx < line->start_index) {
                                     ++currentLineNo;
                                     Rect r;
                                     r.x = PicaPt::kZero;
-                                    if (!mGlyphs.empty()) {
-                                        r.y = mGlyphs.back().frame.maxY();
-                                        r.height = mGlyphs.back().frame.height;
-                                        mGlyphs.back().indexOfNext = idx;
+                                    if (!glyphs.empty()) {
+                                        r.y = glyphs.back().frame.maxY();
+                                        r.height = glyphs.back().frame.height;
                                     }
                                     r.width = PicaPt::kZero;
-                                    mGlyphs.emplace_back(idx, currentLineNo, r);
+                                    glyphs.push_back(Glyph(idx, currentLineNo, r));
                                     idx++;
                                 }
                             }
@@ -1200,9 +1512,8 @@ public:
                         ++currentLineNo;
                         lastLine = line;
                     }
-                    if (!mGlyphs.empty()) {
-                        mGlyphs.back().indexOfNext = textIdx;
-                        lastGlyphWasSpace = (mGlyphs.back().frame.width == PicaPt::kZero);
+                    if (!glyphs.empty()) {
+                        lastGlyphWasSpace = (glyphs.back().frame.width == PicaPt::kZero);
                     }
                     // The logical rectangle is the entire line height, and
                     // also is non-zero width/height for spaces. The ink
@@ -1213,7 +1524,7 @@ public:
                            PicaPt::fromPixels(float(logical.y) * invPangoScale, mDPI) + mAlignmentOffset.y,
                            PicaPt::fromPixels(float(logical.width) * invPangoScale, mDPI),
                            PicaPt::fromPixels(float(logical.height) * invPangoScale, mDPI));
-                    mGlyphs.emplace_back(textIdx, currentLineNo, r);
+                    glyphs.push_back(Glyph(textIdx, currentLineNo, r));
                 } while(pango_layout_iter_next_cluster(it));
             }
             pango_layout_iter_free(it);
@@ -1221,12 +1532,11 @@ public:
             // Add glyph for trailing \n's (if any)
             bool isEmptyFirstLine = (lastLine && lastLine->start_index == 0 && !lastLine->runs);
             if (currentLineNo >= 0 && currentLineNo < nLines - 1 && !isEmptyFirstLine) {
-                if (!mGlyphs.empty()) {
-                    auto r = mGlyphs.back().frame;
+                if (!glyphs.empty()) {
+                    auto r = glyphs.back().frame;
                     r.x = r.maxX();
                     r.width = PicaPt::kZero;
-                    mGlyphs.back().indexOfNext = mGlyphs.back().index + 1;
-                    mGlyphs.emplace_back(mGlyphs.back().indexOfNext, currentLineNo, r);
+                    glyphs.push_back(Glyph(glyphs.back().index + 1, currentLineNo, r));
                     ++currentLineNo;
                 } else {
                     // Must be a \n at begining; handle below
@@ -1239,8 +1549,8 @@ public:
                 PangoLayoutLine *line = pango_layout_get_line(mLayout, currentLineNo);
                 pango_layout_line_get_extents(line, nullptr, &logical);
                 auto y = PicaPt::kZero;
-                if (!mGlyphs.empty()) {
-                    y = mGlyphs.back().frame.maxY();
+                if (!glyphs.empty()) {
+                    y = glyphs.back().frame.maxY();
                 }
                 Rect r(PicaPt::fromPixels(float(logical.x) * invPangoScale, mDPI) + mAlignmentOffset.x,
                        y,
@@ -1256,34 +1566,390 @@ public:
                     r.height = ascent + descent;
                     pango_font_metrics_unref(fm);
                 }
-                if (!mGlyphs.empty()) {
-                    mGlyphs.back().indexOfNext = line->start_index;
-                }
                 ++currentLineNo;
-                mGlyphs.emplace_back(line->start_index, currentLineNo, r);
+                glyphs.push_back(Glyph(line->start_index, currentLineNo, r));
             }
 
-            if (!mGlyphs.empty()) {
+            if (!glyphs.empty()) {
                 if (nLines > 0) {
                     // Find last index. Maybe it would be quicker to use strlen?
                     PangoLayoutLine *line = pango_layout_get_line(mLayout,
                                                                   nLines - 1);
-                    mGlyphs.back().indexOfNext = line->start_index + line->length;
+                    glyphs.setEndIndex(line->start_index + line->length);
                 }
             }
 
-            mGlyphsValid = true;
+            mCompactGlyphsValid = true;
         }
 
-        return mGlyphs;
+        return glyphs;
     }
 
     void draw(cairo_t *gc) const { mDraw.draw(gc); }
 
+    // Returns the area, relative to the draw point, that draw() might touch.
+    // This is the union of the ink rect (which can extend outside the logical
+    // rect, e.g. for italics) and the logical rect (backgrounds, underlines),
+    // outset by the decoration strokes. Wavy underlines are as tall as their
+    // stroke width and double underlines are offset by twice the width, so
+    // 3x the widest stroke covers everything.
+    const Rect& drawBounds() const
+    {
+        if (!mDrawBoundsValid) {
+            PangoRectangle ink, logical;
+            pango_layout_get_pixel_extents(mLayout, &ink, &logical);
+            float x0 = float(std::min(ink.x, logical.x));
+            float y0 = float(std::min(ink.y, logical.y));
+            float x1 = float(std::max(ink.x + ink.width, logical.x + logical.width));
+            float y1 = float(std::max(ink.y + ink.height, logical.y + logical.height));
+            float outset = 3.0f * mDraw.maxStrokeWidth() + 1.0f;  // +1 for rounding
+            mDrawBounds = Rect(PicaPt::fromPixels(x0 - outset, mDPI) + mAlignmentOffset.x,
+                               PicaPt::fromPixels(y0 - outset, mDPI) + mAlignmentOffset.y,
+                               PicaPt::fromPixels(x1 - x0 + 2.0f * outset, mDPI),
+                               PicaPt::fromPixels(y1 - y0 + 2.0f * outset, mDPI));
+            mDrawBoundsValid = true;
+        }
+        return mDrawBounds;
+    }
+
+    bool recolor(const Text& text) override
+    {
+        if (text.runs().size() != mRunParts.size()
+            || text.text() != pango_layout_get_text(mLayout)) {
+            return false;
+        }
+
+        // Anything other than colors changes the layout (and possibly which
+        // parts of the string the runs apply to), so the caller needs a new one.
+        for (size_t i = 0;  i < mRunLayouts.size();  ++i) {
+            if (!mRunLayouts[i].isSameLayout(text.runs()[i])) {
+                return false;
+            }
+        }
+
+        bool sameParts = true;
+        for (size_t i = 0;  i < mRunParts.size();  ++i) {
+            if (runParts(text.runs()[i]) != mRunParts[i]) {
+                sameParts = false;
+                break;
+            }
+        }
+
+        // If the same things are drawn, we can usually just patch the colors
+        // of the existing kSetFG commands. However, redundant color changes
+        // are not recorded, so this does not work if two parts that shared
+        // a color no longer do.
+        if (sameParts) {
+            std::vector<std::pair<int, int>> patches;  // (cmdIndex, rgba)
+            patches.reserve(mColorUses.size());
+            bool canPatch = true;
+            for (auto &use : mColorUses) {
+                int rgba = colorForRole(text.runs()[use.runIndex], use.role);
+                if (use.cmdIndex < 0) {
+                    canPatch = (rgba == 0);  // initial color is transparent black
+                } else if (!patches.empty() && patches.back().first == use.cmdIndex) {
+                    canPatch = (patches.back().second == rgba);
+                } else {
+                    patches.emplace_back(use.cmdIndex, rgba);
+                }
+                if (!canPatch) {
+                    break;
+                }
+            }
+            if (canPatch) {
+                for (auto &p : patches) {
+                    mDraw.setColor(p.first, p.second);
+                }
+                return true;
+            }
+        }
+
+        // Otherwise recreate the draw commands. This still does not need
+        // to reshape the text, as the PangoLayout is unchanged.
+        createDrawCommands(text);
+        mDrawBoundsValid = false;  // stroke widths may have changed
+        return true;
+    }
+
 private:
+    // This uses the compact glyphs, so that hit-testing does not need the
+    // much larger glyphs().
+    long glyphIndexAtPoint(const Point& p) const
+    {
+        auto glyphs = glyphRange();
+        if (mLineIndex.empty() && !glyphs.empty()) {
+            mLineIndex = createLineIndex(glyphs);
+        }
+        return findGlyphAtPoint(glyphs, mLineIndex, p);
+    }
+
+    // The colors that a run can use, in the order the draw commands use them.
+    enum ColorRole { kBgColor = 0, kFgColor, kUnderlineColor, kOutlineColor,
+                     kStrikethroughColor };
+
+    // The parts of a run that produce draw commands. If these are the same
+    // the draw commands are the same, except possibly for the colors.
+    enum RunParts { kHasBg = (1 << 0), kHasUnderline = (1 << 1),
+                    kHasUnderlineColor = (1 << 2), kHasVisibleFg = (1 << 3),
+                    kHasOutline = (1 << 4), kHasStrikethroughColor = (1 << 5),
+                    kHasStrikethrough = (1 << 6) };
+
+    struct ColorUse
+    {
+        int cmdIndex;  // the kSetFG command in effect, or -1 for the initial color
+        int runIndex;
+        ColorRole role;
+    };
+
+    uint8_t runParts(const TextRun& textRun) const
+    {
+        uint8_t parts = 0;
+        if (textRun.backgroundColor.isSet
+            && textRun.backgroundColor.value.alpha() > 0.0f) {
+            parts |= kHasBg;
+        }
+        if (textRun.underlineStyle.isSet
+            && textRun.underlineStyle.value != kUnderlineNone
+            && !(textRun.underlineColor.isSet
+                 && textRun.underlineColor.value.alpha() == 0.0f)) {
+            parts |= kHasUnderline;
+            if (textRun.underlineColor.isSet) {
+                parts |= kHasUnderlineColor;
+            }
+        }
+        if (textRun.color.value.alpha() > 0.0f) {
+            parts |= kHasVisibleFg;
+        }
+        bool isOutlineSet = (textRun.outlineColor.isSet && textRun.outlineColor.value.alpha() > 0.0f && !(textRun.outlineStrokeWidth.isSet && textRun.outlineStrokeWidth.value == PicaPt::kZero));
+        bool outlineOverrideSet = (mStrokeWidth > PicaPt::kZero && mStrokeColor.alpha() > 0.0f);
+        if (isOutlineSet || outlineOverrideSet) {
+            parts |= kHasOutline;
+        }
+        if (textRun.strikethroughColor.isSet && textRun.strikethroughColor.value.alpha() > 0.0f) {
+            parts |= kHasStrikethroughColor;
+        }
+        if (textRun.strikethrough.isSet && textRun.strikethrough.value) {
+            parts |= kHasStrikethrough;
+        }
+        return parts;
+    }
+
+    int colorForRole(const TextRun& textRun, ColorRole role) const
+    {
+        switch (role) {
+            case kBgColor:
+                return textRun.backgroundColor.value.toRGBA();
+            case kFgColor: {
+                Color fg = textRun.color.value;
+                if ((textRun.color.value.red() == Color::kTextDefault.red() &&
+                     textRun.color.value.green() == Color::kTextDefault.green() &&
+                     textRun.color.value.blue() == Color::kTextDefault.blue())) {
+                    fg = mDefaultReplacementColor;
+                    fg.setAlpha(textRun.color.value.alpha());
+                }
+                return fg.toRGBA();
+            }
+            case kUnderlineColor:
+                return textRun.underlineColor.value.toRGBA();
+            case kOutlineColor:
+                if (textRun.outlineColor.isSet) {
+                    return textRun.outlineColor.value.toRGBA();
+                }
+                return mStrokeColor.toRGBA();
+            case kStrikethroughColor:
+                return textRun.strikethroughColor.value.toRGBA();
+        }
+        return 0;
+    }
+
+    void createDrawCommands(const Text& text)
+    {
+        mDraw.clear();
+        mColorUses.clear();
+        mRunParts.clear();
+        mRunParts.reserve(text.runs().size());
+        mRunLayouts.clear();
+        mRunLayouts.reserve(text.runs().size());
+        for (auto &textRun : text.runs()) {
+            mRunParts.push_back(runParts(textRun));
+            mRunLayouts.emplace_back(textRun);
+        }
+
+        int currentColor = 0;  // transparent black
+        int currentColorCmd = -1;
+        auto useColor = [this, &currentColor, &currentColorCmd](int rgba, int runIdx, ColorRole role) {
+            if (rgba != currentColor) {
+                currentColorCmd = int(mDraw.nCommands());
+                mDraw.addColor(rgba);
+                currentColor = rgba;
+            }
+            mColorUses.push_back({ currentColorCmd, runIdx, role });
+        };
+
+        PangoLayoutIter *it = pango_layout_get_iter(mLayout);
+        do {
+            PangoLayoutRun *run = pango_layout_iter_get_run(it);
+            if (run) {  // end of line always has a NULL run
+                auto *attrs = run->item->analysis.extra_attrs;
+                unsigned int runIdx = -1;
+                while (attrs) {
+                    auto *attr = (PangoAttribute*)attrs->data;
+                    if (attr->klass->type == PANGO_ATTR_FOREGROUND) {
+                        auto *colorAttr = (PangoAttrColor*)attr;
+                        unsigned int lower = (unsigned int)(colorAttr->color.red);
+                        unsigned int upper = ((unsigned int)(colorAttr->color.green)) << 16;
+                        runIdx = upper | lower;
+                        break;
+                    }
+                    attrs = attrs->next;
+                }
+                assert(runIdx >= 0);
+                auto &textRun = text.runs()[runIdx];
+                uint8_t parts = mRunParts[runIdx];
+
+                PangoRectangle extents;
+                pango_layout_iter_get_run_extents(it, nullptr, &extents);
+                int pgBaseline = pango_layout_iter_get_baseline(it);
+
+                // If a background color is set, it needs to be drawn first.
+                if (parts & kHasBg) {
+                    useColor(colorForRole(textRun, kBgColor), runIdx, kBgColor);
+                    mDraw.addRect(extents);
+                }
+
+                int fgRGBA = colorForRole(textRun, kFgColor);
+                useColor(fgRGBA, runIdx, kFgColor);
+
+                // Draw underline *before* text, so text descenders are on top
+                if (parts & kHasUnderline) {
+                    if (parts & kHasUnderlineColor) {
+                        useColor(colorForRole(textRun, kUnderlineColor),
+                                 runIdx, kUnderlineColor);
+                    }
+
+                    PangoFont *pgfont = run->item->analysis.font;
+                    PangoLanguage *pglang = run->item->analysis.language;
+                    PangoFontMetrics *pgmetrics = pango_font_get_metrics(pgfont, pglang);
+                    // Note that underline position is *above* the baseline
+                    // (so usually negative).
+                    auto pgY = pgBaseline - mRunBaselinePangoOffsets[runIdx] - pango_font_metrics_get_underline_position(pgmetrics);
+                    auto pgWidth = pango_font_metrics_get_underline_thickness(pgmetrics);
+                    DrawPangoText::Cmd cmd = DrawPangoText::kStroke;
+                    switch (textRun.underlineStyle.value) {
+                        case kUnderlineNone: // to make compiler happy about enum
+                        case kUnderlineSingle:
+                            cmd = DrawPangoText::kStroke;
+                            break;
+                        case kUnderlineDouble:
+                            cmd = DrawPangoText::kDoubleStroke;
+                            break;
+                        case kUnderlineDotted:
+                            cmd = DrawPangoText::kDottedStroke;
+                            break;
+                        case kUnderlineWavy:
+                            cmd = DrawPangoText::kWavyStroke;
+                            break;
+                    }
+                    mDraw.addLine(cmd, extents.x, pgY,
+                                  extents.x + extents.width, pgY, pgWidth);
+
+                    useColor(fgRGBA, runIdx, kFgColor);  // underline might have changed
+                }
+
+                // Draw the actual text (unless transparent)
+                if (parts & kHasVisibleFg) {
+                    mDraw.addText(run, extents.x,
+                                  pgBaseline - mRunBaselinePangoOffsets[runIdx]);
+                }
+
+                // Draw outlined text
+                if (parts & kHasOutline) {
+                    useColor(colorForRole(textRun, kOutlineColor),
+                             runIdx, kOutlineColor);
+
+                    float thickness;
+                    if (textRun.outlineStrokeWidth.isSet) {
+                        thickness = textRun.outlineStrokeWidth.value.toPixels(mDPI);
+                    } else {
+                        thickness = mStrokeWidth.toPixels(mDPI);
+                    }
+                    mDraw.addStrokedText(run, extents.x,
+                                   pgBaseline - mRunBaselinePangoOffsets[runIdx],
+                                   thickness / kInvPangoScale);
+                }
+
+                // Draw strikethroughs *after* text
+                if (parts & kHasStrikethroughColor) {
+                    useColor(colorForRole(textRun, kStrikethroughColor),
+                             runIdx, kStrikethroughColor);
+                }
+                if (parts & kHasStrikethrough) {
+                    PangoFont *pgfont = run->item->analysis.font;
+                    PangoLanguage *pglang = run->item->analysis.language;
+                    PangoFontMetrics *pgmetrics = pango_font_get_metrics(pgfont, pglang);
+                    auto pgY = pgBaseline - mRunBaselinePangoOffsets[runIdx] - pango_font_metrics_get_strikethrough_position(pgmetrics);
+                    auto pgWidth = pango_font_metrics_get_strikethrough_thickness(pgmetrics);
+                    mDraw.addLine(DrawPangoText::kStroke,
+                                  extents.x, pgY,
+                                  extents.x + extents.width, pgY, pgWidth);
+                }
+            }
+        } while(pango_layout_iter_next_run(it));
+        pango_layout_iter_free(it);
+    }
+
     PangoLayout *mLayout;
     DrawPangoText mDraw;
     float mDPI;
+    Color mStrokeColor;
+    PicaPt mStrokeWidth;
+    Color mDefaultReplacementColor;
+    std::vector<int> mRunBaselinePangoOffsets;
+    std::vector<uint8_t> mRunParts;  // RunParts, by TextRun index
+    // The attributes of each TextRun that affect layout, for recolor()
+    struct RunLayout
+    {
+        int startIndex;
+        int length;
+        FontTextAttr font;
+        PointTextAttr pointSize;
+        PointTextAttr characterSpacing;
+        PointTextAttr outlineStrokeWidth;
+        UnderlineStyleTextAttr underlineStyle;
+        BoolTextAttr bold;
+        BoolTextAttr italic;
+        BoolTextAttr strikethrough;
+        BoolTextAttr superscript;
+        BoolTextAttr subscript;
+
+        explicit RunLayout(const TextRun& r)
+            : startIndex(r.startIndex), length(r.length), font(r.font)
+            , pointSize(r.pointSize), characterSpacing(r.characterSpacing)
+            , outlineStrokeWidth(r.outlineStrokeWidth)
+            , underlineStyle(r.underlineStyle), bold(r.bold), italic(r.italic)
+            , strikethrough(r.strikethrough), superscript(r.superscript)
+            , subscript(r.subscript)
+        {}
+
+        bool isSameLayout(const TextRun& r) const
+        {
+            return (startIndex == r.startIndex && length == r.length &&
+                    isSame(font, r.font) && isSame(pointSize, r.pointSize) &&
+                    isSame(characterSpacing, r.characterSpacing) &&
+                    isSame(outlineStrokeWidth, r.outlineStrokeWidth) &&
+                    isSame(underlineStyle, r.underlineStyle) &&
+                    isSame(bold, r.bold) && isSame(italic, r.italic) &&
+                    isSame(strikethrough, r.strikethrough) &&
+                    isSame(superscript, r.superscript) &&
+                    isSame(subscript, r.subscript));
+        }
+
+        template <typename T>
+        static bool isSame(const TextAttr<T>& a, const TextAttr<T>& b)
+            { return (a.isSet == b.isSet && (!a.isSet || a.value == b.value)); }
+    };
+    std::vector<RunLayout> mRunLayouts;  // by TextRun index
+    std::vector<ColorUse> mColorUses;
     Point mAlignmentOffset;
     bool mIsEmptyText;
     bool mHasEmptyLastLine;
@@ -1291,8 +1957,14 @@ private:
     mutable TextMetrics mMetrics;
     mutable bool mMetricsValid = false;
 
-    mutable std::vector<Glyph> mGlyphs;
+    mutable Rect mDrawBounds;
+    mutable bool mDrawBoundsValid = false;
+
+    mutable CompactGlyphs mCompactGlyphs;
+    mutable bool mCompactGlyphsValid = false;
+    mutable std::vector<Glyph> mGlyphs;  // only created if glyphs() is called
     mutable bool mGlyphsValid = false;
+    mutable std::vector<LineIndex> mLineIndex;  // created on demand from mCompactGlyphs
 };
 
 } // namespace
@@ -1486,11 +2158,33 @@ public:
         }
     }
 
+    ~CairoDrawContext()
+    {
+        if (mGradientScratch) {
+            cairo_pattern_destroy(mGradientScratchPattern);
+            cairo_surface_destroy(mGradientScratch);
+        }
+        if (mMeshPattern) {
+            cairo_pattern_destroy(mMeshPattern);
+        }
+        for (auto &mask : mShadowMasks) {
+            cairo_surface_destroy(mask.surface);
+        }
+    }
+
 
     void setNativeDC(cairo_t *dc)
     {
         mStateStack.clear();
         mStateStack.push_back(State());
+        mAppliedStack.clear();
+        mApplied = AppliedState();
+        mLayers.clear();
+        cairo_get_matrix(dc, &mStateStack.back().transform);
+        mBaseTransform = mStateStack.back().transform;
+        mStateStack.back().clipBounds = Rect(PicaPt::kZero, PicaPt::kZero,
+                                             PicaPt(float(mWidth)),
+                                             PicaPt(float(mHeight)));
 
         mNativeDC = dc;
         setInitialState();
@@ -1591,6 +2285,8 @@ public:
     void beginDraw() override
     {
         mDrawingState = DrawingState::kDrawing;
+        mNCulled = 0;
+        mNStateChangesAvoided = 0;
     }
 
     void endDraw() override
@@ -1598,21 +2294,47 @@ public:
         mDrawingState = DrawingState::kNotDrawing;
     }
 
+    // Widgets commonly save() and restore() around drawing themselves, but
+    // most only change colors and translate. Since we mirror the transform,
+    // and the paint settings are only given to Cairo when drawing, those
+    // can be put back on restore() directly, which is much cheaper than
+    // cairo_save(), which copies Cairo's entire graphics state. Cairo's
+    // state is only saved if the clip changes; see saveNativeState().
     void save() override
     {
-        cairo_save(cairoContext());
         mStateStack.push_back(mStateStack.back());  // copy current state
+        auto &state = mStateStack.back();
+        state.nativeSaved = false;
+        state.transformChanged = false;
     }
 
     void restore() override
     {
-        cairo_restore(cairoContext());
+        if (mStateStack.size() <= 1) {
+            return;  // unbalanced restore()
+        }
+        auto *gc = cairoContext();
+        State popped = mStateStack.back();
         mStateStack.pop_back();
+        auto &state = mStateStack.back();
+        if (popped.nativeSaved) {
+            cairo_restore(gc);
+            // Cairo's state is now whatever it was when saveNativeState()
+            // was called, which may have been after changes were made.
+            cairo_set_matrix(gc, &state.transform);
+            mApplied = mAppliedStack.back();
+            mAppliedStack.pop_back();
+        } else if (popped.transformChanged) {
+            cairo_set_matrix(gc, &state.transform);
+        }
     }
 
     void translate(const PicaPt& dx, const PicaPt& dy) override
     {
         cairo_translate(cairoContext(), dx.toPixels(mDPI), dy.toPixels(mDPI));
+        cairo_matrix_translate(&mStateStack.back().transform,
+                               dx.toPixels(mDPI), dy.toPixels(mDPI));
+        mStateStack.back().transformChanged = true;
     }
 
     void rotate(float degrees) override
@@ -1621,12 +2343,67 @@ public:
         // mathematical one, which make +angle rotate clockwise. We still
         // want +angle to be counterclockwise so that the angle works like
         // people expect it, so we need to negate it.
-        cairo_rotate(cairoContext(), -degrees * 3.14159265358979323846f / 180.0f);
+        double rad = -degrees * 3.14159265358979323846f / 180.0f;
+        cairo_rotate(cairoContext(), rad);
+        cairo_matrix_rotate(&mStateStack.back().transform, rad);
+        mStateStack.back().transformChanged = true;
     }
 
     void scale(float sx, float sy) override
     {
         cairo_scale(cairoContext(), sx, sy);
+        cairo_matrix_scale(&mStateStack.back().transform, sx, sy);
+        mStateStack.back().transformChanged = true;
+    }
+
+    AffineTransform currentTransform() const override
+    {
+        // The CTM is base * user, so user = base^-1 * CTM
+        cairo_matrix_t invBase = mBaseTransform, m;
+        cairo_matrix_invert(&invBase);
+        cairo_matrix_multiply(&m, &mStateStack.back().transform, &invBase);
+        return AffineTransform(float(m.xx), float(m.yx), float(m.xy), float(m.yy),
+                               PicaPt::fromPixels(float(m.x0), mDPI),
+                               PicaPt::fromPixels(float(m.y0), mDPI));
+    }
+
+    void setTransform(const AffineTransform& t) override
+    {
+        auto &state = mStateStack.back();
+        cairo_matrix_t m = pixelMatrix(t);
+        cairo_matrix_multiply(&state.transform, &m, &mBaseTransform);
+        cairo_set_matrix(cairoContext(), &state.transform);
+        state.transformChanged = true;
+    }
+
+    void concatTransform(const AffineTransform& t) override
+    {
+        auto &state = mStateStack.back();
+        cairo_matrix_t m = pixelMatrix(t);
+        cairo_transform(cairoContext(), &m);
+        cairo_matrix_multiply(&state.transform, &m, &state.transform);
+        state.transformChanged = true;
+    }
+
+    Rect clipBounds() const override
+    {
+        auto &state = mStateStack.back();
+        cairo_matrix_t inv = state.transform;
+        if (cairo_matrix_invert(&inv) != CAIRO_STATUS_SUCCESS) {
+            return Rect::kZero;  // everything is degenerate, nothing is visible
+        }
+        auto &r = state.clipBounds;
+        double xs[4] = { r.x.pt, r.maxX().pt, r.maxX().pt, r.x.pt };
+        double ys[4] = { r.y.pt, r.y.pt, r.maxY().pt, r.maxY().pt };
+        for (int i = 0;  i < 4;  ++i) {
+            cairo_matrix_transform_point(&inv, &xs[i], &ys[i]);
+        }
+        double minX = std::min(std::min(xs[0], xs[1]), std::min(xs[2], xs[3]));
+        double maxX = std::max(std::max(xs[0], xs[1]), std::max(xs[2], xs[3]));
+        double minY = std::min(std::min(ys[0], ys[1]), std::min(ys[2], ys[3]));
+        double maxY = std::max(std::max(ys[0], ys[1]), std::max(ys[2], ys[3]));
+        return Rect::fromPixels(float(minX), float(minY),
+                                float(maxX - minX), float(maxY - minY), mDPI);
     }
 
     void calcContextPixel(const Point& point, float *x, float *y) override
@@ -1677,67 +2454,57 @@ public:
         mStateStack.back().strokeColor = color;
     }
 
+    // The paint settings are only recorded here; applyStrokeStyle() and
+    // applySourceColor() give them to Cairo when drawing.
     void setStrokeWidth(const PicaPt& w) override
     {
         mStateStack.back().strokeWidth = w;
-        cairo_set_line_width(cairoContext(), w.toPixels(mDPI));
     }
 
     void setStrokeEndCap(EndCapStyle cap) override
     {
         mStateStack.back().endCapStyle = cap;
-        switch(cap) {
-            case kEndCapButt:
-                cairo_set_line_cap(cairoContext(), CAIRO_LINE_CAP_BUTT);
-                break;
-            case kEndCapRound:
-                cairo_set_line_cap(cairoContext(), CAIRO_LINE_CAP_ROUND);
-                break;
-            case kEndCapSquare:
-                cairo_set_line_cap(cairoContext(), CAIRO_LINE_CAP_SQUARE);
-                break;
-        }
     }
 
     void setStrokeJoinStyle(JoinStyle join) override
     {
         mStateStack.back().joinStyle = join;
-        switch(join) {
-            case kJoinMiter:
-                cairo_set_line_join(cairoContext(), CAIRO_LINE_JOIN_MITER);
-                break;
-            case kJoinRound:
-                cairo_set_line_join(cairoContext(), CAIRO_LINE_JOIN_ROUND);
-                break;
-            case kJoinBevel:
-                cairo_set_line_join(cairoContext(), CAIRO_LINE_JOIN_BEVEL);
-                break;
-        }
     }
 
     void setStrokeDashes(const std::vector<PicaPt> lengths, const PicaPt& offset) override
     {
-        std::vector<double> dashes;
-        dashes.reserve(lengths.size());
+        auto &state = mStateStack.back();
+        if (lengths.empty()) {
+            state.dashes = nullptr;  // solid
+            return;
+        }
+        auto dashes = std::make_shared<DashPattern>();
+        dashes->lengths.reserve(lengths.size());
         for (auto length : lengths) {
-            dashes.push_back(length.toPixels(mDPI));
+            dashes->lengths.push_back(length.toPixels(mDPI));
         }
-        cairo_set_dash(cairoContext(), dashes.data(), int(dashes.size()),
-                       -offset.toPixels(mDPI));
+        dashes->offset = -offset.toPixels(mDPI);
+        state.dashes = dashes;
     }
 
     void fill(const Color& color) override
     {
+        if (fillRectFast(Rect::fromPixels(0.0f, 0.0f, float(mWidth), float(mHeight), mDPI),
+                         color)) {
+            return;
+        }
+        applyPendingClip();
         auto *gc = cairoContext();
-        setCairoSourceColor(gc, color);
+        applySourceColor(color);
         cairo_rectangle(gc, 0.0, 0.0, double(mWidth), double(mHeight));
         cairo_fill(cairoContext());
     }
 
     void clearRect(const Rect& rect) override
     {
+        applyPendingClip(deviceBounds(rect, 0.0));
         auto *gc = cairoContext();
-        cairo_set_source_rgba(gc, 0.0, 0.0, 0.0, 0.0);
+        applySourceColor(Color::kTransparent);
         auto old_op = cairo_get_operator(gc);
         cairo_set_operator(gc, CAIRO_OPERATOR_CLEAR);
         cairo_rectangle(gc, rect.x.toPixels(mDPI), rect.y.toPixels(mDPI),
@@ -1758,16 +2525,34 @@ public:
 
     void drawRect(const Rect& rect, PaintMode mode) override
     {
+        Rect device;
+        if (!isVisible(rect, mode, &device)) {
+            return;
+        }
+        if (mode == kPaintFill && fillRectFast(rect, mStateStack.back().fillColor)) {
+            return;
+        }
+        applyPendingClip(device);
         auto *gc = cairoContext();
         cairo_rectangle(gc, rect.x.toPixels(mDPI), rect.y.toPixels(mDPI),
                         rect.width.toPixels(mDPI), rect.height.toPixels(mDPI));
         drawCurrentPath(mode);
     }
 
-    // drawRoundedRect() is defined in nativedraw.cpp
+    void drawRoundedRect(const Rect& rect, const PicaPt& radius, PaintMode mode) override
+    {
+        // Avoid creating the path if it is not going to be drawn
+        if (!isVisible(rect, mode)) {
+            return;
+        }
+        DrawContext::drawRoundedRect(rect, radius, mode);
+    }
 
     void drawEllipse(const Rect& rect, PaintMode mode) override
     {
+        if (!isVisible(rect, mode)) {
+            return;
+        }
         auto path = createBezierPath();
         path->addEllipse(rect);
         drawPath(path, mode);
@@ -1775,6 +2560,11 @@ public:
 
     void drawPath(std::shared_ptr<BezierPath> path, PaintMode mode) override
     {
+        Rect device;
+        if (!isVisible(path->controlBounds(), mode, &device)) {
+            return;
+        }
+        applyPendingClip(device);
         const bool ignored = false;
         auto *gc = cairoContext();
         cairo_append_path(gc, (cairo_path_t*)path->nativePathForDPI(mDPI, ignored));
@@ -1795,21 +2585,30 @@ public:
         if (dist < 1e-6) {
             return;
         }
-
-        save();
-        clipToPath(path);
+        Rect device;
+        if (!isVisible(path->controlBounds(), kPaintFill, &device)) {
+            return;
+        }
+        applyPendingClip(device);
 
         // We created the brush with the gradient going from (0, 0) to (1, 0).
         // So we can avoid creating different brushes (which presumably creates
         // a gradient bitmap for each one) for each start/end that uses the same
-        // stops by just transforming the draw matrix so that drawing from
-        // (0, 0) to (1, 0) gives us the desired result.
-        translate(start.x, start.y);
-        scale(dist, dist);
-        rotate(-rotationRad * 180.0f / 3.14159265f);
-
-        drawGradient(((CairoGradient&)gradient).linearPattern());
-        restore();
+        // stops by just transforming the pattern so that (0, 0) to (1, 0)
+        // maps onto start to end.
+        cairo_matrix_t gradientToUser;
+        cairo_matrix_init_translate(&gradientToUser,
+                                    start.x.toPixels(mDPI), start.y.toPixels(mDPI));
+        cairo_matrix_scale(&gradientToUser, dist, dist);
+        cairo_matrix_rotate(&gradientToUser, rotationRad);
+
+        auto &cairoGradient = (CairoGradient&)gradient;
+        if (mGradientMode == kGradientLookupTable &&
+            fillPathWithGradientTable(path, cairoGradient, gradientToUser,
+                                      GradientShape::kLinear)) {
+            return;
+        }
+        fillPathWithGradient(path, cairoGradient.linearPattern(), gradientToUser);
     }
 
     void drawRadialGradientPath(std::shared_ptr<BezierPath> path,
@@ -1817,70 +2616,314 @@ public:
                                 const Point& center, const PicaPt& startRadius,
                                 const PicaPt& endRadius)
     {
-        save();
-        clipToPath(path);
-
-        translate(center.x, center.y);
         float radiusPx = endRadius.toPixels(mDPI);
-        scale(radiusPx, radiusPx);
+        // As with linear gradients, a zero radius is invisible and the matrix
+        // would not be invertible.
+        if (radiusPx < 1e-6f) {
+            return;
+        }
+        Rect device;
+        if (!isVisible(path->controlBounds(), kPaintFill, &device)) {
+            return;
+        }
+        applyPendingClip(device);
+
+        cairo_matrix_t gradientToUser;
+        cairo_matrix_init_translate(&gradientToUser,
+                                    center.x.toPixels(mDPI), center.y.toPixels(mDPI));
+        cairo_matrix_scale(&gradientToUser, radiusPx, radiusPx);
+
+        auto &cairoGradient = (CairoGradient&)gradient;
+        // The other platforms are fine with startRadius = 1.0, but Cairo
+        // draws nothing, so radialPattern() limits it; do the same here.
+        float startRatio = std::min(startRadius / endRadius, 0.999f);
+        if (mGradientMode == kGradientLookupTable &&
+            fillPathWithGradientTable(path, cairoGradient, gradientToUser,
+                                      GradientShape::kRadial, startRatio)) {
+            return;
+        }
+        auto *pattern = cairoGradient.radialPattern(startRadius / endRadius);
+        fillPathWithGradient(path, pattern, gradientToUser);
+    }
 
-        auto *pattern = ((CairoGradient&)gradient).radialPattern(startRadius / endRadius);
-        drawGradient(pattern);
+    void drawConicGradientPath(std::shared_ptr<BezierPath> path,
+                               Gradient& gradient,
+                               const Point& center,
+                               float startAngleDeg) override
+    {
+        auto bounds = path->controlBounds();
+        Rect device;
+        if (!isVisible(bounds, kPaintFill, &device)) {
+            return;
+        }
+        applyPendingClip(device);
+
+        // The pattern has radius 1, so it needs to be scaled to reach the
+        // farthest corner of the path (plus a pixel for antialiasing).
+        double cx = center.x.toPixels(mDPI);
+        double cy = center.y.toPixels(mDPI);
+        double radius = 0.0;
+        for (auto &p : { Point(bounds.x, bounds.y), Point(bounds.maxX(), bounds.y),
+                         Point(bounds.maxX(), bounds.maxY()), Point(bounds.x, bounds.maxY()) }) {
+            double dx = p.x.toPixels(mDPI) - cx;
+            double dy = p.y.toPixels(mDPI) - cy;
+            radius = std::max(radius, std::sqrt(dx * dx + dy * dy));
+        }
+        radius += 1.0;
+
+        cairo_matrix_t gradientToUser;
+        cairo_matrix_init_translate(&gradientToUser, cx, cy);
+        cairo_matrix_scale(&gradientToUser, radius, radius);
+        // Cairo's +angle is clockwise, ours is counterclockwise
+        cairo_matrix_rotate(&gradientToUser, -startAngleDeg * 3.14159265358979323846 / 180.0);
+
+        auto &cairoGradient = (CairoGradient&)gradient;
+        if (mGradientMode == kGradientLookupTable &&
+            fillPathWithGradientTable(path, cairoGradient, gradientToUser,
+                                      GradientShape::kConic)) {
+            return;
+        }
+        fillPathWithGradient(path, cairoGradient.conicPattern(), gradientToUser);
+    }
 
-        restore();
+    void drawMeshGradientPath(std::shared_ptr<BezierPath> path,
+                              const std::vector<GradientMeshPatch>& patches) override
+    {
+        Rect device;
+        if (patches.empty() || !isVisible(path->controlBounds(), kPaintFill, &device)) {
+            return;
+        }
+        applyPendingClip(device);
+
+        // The mesh is in user space, so redrawing the same patches (e.g. the
+        // same widget every frame) can reuse the pattern whatever the transform.
+        auto samePatches = [](const std::vector<GradientMeshPatch>& a,
+                              const std::vector<GradientMeshPatch>& b) {
+            if (a.size() != b.size()) {
+                return false;
+            }
+            for (size_t i = 0;  i < a.size();  ++i) {
+                for (int c = 0;  c < 4;  ++c) {
+                    auto &ca = a[i].colors[c];
+                    auto &cb = b[i].colors[c];
+                    if (a[i].corners[c] != b[i].corners[c] ||
+                        ca.red() != cb.red() || ca.green() != cb.green() ||
+                        ca.blue() != cb.blue() || ca.alpha() != cb.alpha()) {
+                        return false;
+                    }
+                }
+            }
+            return true;
+        };
+        if (!mMeshPattern || !samePatches(patches, mMeshPatches)) {
+            if (mMeshPattern) {
+                cairo_pattern_destroy(mMeshPattern);
+            }
+            mMeshPattern = cairo_pattern_create_mesh();
+            for (auto &patch : patches) {
+                cairo_mesh_pattern_begin_patch(mMeshPattern);
+                for (int c = 0;  c < 4;  ++c) {
+                    double x = patch.corners[c].x.toPixels(mDPI);
+                    double y = patch.corners[c].y.toPixels(mDPI);
+                    if (c == 0) {
+                        cairo_mesh_pattern_move_to(mMeshPattern, x, y);
+                    } else {
+                        cairo_mesh_pattern_line_to(mMeshPattern, x, y);
+                    }
+                }
+                for (int c = 0;  c < 4;  ++c) {
+                    auto &color = patch.colors[c];
+                    cairo_mesh_pattern_set_corner_color_rgba(mMeshPattern, c,
+                                                             color.red(), color.green(),
+                                                             color.blue(), color.alpha());
+                }
+                cairo_mesh_pattern_end_patch(mMeshPattern);
+            }
+            mMeshPatches = patches;
+        }
+
+        cairo_matrix_t identity;
+        cairo_matrix_init_identity(&identity);
+        fillPathWithGradient(path, mMeshPattern, identity);
     }
 
+    void setGradientMode(GradientMode mode) override { mGradientMode = mode; }
+    GradientMode gradientMode() const override { return mGradientMode; }
+
 private:
-    void drawGradient(cairo_pattern_t *pattern)
+    // Fills the path with the pattern, where gradientToUser maps the pattern's
+    // unit coordinates into user space. Filling the path directly (rather than
+    // clipping to the path and filling the whole context) keeps the cost
+    // proportional to the area of the path.
+    void fillPathWithGradient(std::shared_ptr<BezierPath> path,
+                              cairo_pattern_t *pattern,
+                              const cairo_matrix_t& gradientToUser)
     {
         auto *gc = cairoContext();
 
-        // We assume that this is bracketed by save/restore, so that the
-        // set_source() is undone
-        cairo_set_source(gc, pattern);
-
-        // Draw a rect the size of the entire context using the gradient brush;
-        // the clipping will limit to the path.
-        double ulX = 0.0, ulY = 0.0;
-        double urX = double(mWidth), urY = 0.0;
-        double lrX = double(mWidth), lrY = double(mHeight);
-        double llX = 0.0, llY = double(mHeight);
-
-        // We need to transform the four corners of the context-rect so that
-        // they are in the same coordinate system as the current transform
-        // matrix. To do that, we transform by the inverse of the transform
-        // matrix. Happily, this is exactly what cairo_device_to_user() does.
-        cairo_device_to_user(gc, &ulX, &ulY);
-        cairo_device_to_user(gc, &urX, &urY);
-        cairo_device_to_user(gc, &lrX, &lrY);
-        cairo_device_to_user(gc, &llX, &llY);
-
-        // Draw the full-context rect. Note that this might be rotated, so
-        // we cannot just draw a rectangle from ul to lr.
+        // Cairo's pattern matrix maps user space to pattern space. Patterns
+        // are shared between calls, so this needs to be set every time.
+        cairo_matrix_t userToGradient = gradientToUser;
+        if (cairo_matrix_invert(&userToGradient) != CAIRO_STATUS_SUCCESS) {
+            return;
+        }
+        cairo_pattern_set_matrix(pattern, &userToGradient);
+
+        // Every draw sets its own source, so there is no need to restore the
+        // previous one afterwards.
+        const bool ignored = false;
         cairo_new_path(gc);
-        cairo_move_to(gc, ulX, ulY);
-        cairo_line_to(gc, urX, urY);
-        cairo_line_to(gc, lrX, lrY);
-        cairo_line_to(gc, llX, llY);
-        cairo_close_path(gc);
+        cairo_append_path(gc, (cairo_path_t*)path->nativePathForDPI(mDPI, ignored));
+        cairo_set_source(gc, pattern);
+        invalidateAppliedSource();
+        cairo_fill(gc);
+    }
+
+    // For CPU image surfaces, fills the path by computing the gradient from
+    // its color table into a scratch surface covering the path, and then
+    // filling with that, which is much cheaper than Cairo evaluating the
+    // gradient stops for every pixel. Returns false if this does not apply.
+    enum class GradientShape { kLinear, kRadial, kConic };
+    bool fillPathWithGradientTable(std::shared_ptr<BezierPath> path,
+                                   CairoGradient& gradient,
+                                   const cairo_matrix_t& gradientToUser,
+                                   GradientShape shape, float startRadius = 0.0f)
+    {
+        auto *gc = cairoContext();
+        auto *target = cairo_get_group_target(gc);
+        if (cairo_surface_get_type(target) != CAIRO_SURFACE_TYPE_IMAGE) {
+            return false;
+        }
+        auto format = cairo_image_surface_get_format(target);
+        if (format != CAIRO_FORMAT_ARGB32 && format != CAIRO_FORMAT_RGB24) {
+            return false;
+        }
+
+        auto &state = mStateStack.back();
+        cairo_matrix_t deviceToGradient;
+        cairo_matrix_multiply(&deviceToGradient, &gradientToUser, &state.transform);
+        if (cairo_matrix_invert(&deviceToGradient) != CAIRO_STATUS_SUCCESS) {
+            return false;
+        }
+
+        // Inside a layer the target is the group's surface, which only
+        // covers part of the device: device pixel (x, y) is its pixel
+        // (x + offsetX, y + offsetY).
+        double offsetX = 0.0, offsetY = 0.0;
+        cairo_surface_get_device_offset(target, &offsetX, &offsetY);
+        int minX = -int(std::round(offsetX));
+        int minY = -int(std::round(offsetY));
+        auto bounds = deviceBounds(path->controlBounds(), 0.0).intersectedWith(state.clipBounds);
+        int x0 = std::max(minX, int(std::floor(bounds.x.asFloat())));
+        int y0 = std::max(minY, int(std::floor(bounds.y.asFloat())));
+        int x1 = std::min(minX + cairo_image_surface_get_width(target),
+                          int(std::ceil(bounds.maxX().asFloat())));
+        int y1 = std::min(minY + cairo_image_surface_get_height(target),
+                          int(std::ceil(bounds.maxY().asFloat())));
+        if (x1 <= x0 || y1 <= y0) {
+            return true;  // nothing visible, but handled
+        }
+        int w = x1 - x0;
+        int h = y1 - y0;
+
+        if (!mGradientScratch || cairo_image_surface_get_width(mGradientScratch) < w ||
+            cairo_image_surface_get_height(mGradientScratch) < h) {
+            int newW = w, newH = h;
+            if (mGradientScratch) {
+                newW = std::max(newW, cairo_image_surface_get_width(mGradientScratch));
+                newH = std::max(newH, cairo_image_surface_get_height(mGradientScratch));
+                cairo_pattern_destroy(mGradientScratchPattern);
+                cairo_surface_destroy(mGradientScratch);
+            }
+            mGradientScratch = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, newW, newH);
+            mGradientScratchPattern = cairo_pattern_create_for_surface(mGradientScratch);
+            cairo_pattern_set_filter(mGradientScratchPattern, CAIRO_FILTER_NEAREST);
+        }
 
+        const uint32_t *colors = gradient.colorTable();
+        cairo_surface_flush(mGradientScratch);
+        unsigned char *data = cairo_image_surface_get_data(mGradientScratch);
+        int stride = cairo_image_surface_get_stride(mGradientScratch);
+        const auto &m = deviceToGradient;
+        for (int y = 0;  y < h;  ++y) {
+            double px = double(x0) + 0.5;
+            double py = double(y0 + y) + 0.5;
+            double gx = m.xx * px + m.xy * py + m.x0;
+            double gy = m.yx * px + m.yy * py + m.y0;
+            auto *row = (uint32_t*)(data + y * stride);
+            switch (shape) {
+                case GradientShape::kLinear:
+                    fillLinearGradientRow(row, w, gx, m.xx, colors);
+                    break;
+                case GradientShape::kRadial:
+                    fillRadialGradientRow(row, w, gx, gy, m.xx, m.yx, startRadius, colors);
+                    break;
+                case GradientShape::kConic:
+                    fillConicGradientRow(row, w, gx, gy, m.xx, m.yx, colors);
+                    break;
+            }
+        }
+        cairo_surface_mark_dirty_rectangle(mGradientScratch, 0, 0, w, h);
+
+        // The scratch surface's (0, 0) is device pixel (x0, y0), so the
+        // pattern maps user space through the CTM and then offsets.
+        cairo_matrix_t userToScratch, offset;
+        cairo_matrix_init_translate(&offset, -double(x0), -double(y0));
+        cairo_matrix_multiply(&userToScratch, &state.transform, &offset);
+        cairo_pattern_set_matrix(mGradientScratchPattern, &userToScratch);
+
+        const bool ignored = false;
+        cairo_new_path(gc);
+        cairo_append_path(gc, (cairo_path_t*)path->nativePathForDPI(mDPI, ignored));
+        cairo_set_source(gc, mGradientScratchPattern);
+        invalidateAppliedSource();
         cairo_fill(gc);
+        return true;
     }
 
 public:
     void drawText(const char *textUTF8, const Point& topLeft, const Font& font, PaintMode mode) override
     {
+        // We cannot know the extent of the text without laying it out, which
+        // is the expensive part. But left-aligned text only extends right and
+        // down from topLeft (give or take some overhang), so text starting
+        // past the right or bottom of the clip can be rejected without it.
+        auto &state = mStateStack.back();
+        auto &m = state.transform;
+        if (m.xy == 0.0 && m.yx == 0.0 && m.xx > 0.0 && m.yy > 0.0) {
+            double x = topLeft.x.toPixels(mDPI);
+            double y = topLeft.y.toPixels(mDPI);
+            cairo_matrix_transform_point(&m, &x, &y);
+            double overhang = font.pointSize().toPixels(mDPI) * std::max(m.xx, m.yy);
+            if (x - overhang >= double(state.clipBounds.maxX().asFloat()) ||
+                y - overhang >= double(state.clipBounds.maxY().asFloat())) {
+                ++mNCulled;
+                return;
+            }
+        }
         drawText(layoutFromCurrent(textUTF8, font, mode), topLeft);
     }
 
     void drawText(const TextLayout& layout, const Point& topLeft) override
     {
-        // This can only be our TextObj, but we need to cast, otherwise we
+        if (drawCompositeText(layout, topLeft)) {
+            return;
+        }
+        // Otherwise this can only be our TextObj, but we need to cast, otherwise we
         // have to add a virtual function, which then starts putting our
         // internals in the definition (even if we make it protected, it still
         // needs to be in the class declaration).
         const TextObj *text = static_cast<const TextObj*>(&layout);
 
+        auto bounds = text->drawBounds();
+        bounds.x += topLeft.x;
+        bounds.y += topLeft.y;
+        Rect device;
+        if (!isVisible(bounds, kPaintFill, &device)) {
+            return;
+        }
+        applyPendingClip(device);
+
         auto *gc = cairoContext();
         cairo_save(gc);
         cairo_translate(gc, 
@@ -1892,6 +2935,29 @@ public:
 
     void drawImage(std::shared_ptr<DrawableImage> image, const Rect& destRect) override
     {
+        paintImage(image, destRect, 1.0f);
+    }
+
+    void drawLayer(std::shared_ptr<Layer> layer, const Point& topLeft,
+                   float opacity /*= 1.0f*/) override
+    {
+        // The layer is a CairoBitmap, whose image shares the surface, so
+        // this paints the layer's surface directly.
+        auto image = layer->image();
+        if (image) {
+            paintImage(image, Rect(topLeft.x, topLeft.y, image->width(), image->height()),
+                       opacity);
+        }
+    }
+
+    void paintImage(std::shared_ptr<DrawableImage> image, const Rect& destRect,
+                    float opacity)
+    {
+        Rect device;
+        if (!isVisible(destRect, kPaintFill, &device)) {
+            return;
+        }
+        applyPendingClip(device);
         auto *gc = cairoContext();
         save();
         translate(destRect.x, destRect.y);
@@ -1902,12 +2968,113 @@ public:
         scale(sx, sy);
         cairo_set_source_surface(gc, (cairo_surface_t*)image->nativeHandle(),
                                  0.0, 0.0);
-        cairo_paint(gc);
+        invalidateAppliedSource();
+        if (opacity >= 1.0f) {
+            cairo_paint(gc);
+        } else {
+            cairo_paint_with_alpha(gc, double(opacity));
+        }
+        restore();
+    }
+
+    void drawShadow(std::shared_ptr<BezierPath> path, const Size& offset,
+                    const PicaPt& blurRadius, const Color& color) override
+    {
+        auto &state = mStateStack.back();
+        double dx = offset.width.toPixels(mDPI);
+        double dy = offset.height.toPixels(mDPI);
+        cairo_matrix_transform_distance(&state.transform, &dx, &dy);
+        double det = state.transform.xx * state.transform.yy -
+                     state.transform.xy * state.transform.yx;
+        float radiusPx = blurRadius.toPixels(mDPI) * float(std::sqrt(std::abs(det)));
+        int extent = blurExtentPx(radiusPx);
+
+        // The mask is in device pixels, and its origin is on a pixel, so that
+        // moving the path by whole pixels (e.g. scrolling) can reuse it.
+        auto pathBounds = deviceBounds(path->controlBounds(), 1.0);  // 1 px antialiasing
+        int x0 = int(std::floor(pathBounds.x.asFloat())) - extent;
+        int y0 = int(std::floor(pathBounds.y.asFloat())) - extent;
+        int width = int(std::ceil(pathBounds.maxX().asFloat())) + extent - x0;
+        int height = int(std::ceil(pathBounds.maxY().asFloat())) + extent - y0;
+        auto shadowBounds = Rect(PicaPt(float(x0 + dx)), PicaPt(float(y0 + dy)),
+                                 PicaPt(float(width)), PicaPt(float(height)));
+        auto &clip = state.clipBounds;
+        if (width <= 0 || height <= 0 ||
+            shadowBounds.maxX() <= clip.x || shadowBounds.x >= clip.maxX() ||
+            shadowBounds.maxY() <= clip.y || shadowBounds.y >= clip.maxY()) {
+            ++mNCulled;
+            return;
+        }
+
+        ShadowMaskKey key;
+        key.pathHash = path->hash();
+        key.pathToMask = state.transform;
+        key.pathToMask.x0 -= double(x0);
+        key.pathToMask.y0 -= double(y0);
+        key.radiusPx = radiusPx;
+        key.width = width;
+        key.height = height;
+        auto *mask = shadowMask(key, path);
+
+        applyPendingClip(shadowBounds);
+        applySourceColor(color);
+        auto *gc = cairoContext();
+        cairo_identity_matrix(gc);
+        cairo_mask_surface(gc, mask, double(x0) + dx, double(y0) + dy);
+        cairo_set_matrix(gc, &state.transform);
+    }
+
+    void beginLayer(const Rect& bounds, float opacity /*= 1.0f*/) override
+    {
+        save();
+        clipToRect(bounds);
+        applyPendingClip();  // the group's surface is the size of the clip
+        cairo_push_group(cairoContext());
+        mAppliedStack.push_back(mApplied);  // cairo_push_group() saves the state
+        mLayers.push_back({ mStateStack.size(), opacity });
+    }
+
+    void endLayer() override
+    {
+        if (mLayers.empty()) {
+            return;  // unbalanced endLayer()
+        }
+        auto layer = mLayers.back();
+        mLayers.pop_back();
+        while (mStateStack.size() > layer.stateDepth) {
+            restore();  // unbalanced save() inside the layer
+        }
+
+        auto *gc = cairoContext();
+        cairo_pop_group_to_source(gc);
+        mApplied = mAppliedStack.back();
+        mAppliedStack.pop_back();
+        invalidateAppliedSource();
+        // Popping restores the transform from when the group was pushed
+        cairo_set_matrix(gc, &mStateStack.back().transform);
+        if (layer.opacity >= 1.0f) {
+            cairo_paint(gc);
+        } else {
+            cairo_paint_with_alpha(gc, double(layer.opacity));
+        }
         restore();
     }
 
     void clipToRect(const Rect& rect) override
     {
+        auto &state = mStateStack.back();
+        bool isAxisAligned = (state.transform.xy == 0.0 && state.transform.yx == 0.0);
+        state.clipBounds = state.clipBounds.intersectedWith(deviceBounds(rect, 0.0));
+        state.clipIsRect = (state.clipIsRect && isAxisAligned);
+        if (isAxisAligned) {
+            // In device space the clip is still a rect, so clipBounds
+            // describes it exactly; Cairo is told when it is needed.
+            state.clipPending = true;
+            return;
+        }
+
+        applyPendingClip();
+        saveNativeState();
         auto *gc = cairoContext();
         cairo_rectangle(gc, rect.x.toPixels(mDPI), rect.y.toPixels(mDPI),
                         rect.width.toPixels(mDPI), rect.height.toPixels(mDPI));
@@ -1916,10 +3083,28 @@ public:
 
     void clipToPath(std::shared_ptr<BezierPath> path) override
     {
+        applyPendingClip();
+        saveNativeState();
         const bool ignored = false;
         auto *gc = cairoContext();
         cairo_append_path(gc, (cairo_path_t*)path->nativePathForDPI(mDPI, ignored));
         cairo_clip(gc);
+        auto &state = mStateStack.back();
+        state.clipBounds = state.clipBounds.intersectedWith(
+                                    deviceBounds(path->controlBounds(), 0.0));
+        state.clipIsRect = false;
+    }
+
+    int culledDrawCount() const override { return mNCulled; }
+
+    int avoidedStateChangeCount() const override { return mNStateChangesAvoided; }
+
+    std::string fontFamilyForCodePoint(const Font& font, uint32_t codePoint) const override
+    {
+        if (auto *family = gFontMgr.get(font, mDPI)->fallbackFamily(codePoint)) {
+            return *family;
+        }
+        return font.family();
     }
 
     Font::Metrics fontMetrics(const Font& font) const override
@@ -1929,7 +3114,7 @@ public:
         // get more accurate values due to hinting (or lack thereof at
         // higher resolutions).
         PangoFontInfo* fontInfo = gFontMgr.get(font, mDPI);
-        return fontInfo->metrics;
+        return fontInfo->metrics();
     }
 
     TextMetrics textMetrics(const char *textUTF8, const Font& font,
@@ -1983,22 +3168,402 @@ protected:
         auto &state = mStateStack.back();
         switch(mode) {
             case kPaintStroke:
-                setCairoSourceColor(gc, state.strokeColor);
+                applyStrokeStyle();
+                applySourceColor(state.strokeColor);
                 cairo_stroke(gc);
                 break;
             case kPaintFill:
-                setCairoSourceColor(gc, state.fillColor);
+                applySourceColor(state.fillColor);
                 cairo_fill(gc);
                 break;
             case kPaintStrokeAndFill:
-                setCairoSourceColor(gc, state.fillColor);
+                applySourceColor(state.fillColor);
                 cairo_fill_preserve(gc);
-                setCairoSourceColor(gc, state.strokeColor);
+                applyStrokeStyle();
+                applySourceColor(state.strokeColor);
                 cairo_stroke(gc);
                 break;
         }
     }
 
+    // Intersects the clip with the union of the rects, which are in context
+    // coordinates (that is, ignoring the current transform). The rects are
+    // expanded to whole pixels.
+    void clipToContextRects(const std::vector<Rect>& rects)
+    {
+        applyPendingClip();
+        saveNativeState();
+        auto *gc = cairoContext();
+        cairo_matrix_t m;
+        cairo_get_matrix(gc, &m);
+        cairo_identity_matrix(gc);
+        cairo_new_path(gc);
+        bool hasBounds = false;
+        Rect bounds;
+        for (auto &r : rects) {
+            double x0 = std::floor(r.x.toPixels(mDPI));
+            double y0 = std::floor(r.y.toPixels(mDPI));
+            double x1 = std::ceil(r.maxX().toPixels(mDPI));
+            double y1 = std::ceil(r.maxY().toPixels(mDPI));
+            if (x1 <= x0 || y1 <= y0) {
+                continue;
+            }
+            cairo_rectangle(gc, x0, y0, x1 - x0, y1 - y0);
+            Rect device(PicaPt(float(x0)), PicaPt(float(y0)),
+                        PicaPt(float(x1 - x0)), PicaPt(float(y1 - y0)));
+            bounds = (hasBounds ? bounds.unionedWith(device) : device);
+            hasBounds = true;
+        }
+        cairo_clip(gc);  // with no rects the path is empty, which clips everything
+        cairo_set_matrix(gc, &m);
+
+        auto &state = mStateStack.back();
+        state.clipBounds = state.clipBounds.intersectedWith(bounds);
+        state.clipIsRect = (state.clipIsRect && rects.size() <= 1);
+    }
+
+    // Opaque fills of pixel-aligned rects are most of the fills in a UI
+    // (backgrounds, table cells, selections). For CPU image surfaces we can
+    // write the pixels directly, which is much faster than going through
+    // Cairo's rasterizer. Returns false if the fast path does not apply.
+    bool fillRectFast(const Rect& rect, const Color& color)
+    {
+        auto &state = mStateStack.back();
+        auto &m = state.transform;
+        if (color.alpha() < 1.0f || !state.clipIsRect || m.xy != 0.0 || m.yx != 0.0) {
+            return false;
+        }
+        if (!mLayers.empty()) {
+            return false;  // drawing goes to the layer's group, not the target
+        }
+        auto *gc = cairoContext();
+        auto *target = cairo_get_target(gc);
+        if (cairo_surface_get_type(target) != CAIRO_SURFACE_TYPE_IMAGE ||
+            cairo_get_operator(gc) != CAIRO_OPERATOR_OVER) {
+            return false;
+        }
+        auto format = cairo_image_surface_get_format(target);
+        if (format != CAIRO_FORMAT_ARGB32 && format != CAIRO_FORMAT_RGB24) {
+            return false;
+        }
+
+        double x0 = rect.x.toPixels(mDPI), y0 = rect.y.toPixels(mDPI);
+        double x1 = rect.maxX().toPixels(mDPI), y1 = rect.maxY().toPixels(mDPI);
+        cairo_matrix_transform_point(&m, &x0, &y0);
+        cairo_matrix_transform_point(&m, &x1, &y1);
+        if (x0 > x1) { std::swap(x0, x1); }
+        if (y0 > y1) { std::swap(y0, y1); }
+        auto &clip = state.clipBounds;
+        double cx0 = clip.x.asFloat(), cy0 = clip.y.asFloat();
+        double cx1 = clip.maxX().asFloat(), cy1 = clip.maxY().asFloat();
+        // Cairo uses 24.8 fixed point, so anything within half of 1/256 of
+        // a pixel boundary is exactly on the boundary as far as it is
+        // concerned. Otherwise the edges need antialiasing.
+        auto isAligned = [](double v) { return (std::abs(v - std::round(v)) < 0.5 / 256.0); };
+        if (!isAligned(x0) || !isAligned(y0) || !isAligned(x1) || !isAligned(y1) ||
+            !isAligned(cx0) || !isAligned(cy0) || !isAligned(cx1) || !isAligned(cy1)) {
+            return false;
+        }
+
+        int ix0 = int(std::round(std::max(x0, cx0)));
+        int iy0 = int(std::round(std::max(y0, cy0)));
+        int ix1 = int(std::round(std::min(x1, cx1)));
+        int iy1 = int(std::round(std::min(y1, cy1)));
+        ix0 = std::max(ix0, 0);
+        iy0 = std::max(iy0, 0);
+        ix1 = std::min(ix1, cairo_image_surface_get_width(target));
+        iy1 = std::min(iy1, cairo_image_surface_get_height(target));
+        if (ix1 <= ix0 || iy1 <= iy0) {
+            return true;  // nothing visible, but handled
+        }
+
+        // Same conversion Cairo does (double -> 16-bit -> 8-bit), so that
+        // the pixels are identical to the slow path.
+        auto to8 = [](float c) { return uint32_t(uint16_t(double(c) * 65535.0 + 0.5) >> 8); };
+        uint32_t pixel = 0xff000000 | (to8(color.red()) << 16)
+                         | (to8(color.green()) << 8) | to8(color.blue());
+
+        cairo_surface_flush(target);
+        unsigned char *data = cairo_image_surface_get_data(target);
+        int stride = cairo_image_surface_get_stride(target);
+        int w = ix1 - ix0;
+        for (int y = iy0;  y < iy1;  ++y) {
+            // A simple loop over uint32_t, which compilers vectorize into
+            // wide stores on every platform.
+            uint32_t *row = (uint32_t*)(data + y * stride) + ix0;
+            std::fill_n(row, w, pixel);
+        }
+        cairo_surface_mark_dirty_rectangle(target, ix0, iy0, w, iy1 - iy0);
+        return true;
+    }
+
+    // Returns the transform in pixels, suitable for Cairo
+    cairo_matrix_t pixelMatrix(const AffineTransform& t) const
+    {
+        cairo_matrix_t m;
+        cairo_matrix_init(&m, t.a, t.b, t.c, t.d,
+                          t.tx.toPixels(mDPI), t.ty.toPixels(mDPI));
+        return m;
+    }
+
+    // Returns the bounding box in device pixels of the user-space rect,
+    // outset by outsetPx user-space pixels. The result is exact for
+    // translations and scales, and conservative for rotations.
+    Rect deviceBounds(const Rect& r, double outsetPx) const
+    {
+        auto &m = mStateStack.back().transform;
+        double x0 = r.x.toPixels(mDPI) - outsetPx;
+        double y0 = r.y.toPixels(mDPI) - outsetPx;
+        double x1 = r.maxX().toPixels(mDPI) + outsetPx;
+        double y1 = r.maxY().toPixels(mDPI) + outsetPx;
+        double xs[4] = { x0, x1, x1, x0 };
+        double ys[4] = { y0, y0, y1, y1 };
+        for (int i = 0;  i < 4;  ++i) {
+            cairo_matrix_transform_point(&m, &xs[i], &ys[i]);
+        }
+        double minX = std::min(std::min(xs[0], xs[1]), std::min(xs[2], xs[3]));
+        double maxX = std::max(std::max(xs[0], xs[1]), std::max(xs[2], xs[3]));
+        double minY = std::min(std::min(ys[0], ys[1]), std::min(ys[2], ys[3]));
+        double maxY = std::max(std::max(ys[0], ys[1]), std::max(ys[2], ys[3]));
+        return Rect(PicaPt(float(minX)), PicaPt(float(minY)),
+                    PicaPt(float(maxX - minX)), PicaPt(float(maxY - minY)));
+    }
+
+    // Returns false (and counts the call as culled) if drawing the rect with
+    // the current stroke settings cannot touch any pixel inside the clip.
+    // This is conservative: it may return true for things that end up not
+    // being visible, but never false for something that is. If device is
+    // given, it is set to the device-space area the drawing may touch.
+    bool isVisible(const Rect& r, PaintMode mode, Rect *device = nullptr)
+    {
+        auto &state = mStateStack.back();
+        double outsetPx = 0.0;
+        if (mode != kPaintFill) {
+            // Miters can extend up to miterLimit * strokeWidth / 2 from the
+            // path (we leave Cairo's miter limit at its default of 10);
+            // square caps and other joins are within sqrt(2) * strokeWidth / 2.
+            double halfWidth = 0.5 * double(state.strokeWidth.toPixels(mDPI));
+            outsetPx = (state.joinStyle == kJoinMiter ? 10.0 : 1.4143) * halfWidth;
+        }
+        const float kAntialias = 1.0f;  // device pixels
+        auto drawn = deviceBounds(r, outsetPx + kAntialias);
+        auto &clip = state.clipBounds;
+        // Bounds that only touch the clip cannot cover any of its pixels
+        if (drawn.maxX() <= clip.x || drawn.x >= clip.maxX() ||
+            drawn.maxY() <= clip.y || drawn.y >= clip.maxY()) {
+            ++mNCulled;
+            return false;
+        }
+        if (device) {
+            *device = drawn;
+        }
+        return true;
+    }
+
+    struct ShadowMaskKey
+    {
+        size_t pathHash;
+        cairo_matrix_t pathToMask;  // path pixels -> mask pixels
+        float radiusPx;  // in mask pixels
+        int width;
+        int height;
+
+        bool operator==(const ShadowMaskKey& rhs) const
+        {
+            return (pathHash == rhs.pathHash && radiusPx == rhs.radiusPx &&
+                    width == rhs.width && height == rhs.height &&
+                    pathToMask.xx == rhs.pathToMask.xx &&
+                    pathToMask.yx == rhs.pathToMask.yx &&
+                    pathToMask.xy == rhs.pathToMask.xy &&
+                    pathToMask.yy == rhs.pathToMask.yy &&
+                    pathToMask.x0 == rhs.pathToMask.x0 &&
+                    pathToMask.y0 == rhs.pathToMask.y0);
+        }
+    };
+    struct ShadowMask
+    {
+        ShadowMaskKey key;
+        cairo_surface_t *surface;  // CAIRO_FORMAT_A8
+    };
+
+    // Returns the blurred alpha of the path described by the key, which is
+    // cached since blurring is expensive and shadows are usually redrawn
+    // unchanged (e.g. behind a button or card) every frame.
+    cairo_surface_t* shadowMask(const ShadowMaskKey& key,
+                                std::shared_ptr<BezierPath> path)
+    {
+        for (auto it = mShadowMasks.begin();  it != mShadowMasks.end();  ++it) {
+            if (it->key == key) {
+                mShadowMasks.splice(mShadowMasks.begin(), mShadowMasks, it);
+                return it->surface;
+            }
+        }
+
+        auto *surface = cairo_image_surface_create(CAIRO_FORMAT_A8, key.width, key.height);
+        auto *gc = cairo_create(surface);
+        cairo_set_matrix(gc, &key.pathToMask);
+        const bool ignored = false;
+        cairo_append_path(gc, (cairo_path_t*)path->nativePathForDPI(mDPI, ignored));
+        cairo_fill(gc);
+        cairo_destroy(gc);
+        cairo_surface_flush(surface);
+        blurPixels(cairo_image_surface_get_data(surface), key.width, key.height,
+                   cairo_image_surface_get_stride(surface), 1, key.radiusPx);
+        cairo_surface_mark_dirty(surface);
+
+        const size_t kMaxShadowMasks = 16;
+        if (mShadowMasks.size() >= kMaxShadowMasks) {
+            cairo_surface_destroy(mShadowMasks.back().surface);
+            mShadowMasks.pop_back();
+        }
+        mShadowMasks.push_front({ key, surface });
+        return surface;
+    }
+
+    // Axis-aligned rect clips are only recorded in clipBounds, since that
+    // is much cheaper than a Cairo clip, and many never need one: nested
+    // clips (scroll views, table cells) intersect arithmetically, and most
+    // drawing is entirely inside the clip anyway. This gives the clip to
+    // Cairo if drawing in deviceDrawBounds could extend outside it, and
+    // must be called before a path is created, since clipping uses the path.
+    void applyPendingClip(const Rect& deviceDrawBounds)
+    {
+        auto &state = mStateStack.back();
+        if (!state.clipPending) {
+            return;
+        }
+        auto &clip = state.clipBounds;
+        if (deviceDrawBounds.x >= clip.x && deviceDrawBounds.maxX() <= clip.maxX() &&
+            deviceDrawBounds.y >= clip.y && deviceDrawBounds.maxY() <= clip.maxY()) {
+            return;
+        }
+        applyPendingClip();
+    }
+
+    void applyPendingClip()
+    {
+        auto &state = mStateStack.back();
+        if (!state.clipPending) {
+            return;
+        }
+        // Cairo's clip is the intersection of all the clips before this,
+        // all of which contain clipBounds, so intersecting with clipBounds
+        // gives the current clip (even if an earlier clip was a path).
+        saveNativeState();
+        auto *gc = cairoContext();
+        auto &clip = state.clipBounds;
+        cairo_identity_matrix(gc);
+        cairo_new_path(gc);
+        cairo_rectangle(gc, clip.x.asFloat(), clip.y.asFloat(),
+                        std::max(0.0f, clip.width.asFloat()),
+                        std::max(0.0f, clip.height.asFloat()));
+        cairo_clip(gc);
+        cairo_set_matrix(gc, &state.transform);
+        state.clipPending = false;
+    }
+
+    // Saves Cairo's graphics state, if it has not been saved since save(),
+    // so that restore() can undo changes that are not mirrored in State.
+    // Must be called before changing the clip or the dashes.
+    void saveNativeState()
+    {
+        auto &state = mStateStack.back();
+        if (!state.nativeSaved && mStateStack.size() > 1) {
+            cairo_save(cairoContext());
+            mAppliedStack.push_back(mApplied);
+            state.nativeSaved = true;
+        }
+    }
+
+    // Sets Cairo's source to the color, unless it already is. Anything else
+    // that sets the source must call invalidateAppliedSource().
+    void applySourceColor(const Color& color)
+    {
+        auto &applied = mApplied;
+        if (applied.sourceIsColor && applied.source.red() == color.red() &&
+            applied.source.green() == color.green() &&
+            applied.source.blue() == color.blue() &&
+            applied.source.alpha() == color.alpha()) {
+            ++mNStateChangesAvoided;
+            return;
+        }
+        setCairoSourceColor(cairoContext(), color);
+        applied.source = color;
+        applied.sourceIsColor = true;
+    }
+
+    void invalidateAppliedSource() { mApplied.sourceIsColor = false; }
+
+    // Gives Cairo the current stroke settings that it does not already have
+    void applyStrokeStyle()
+    {
+        auto *gc = cairoContext();
+        auto &state = mStateStack.back();
+        auto &applied = mApplied;
+
+        double width = double(state.strokeWidth.toPixels(mDPI));
+        if (applied.lineWidth != width) {
+            cairo_set_line_width(gc, width);
+            applied.lineWidth = width;
+        } else {
+            ++mNStateChangesAvoided;
+        }
+
+        if (applied.endCapStyle != int(state.endCapStyle)) {
+            switch(state.endCapStyle) {
+                case kEndCapButt:
+                    cairo_set_line_cap(gc, CAIRO_LINE_CAP_BUTT);
+                    break;
+                case kEndCapRound:
+                    cairo_set_line_cap(gc, CAIRO_LINE_CAP_ROUND);
+                    break;
+                case kEndCapSquare:
+                    cairo_set_line_cap(gc, CAIRO_LINE_CAP_SQUARE);
+                    break;
+            }
+            applied.endCapStyle = int(state.endCapStyle);
+        } else {
+            ++mNStateChangesAvoided;
+        }
+
+        if (applied.joinStyle != int(state.joinStyle)) {
+            switch(state.joinStyle) {
+                case kJoinMiter:
+                    cairo_set_line_join(gc, CAIRO_LINE_JOIN_MITER);
+                    break;
+                case kJoinRound:
+                    cairo_set_line_join(gc, CAIRO_LINE_JOIN_ROUND);
+                    break;
+                case kJoinBevel:
+                    cairo_set_line_join(gc, CAIRO_LINE_JOIN_BEVEL);
+                    break;
+            }
+            applied.joinStyle = int(state.joinStyle);
+        } else {
+            ++mNStateChangesAvoided;
+        }
+
+        // Most strokes are solid, and dashed strokes usually share the
+        // pattern, so comparing pointers catches nearly everything.
+        bool sameDashes = (applied.dashesValid &&
+                           (applied.dashes == state.dashes ||
+                            (applied.dashes && state.dashes &&
+                             *applied.dashes == *state.dashes)));
+        if (!sameDashes) {
+            if (state.dashes) {
+                cairo_set_dash(gc, state.dashes->lengths.data(),
+                               int(state.dashes->lengths.size()),
+                               state.dashes->offset);
+            } else {
+                cairo_set_dash(gc, nullptr, 0, 0.0);
+            }
+            applied.dashes = state.dashes;
+            applied.dashesValid = true;
+        } else {
+            ++mNStateChangesAvoided;
+        }
+    }
+
     void setFont(const Font& font) const
     {
         auto *gc = cairoContext();
@@ -2011,15 +3576,67 @@ protected:
     }
 
 private:
+    struct DashPattern
+    {
+        std::vector<double> lengths;  // in pixels
+        double offset = 0.0;  // in pixels, as Cairo wants it
+
+        bool operator==(const DashPattern& rhs) const
+            { return (lengths == rhs.lengths && offset == rhs.offset); }
+    };
+
+    // This is copied on every save(), so keep it small.
     struct State
     {
+        cairo_matrix_t transform;  // mirrors Cairo's CTM
+        Rect clipBounds;  // in device pixels (not PicaPt); bounds of the clip
         Color fillColor;
         Color strokeColor;
         PicaPt strokeWidth;
-        EndCapStyle endCapStyle;
-        JoinStyle joinStyle;
+        std::shared_ptr<const DashPattern> dashes;  // nullptr is solid
+        EndCapStyle endCapStyle : 8;
+        JoinStyle joinStyle : 8;
+        bool clipIsRect : 1;  // clip is exactly clipBounds
+        bool clipPending : 1;  // Cairo has not been given clipBounds yet
+        bool nativeSaved : 1;  // cairo_save() was called for this state
+        bool transformChanged : 1;  // since save()
+
+        State()
+            : endCapStyle(kEndCapButt), joinStyle(kJoinMiter)
+            , clipIsRect(true), clipPending(false)
+            , nativeSaved(false), transformChanged(false)
+        {}
     };
     std::vector<State> mStateStack;
+    cairo_matrix_t mBaseTransform;  // CTM for context coordinates
+    // The paint settings Cairo currently has, so that draws only change
+    // what is different. Invalid values force the next draw to set them.
+    struct AppliedState
+    {
+        Color source;
+        bool sourceIsColor = false;
+        double lineWidth = -1.0;
+        int endCapStyle = -1;
+        int joinStyle = -1;
+        bool dashesValid = false;
+        std::shared_ptr<const DashPattern> dashes;
+    };
+    AppliedState mApplied;
+    std::vector<AppliedState> mAppliedStack;  // one for each saveNativeState()
+    struct LayerInfo
+    {
+        size_t stateDepth;  // mStateStack.size() after beginLayer()
+        float opacity;
+    };
+    std::vector<LayerInfo> mLayers;
+    std::list<ShadowMask> mShadowMasks;  // most recently used first
+    int mNCulled = 0;
+    int mNStateChangesAvoided = 0;
+    GradientMode mGradientMode = kGradientNative;
+    cairo_surface_t *mGradientScratch = nullptr;
+    cairo_pattern_t *mGradientScratchPattern = nullptr;
+    cairo_pattern_t *mMeshPattern = nullptr;
+    std::vector<GradientMeshPatch> mMeshPatches;  // that mMeshPattern was created from
 };
 //-----------------------------------------------------------------------------
 // This is a CPU-bound bitmap
@@ -2126,6 +3743,7 @@ public:
 
 class CairoX11DrawContext : public CairoDrawContext
 {
+    using Super = CairoDrawContext;
 protected:
     // These are X11's pointers, we do not own them
     Display *mDisplay;
@@ -2134,7 +3752,10 @@ protected:
     // We own everything below here
     cairo_surface_t *mSurface = nullptr;
     cairo_t *mDC = nullptr;
-    
+
+    std::vector<Rect> mDirty;
+    bool mIsClippedToDirty = false;
+
 public:
     // For derived classes. The object is incomplete until the derived class
     // calls finishConstructing().
@@ -2172,6 +3793,57 @@ public:
                                                  dpi);
     }
 
+    void invalidate(const Rect& r) override
+    {
+        if (r.isEmpty()) {
+            return;
+        }
+        // Merge overlapping rects, so that repeatedly invalidating the same
+        // widget does not grow the list. If there are still a lot of rects,
+        // drawing the bounding box is cheaper than a complex clip.
+        const size_t kMaxRects = 16;
+        Rect newRect = r;
+        for (size_t i = 0;  i < mDirty.size();  ) {
+            if (mDirty[i].intersects(newRect)) {
+                newRect = newRect.unionedWith(mDirty[i]);
+                mDirty.erase(mDirty.begin() + i);
+                i = 0;  // union may now overlap something we already passed
+            } else {
+                ++i;
+            }
+        }
+        mDirty.push_back(newRect);
+        if (mDirty.size() > kMaxRects) {
+            Rect bounds = mDirty[0];
+            for (auto &d : mDirty) {
+                bounds = bounds.unionedWith(d);
+            }
+            mDirty = { bounds };
+        }
+    }
+
+    std::vector<Rect> dirtyRegion() const override { return mDirty; }
+
+    using Super::beginDraw;
+
+    void beginDraw(const std::vector<Rect>& dirtyRegion) override
+    {
+        beginDraw();  // virtual, so that derived classes are also notified
+        save();
+        clipToContextRects(dirtyRegion);
+        mIsClippedToDirty = true;
+        mDirty.clear();
+    }
+
+    void endDraw() override
+    {
+        if (mIsClippedToDirty) {
+            restore();
+            mIsClippedToDirty = false;
+        }
+        Super::endDraw();
+    }
+
 protected:
     void finishConstructing(Drawable drawable, 
                             cairo_surface_t* surface /* takes ownership */)
@@ -2183,6 +3855,250 @@ protected:
     }
 };
 
+//-----------------------------------------------------------------------------
+namespace {
+bool gShmAttachFailed = false;
+
+int shmAttachErrorHandler(Display *display, XErrorEvent *err)
+{
+    gShmAttachFailed = true;
+    return 0;
+}
+} // namespace
+
+// Draws into a client-side image surface and copies the damaged areas to the
+// drawable in endDraw(), so that the window never shows a partially drawn
+// frame and drawing does not generate any X traffic. The image is in shared
+// memory if the server supports MIT-SHM (which requires a local connection),
+// otherwise it is sent with XPutImage().
+class CairoX11BufferedDrawContext : public CairoX11DrawContext
+{
+    using Super = CairoX11DrawContext;
+private:
+    Visual *mVisual;
+    int mDepth;
+    GC mGC = nullptr;
+    XImage *mImage = nullptr;
+    XShmSegmentInfo mShmInfo;
+    bool mUsingShm = false;
+
+    std::vector<Rect> mPresentRects;
+    bool mPresentAll = true;
+
+    // Depth 24 may be packed into 24 bits per pixel, unlike Cairo's RGB24
+    static int bitsPerPixel(Display *display, int depth)
+    {
+        int bpp = 0;
+        int nFormats = 0;
+        XPixmapFormatValues *formats = XListPixmapFormats(display, &nFormats);
+        for (int i = 0;  i < nFormats;  ++i) {
+            if (formats[i].depth == depth) {
+                bpp = formats[i].bits_per_pixel;
+            }
+        }
+        if (formats) {
+            XFree(formats);
+        }
+        return bpp;
+    }
+
+public:
+    // The image surface can only be copied directly into the window if the
+    // pixel layout is the same as Cairo's. This is true of all the visuals
+    // that anyone actually uses nowadays, but if it is false, the caller
+    // should use an unbuffered context.
+    static bool canBuffer(Display *display, Drawable window)
+    {
+        XWindowAttributes attrs;
+        if (!XGetWindowAttributes(display, (Window)window, &attrs)) {
+            return false;
+        }
+        auto *v = attrs.visual;
+        int nativeByteOrder = (isLittleEndian() ? LSBFirst : MSBFirst);
+        return ((attrs.depth == 24 || attrs.depth == 32) &&
+                v->c_class == TrueColor &&
+                v->red_mask == 0xff0000 && v->green_mask == 0x00ff00 &&
+                v->blue_mask == 0x0000ff &&
+                ImageByteOrder(display) == nativeByteOrder &&
+                bitsPerPixel(display, attrs.depth) == 32);
+    }
+
+    CairoX11BufferedDrawContext(Display* display, Drawable window,
+                                int width, int height, float dpi)
+        : CairoX11DrawContext(display, width, height, dpi)
+    {
+        XWindowAttributes attrs;
+        XGetWindowAttributes(display, (Window)window, &attrs);
+        mVisual = attrs.visual;
+        mDepth = attrs.depth;
+        mGC = XCreateGC(display, window, 0, nullptr);
+
+        auto format = (mDepth == 32 ? CAIRO_FORMAT_ARGB32 : CAIRO_FORMAT_RGB24);
+        if (XShmQueryExtension(display)) {
+            mUsingShm = createShmImage(width, height);
+        }
+        if (!mUsingShm) {
+            int stride = cairo_format_stride_for_width(format, width);
+            // XDestroyImage() will free() the data
+            char *data = (char*)malloc(size_t(stride) * size_t(height));
+            if (data) {
+                mImage = XCreateImage(display, mVisual, mDepth, ZPixmap, 0, data,
+                                      width, height, 32, stride);
+                if (!mImage) {
+                    free(data);
+                }
+            }
+        }
+        if (!mImage) {
+            return;  // isBuffered() is false, caller should not use this
+        }
+
+        auto *surface = cairo_image_surface_create_for_data(
+                                (unsigned char*)mImage->data, format,
+                                width, height, mImage->bytes_per_line);
+        finishConstructing(window, surface);
+    }
+
+    ~CairoX11BufferedDrawContext()
+    {
+        // The surface uses the image's memory, so it needs to be destroyed
+        // first. (Cairo allows destroying nullptr in the base destructor.)
+        cairo_destroy(mDC);
+        mDC = nullptr;
+        cairo_surface_destroy(mSurface);
+        mSurface = nullptr;
+
+        if (mUsingShm) {
+            XShmDetach(mDisplay, &mShmInfo);
+            mImage->data = nullptr;  // so XDestroyImage() does not free() it
+            XDestroyImage(mImage);
+            shmdt(mShmInfo.shmaddr);
+        } else if (mImage) {
+            XDestroyImage(mImage);
+        }
+        XFreeGC(mDisplay, mGC);
+    }
+
+    // Returns false if the image could not be allocated, in which case
+    // this context cannot draw.
+    bool isBuffered() const { return (mImage != nullptr); }
+
+    std::shared_ptr<DrawContext> createBitmap(BitmapType type,
+                                              int width, int height,
+                                              float dpi /*= 72.0f*/) override
+    {
+        // We draw on the CPU, so drawing a server-side pixmap would require
+        // fetching it from the server each time.
+        return std::make_shared<CairoBitmap>(type, width, height, dpi);
+    }
+
+    void beginDraw() override
+    {
+        Super::beginDraw();
+        mPresentAll = true;
+        mPresentRects.clear();
+    }
+
+    void beginDraw(const std::vector<Rect>& dirtyRegion) override
+    {
+        Super::beginDraw(dirtyRegion);  // calls beginDraw()
+        mPresentAll = false;
+        mPresentRects = dirtyRegion;
+    }
+
+    void endDraw() override
+    {
+        Super::endDraw();
+        present();
+    }
+
+private:
+    bool createShmImage(int width, int height)
+    {
+        mImage = XShmCreateImage(mDisplay, mVisual, mDepth, ZPixmap, nullptr,
+                                 &mShmInfo, width, height);
+        if (!mImage) {
+            return false;
+        }
+        mShmInfo.shmid = shmget(IPC_PRIVATE,
+                                size_t(mImage->bytes_per_line) * size_t(mImage->height),
+                                IPC_CREAT | 0600);
+        if (mShmInfo.shmid < 0) {
+            XDestroyImage(mImage);
+            mImage = nullptr;
+            return false;
+        }
+        mShmInfo.shmaddr = (char*)shmat(mShmInfo.shmid, nullptr, 0);
+        if (mShmInfo.shmaddr == (char*)-1) {
+            shmctl(mShmInfo.shmid, IPC_RMID, nullptr);
+            XDestroyImage(mImage);
+            mImage = nullptr;
+            return false;
+        }
+        mShmInfo.readOnly = False;
+        mImage->data = mShmInfo.shmaddr;
+
+        // Attaching fails asynchronously if the server is remote, so we need
+        // to sync and see if an error came back.
+        gShmAttachFailed = false;
+        auto oldHandler = XSetErrorHandler(shmAttachErrorHandler);
+        bool attached = XShmAttach(mDisplay, &mShmInfo);
+        XSync(mDisplay, False);
+        XSetErrorHandler(oldHandler);
+        attached = (attached && !gShmAttachFailed);
+
+        // The segment is deleted after the last detach, so we cannot leak it
+        // even if we crash.
+        shmctl(mShmInfo.shmid, IPC_RMID, nullptr);
+
+        if (!attached) {
+            mImage->data = nullptr;
+            XDestroyImage(mImage);
+            mImage = nullptr;
+            shmdt(mShmInfo.shmaddr);
+            return false;
+        }
+        return true;
+    }
+
+    void present()
+    {
+        cairo_surface_flush(mSurface);
+
+        auto putImage = [this](int x, int y, int w, int h) {
+            if (mUsingShm) {
+                XShmPutImage(mDisplay, mDrawable, mGC, mImage, x, y, x, y,
+                             w, h, False);
+            } else {
+                XPutImage(mDisplay, mDrawable, mGC, mImage, x, y, x, y, w, h);
+            }
+        };
+
+        if (mPresentAll) {
+            putImage(0, 0, mWidth, mHeight);
+        } else {
+            for (auto &r : mPresentRects) {
+                // Same rounding as the clip in beginDraw(dirtyRegion)
+                int x0 = std::max(0, int(std::floor(r.x.toPixels(mDPI))));
+                int y0 = std::max(0, int(std::floor(r.y.toPixels(mDPI))));
+                int x1 = std::min(mWidth, int(std::ceil(r.maxX().toPixels(mDPI))));
+                int y1 = std::min(mHeight, int(std::ceil(r.maxY().toPixels(mDPI))));
+                if (x1 > x0 && y1 > y0) {
+                    putImage(x0, y0, x1 - x0, y1 - y0);
+                }
+            }
+        }
+
+        if (mUsingShm) {
+            // The server reads the image asynchronously, so we must not
+            // draw into it again until it is done.
+            XSync(mDisplay, False);
+        } else {
+            XFlush(mDisplay);
+        }
+    }
+};
+
 class CairoX11Image : public CairoImage
 {
 private:
@@ -2200,6 +4116,8 @@ public:
 class CairoX11Bitmap : public CairoX11DrawContext
 {
     using Super = CairoX11DrawContext;
+public:
+    using Super::beginDraw;
 private:
     BitmapType mType;
     std::shared_ptr<ShareableX11Pixmap> mPixmap;
@@ -2292,6 +4210,21 @@ std::shared_ptr<DrawContext> DrawContext::fromX11(
                                                  dpi);
 }
 
+std::shared_ptr<DrawContext> DrawContext::fromX11DoubleBuffered(
+            void* display, const void* window, int width, int height, float dpi)
+{
+    if (!CairoX11BufferedDrawContext::canBuffer((Display*)display,
+                                                *(Drawable*)window)) {
+        return fromX11(display, window, width, height, dpi);
+    }
+    auto dc = std::make_shared<CairoX11BufferedDrawContext>(
+                    (Display*)display, *(Drawable*)window, width, height, dpi);
+    if (!dc->isBuffered()) {
+        return fromX11(display, window, width, height, dpi);
+    }
+    return dc;
+}
+
 std::shared_ptr<DrawContext> DrawContext::createCairoX11Bitmap(
             void *display, BitmapType type, int width, int height,
             float dpi /*= 72.0f*/)
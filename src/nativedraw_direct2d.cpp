@@ -471,6 +471,8 @@ public:
 
     Id id() const override { return mId; }
 
+    const std::vector<Stop>& stops() const override { return mInfo.stops; }
+
     const GradientInfo& info() const { return mInfo; }
 
     void setInvalid()
@@ -2862,6 +2864,9 @@ public:
 
     void drawText(const TextLayout& layout, const Point& topLeft) override
     {
+        if (drawCompositeText(layout, topLeft)) {
+            return;
+        }
         auto& state = mStateStack.back();
         auto* gc = deviceContext();
 
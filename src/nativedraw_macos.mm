@@ -140,6 +140,8 @@ public:
 
     Id id() const override { return calcId(); }
 
+    const std::vector<Stop>& stops() const override { return mInfo.stops; }
+
     CGGradient* cgGradient() const { return mGradient; }
     const GradientInfo& info() const { return mInfo; }
     
@@ -955,6 +957,7 @@ private:
     };
 
     std::vector<ContextState> mStateStack;
+    CGAffineTransform mBaseTransform;  // CTM for context coordinates
 
 public:
     CoreGraphicsContext(void *cgcontext, int width, int height, float dpi, float nativeDPI)
@@ -1178,6 +1181,7 @@ public:
         CGContextRef gc = (CGContextRef)nativeDC;
         CGContextTranslateCTM(gc, 0, mHeight);
         CGContextScaleCTM(gc, 1, -1);
+        mBaseTransform = CGContextGetCTM(gc);
 
         mStateStack.clear();
         mStateStack.push_back(ContextState());
@@ -1219,6 +1223,42 @@ public:
         CGContextScaleCTM(gc, sx, sy);
     }
 
+    AffineTransform currentTransform() const override
+    {
+        CGContextRef gc = (CGContextRef)mNativeDC;
+        // CoreGraphics concatenates left to right: CTM = user then base
+        CGAffineTransform t = CGAffineTransformConcat(CGContextGetCTM(gc),
+                                                      CGAffineTransformInvert(mBaseTransform));
+        return AffineTransform(float(t.a), float(t.b), float(t.c), float(t.d),
+                               PicaPt::fromPixels(float(t.tx), mDPI),
+                               PicaPt::fromPixels(float(t.ty), mDPI));
+    }
+
+    void setTransform(const AffineTransform& t) override
+    {
+        // There is no public function to set the CTM, so undo it instead.
+        CGContextRef gc = (CGContextRef)mNativeDC;
+        CGContextConcatCTM(gc, CGAffineTransformInvert(CGContextGetCTM(gc)));
+        CGContextConcatCTM(gc, mBaseTransform);
+        concatTransform(t);
+    }
+
+    void concatTransform(const AffineTransform& t) override
+    {
+        CGContextRef gc = (CGContextRef)mNativeDC;
+        CGContextConcatCTM(gc, CGAffineTransformMake(t.a, t.b, t.c, t.d,
+                                                     t.tx.toPixels(mDPI),
+                                                     t.ty.toPixels(mDPI)));
+    }
+
+    Rect clipBounds() const override
+    {
+        CGContextRef gc = (CGContextRef)mNativeDC;
+        CGRect r = CGContextGetClipBoundingBox(gc);  // in user space
+        return Rect::fromPixels(float(r.origin.x), float(r.origin.y),
+                                float(r.size.width), float(r.size.height), mDPI);
+    }
+
     void calcContextPixel(const Point& point, float *x, float *y) override
     {
         CGContextRef gc = (CGContextRef)mNativeDC;
@@ -1426,6 +1466,9 @@ public:
 
     void drawText(const TextLayout& layout, const Point& p) override
     {
+        if (drawCompositeText(layout, p)) {
+            return;
+        }
         // We know we have a TextObj, because that is the only thing
         // we give out, so dynamic casting would be unnecessarily slow,
         // which is not what you want in your drawing functions. But we
@@ -1463,6 +1506,27 @@ public:
                                            rect.width.toPixels(mDPI), rect.height.toPixels(mDPI)));
     }
 
+    void beginLayer(const Rect& bounds, float opacity /*= 1.0f*/) override
+    {
+        CGContextRef gc = (CGContextRef)mNativeDC;
+        save();
+        clipToRect(bounds);
+        // The alpha applies when the layer is composited; inside the layer
+        // it is reset to 1.
+        CGContextSetAlpha(gc, opacity);
+        CGContextBeginTransparencyLayerWithRect(gc,
+                CGRectMake(bounds.x.toPixels(mDPI), bounds.y.toPixels(mDPI),
+                           bounds.width.toPixels(mDPI), bounds.height.toPixels(mDPI)),
+                NULL);
+    }
+
+    void endLayer() override
+    {
+        CGContextRef gc = (CGContextRef)mNativeDC;
+        CGContextEndTransparencyLayer(gc);
+        restore();
+    }
+
     void clipToPath(std::shared_ptr<BezierPath> path) override
     {
         CGContextRef gc = (CGContextRef)mNativeDC;
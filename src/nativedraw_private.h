@@ -25,7 +25,10 @@
 
 #include "nativedraw.h"
 
+#include <algorithm>
 #include <functional>
+#include <memory>
+#include <mutex>
 #include <unordered_map>
 
 namespace ND_NAMESPACE {
@@ -97,12 +100,68 @@ protected:
     DestroyFunc mDestroy;
 };
 
+// A set of immutable values, shared so that equal values use one allocation
+// and can be compared by pointer. Values are freed when the last reference
+// to them is released. Since values may be released during static destruction
+// (e.g. global Fonts), tables should be allocated with new and never deleted.
+template <typename T, typename Equal = std::equal_to<T>>
+class InternTable
+{
+public:
+    std::shared_ptr<const T> intern(T&& value, std::size_t hash)
+    {
+        std::lock_guard<std::mutex> guard(mLock);
+        auto range = mTable.equal_range(hash);
+        for (auto it = range.first;  it != range.second;  ) {
+            auto existing = it->second.lock();
+            if (!existing) {
+                it = mTable.erase(it);
+            } else if (Equal()(*existing, value)) {
+                return existing;
+            } else {
+                ++it;
+            }
+        }
+
+        // Released values are only removed when their hash is looked up,
+        // so occasionally remove everything that has been released.
+        if (mTable.size() >= mPurgeSize) {
+            for (auto it = mTable.begin();  it != mTable.end();  ) {
+                if (it->second.expired()) {
+                    it = mTable.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            mPurgeSize = std::max(size_t(1024), 2 * mTable.size());
+        }
+
+        // Not make_shared(), which would keep the memory until purged
+        std::shared_ptr<const T> v(new T(std::move(value)));
+        mTable.insert({hash, v});
+        return v;
+    }
+
+private:
+    // Note that a released value cannot remove itself (e.g. with a custom
+    // deleter), since that may happen while intern() holds the lock.
+    std::mutex mLock;
+    std::unordered_multimap<std::size_t, std::weak_ptr<const T>> mTable;
+    size_t mPurgeSize = 1024;
+};
+
 extern const Font kDefaultReplacementFont;
 extern const Color kDefaultReplacementColor;
 bool isFamilyDefault(const Font& f);
 bool isPointSizeDefault(const Font& f);
 Font fontSizedForSuperSubscript(const Font& f);
 
+inline void hashGradientStop(std::size_t& seed, const Gradient::Stop& stop)
+{
+    hash_combine(seed, stop.color.hash());
+    hash_combine(seed, stop.location);
+}
+
 struct GradientInfo
 {
     DrawContext* context = nullptr;
@@ -113,8 +172,7 @@ struct GradientInfo
         size_t seed = 0;
         hash_combine(seed, context);
         for (auto &s : stops) {
-            hash_combine(seed, s.color.hash());
-            hash_combine(seed, s.location);
+            hashGradientStop(seed, s);
         }
         return seed;
     }
@@ -172,6 +230,46 @@ struct BezierPath::Impl
     };
 
     std::vector<Command> commands;
+
+    // Geometry derived from the commands. This is computed on demand and
+    // must be invalidated whenever the commands change.
+    struct Cache
+    {
+        bool boundsValid = false;
+        bool controlBoundsValid = false;
+        Rect bounds;
+        Rect controlBounds;
+        float flattenTolerance = -1.0f;  // < 0 means flattened is invalid
+        std::vector<std::vector<Point>> flattened;
+        // contains() has its own, so that it does not compete with flatten()
+        bool hitTestValid = false;
+        std::vector<std::vector<Point>> hitTestPolygons;
+        bool hashValid = false;
+        size_t hash = 0;
+    };
+    mutable Cache cache;
+
+    void invalidateCache()
+    {
+        cache.boundsValid = false;
+        cache.controlBoundsValid = false;
+        cache.hashValid = false;
+        if (cache.flattenTolerance >= 0.0f) {
+            cache.flattenTolerance = -1.0f;
+            cache.flattened.clear();
+        }
+        if (cache.hitTestValid) {
+            cache.hitTestValid = false;
+            cache.hitTestPolygons.clear();
+        }
+    }
+
+    Rect calcBounds() const;
+    Rect calcControlBounds() const;
+    size_t calcHash() const;
+    std::vector<std::vector<Point>> calcFlattened(float tolerance) const;
+    const std::vector<std::vector<Point>>& flattened(float tolerance) const;
+    const std::vector<std::vector<Point>>& hitTestPolygons() const;
 };
 
 std::vector<float> createWavyLinePoints(float x0, float y0, float x1,
@@ -212,6 +310,16 @@ void unpremultiplyRGBA(uint8_t *rgba, int width, int height);
 
 #define kDefaultImageDPI 96.0f
 
+// Blurs 8-bit pixel data in place with three box blurs, which approximates
+// a Gaussian blur with standard deviation radiusPx / 2. Each pixel has
+// nChannels interleaved channels, which are blurred independently. Pixels
+// beyond the edges are treated as copies of the edge pixels. Large images
+// are split across threads.
+void blurPixels(uint8_t *pixels, int width, int height, int stride,
+                int nChannels, float radiusPx);
+// Returns how many pixels blurPixels() spreads content in each direction
+int blurExtentPx(float radiusPx);
+
 std::vector<uint8_t> readFile(const char *path);
 
 // Requires libpng, giflib, and libjpeg-turbo (libjpeg also works but is slower)
@@ -145,6 +145,8 @@ public:
 
     Id id() const override { return mId; }
 
+    const std::vector<Stop>& stops() const override { return mInfo.stops; }
+
     bool ownedByContext(DrawContext *dc) { return mInfo.context == dc; }
 
 private:
@@ -1783,6 +1785,9 @@ public:
 
     void drawText(const TextLayout& layout, const Point& topLeft) override
     {
+        if (drawCompositeText(layout, topLeft)) {
+            return;
+        }
         ((TextObj*)&layout)->draw(*this, topLeft, kPaintFill);
     }
 
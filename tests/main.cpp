@@ -30,6 +30,7 @@
 
 #include <array>
 #include <cstdlib>  // getenv()
+#include <functional>
 #include <iostream>
 #include <map>
 #include <memory>
@@ -1122,6 +1123,127 @@ public:
     }
 };
 
+class LayerTest : public BitmapTest
+{
+public:
+    LayerTest() : BitmapTest("layers", 12, 12) {}
+
+    std::string run() override
+    {
+        auto dpi = mBitmap->dpi();
+        Color fg = Color::kBlack;
+
+        // Overlapping shapes in a translucent layer should not show through
+        // each other, and the layer is clipped to its bounds.
+        mBitmap->beginDraw();
+        mBitmap->fill(mBGColor);
+        mBitmap->setFillColor(fg);
+        mBitmap->beginLayer(Rect::fromPixels(1, 1, 9, 9, dpi), 0.5f);
+        mBitmap->drawRect(Rect::fromPixels(0, 0, 6, 6, dpi), kPaintFill);
+        mBitmap->drawRect(Rect::fromPixels(3, 3, 8, 8, dpi), kPaintFill);
+        mBitmap->endLayer();
+        mBitmap->endDraw();
+
+        auto single = mBitmap->pixelAt(2, 2);
+        struct { int x; int y; Color expected; const char *msg; } checks[] = {
+            { 0, 0, mBGColor, "drew outside layer bounds" },
+            { 10, 10, mBGColor, "drew outside layer bounds" },
+            { 4, 4, single, "overlapping shapes in layer are not uniform" },
+            { 8, 8, single, "overlapping shapes in layer are not uniform" } };
+        for (auto &c : checks) {
+            auto pixel = mBitmap->pixelAt(c.x, c.y);
+            if (pixel.toRGBA() != c.expected.toRGBA()) {
+                return createPixelError(c.msg, c.x, c.y, c.expected, pixel);
+            }
+        }
+
+        // Retained layers keep their contents until invalidated
+        Color layerColor(1.0f, 0.0f, 0.0f, 1.0f);
+        auto layer = mBitmap->createLayer(Size(PicaPt::fromPixels(4, dpi),
+                                               PicaPt::fromPixels(4, dpi)));
+        if (!layer->needsRedraw()) {
+            return "new layer does not need redraw";
+        }
+        auto &ldc = layer->beginDraw();
+        ldc.setFillColor(layerColor);
+        ldc.drawRect(Rect::fromPixels(0, 0, 4, 4, dpi), kPaintFill);
+        layer->endDraw();
+        if (layer->needsRedraw()) {
+            return "layer needs redraw after drawing";
+        }
+
+        mBitmap->beginDraw();
+        mBitmap->fill(mBGColor);
+        mBitmap->drawLayer(layer, Point::fromPixels(1, 1, dpi));
+        mBitmap->drawLayer(layer, Point::fromPixels(6, 6, dpi));
+        mBitmap->endDraw();
+
+        auto err = verifyRect("bad layer pixel", 1, 1, 4, 4, layerColor);
+        if (err.empty()) {
+            err = verifyRect("bad layer pixel", 6, 6, 4, 4, layerColor);
+        }
+        if (err.empty()) {
+            err = verifyRect("bad background pixel", 0, 5, 12, 1, mBGColor);
+        }
+        if (err.empty()) {
+            layer->invalidate();
+            if (!layer->needsRedraw()) {
+                err = "invalidated layer does not need redraw";
+            }
+        }
+        return err;
+    }
+};
+
+class ShadowTest : public BitmapTest
+{
+public:
+    ShadowTest() : BitmapTest("shadow", 30, 30) {}
+
+    std::string run() override
+    {
+        auto dpi = mBitmap->dpi();
+        auto path = mBitmap->createBezierPath();
+        path->addRect(Rect::fromPixels(10, 10, 10, 10, dpi));
+        auto offset = Size(PicaPt::fromPixels(2, dpi), PicaPt::fromPixels(2, dpi));
+        auto radius = PicaPt::fromPixels(4, dpi);
+
+        // Draw twice, since the second time may use a cached mask
+        Color edge;
+        for (int i = 0;  i < 2;  ++i) {
+            mBitmap->beginDraw();
+            mBitmap->fill(mBGColor);
+            mBitmap->drawShadow(path, offset, radius, Color::kBlack);
+            mBitmap->endDraw();
+
+            auto pixel = mBitmap->pixelAt(0, 0);
+            if (pixel.toRGBA() != mBGColor.toRGBA()) {
+                return createPixelError("shadow drawn too far away", 0, 0, mBGColor, pixel);
+            }
+            pixel = mBitmap->pixelAt(27, 17);
+            if (pixel.toRGBA() != mBGColor.toRGBA()) {
+                return createPixelError("shadow drawn too far away", 27, 17, mBGColor, pixel);
+            }
+            pixel = mBitmap->pixelAt(17, 17);
+            if (pixel.red() > 0.1f) {
+                return createPixelError("shadow center should be nearly opaque", 17, 17,
+                                        Color::kBlack, pixel);
+            }
+            pixel = mBitmap->pixelAt(12, 17);
+            if (pixel.red() < 0.3f || pixel.red() > 0.7f) {
+                return createPixelError("shadow edge should be blurred", 12, 17,
+                                        Color(0.5f, 0.5f, 0.5f), pixel);
+            }
+            if (i == 0) {
+                edge = pixel;
+            } else if (pixel.toRGBA() != edge.toRGBA()) {
+                return createPixelError("shadow changed when redrawn", 12, 17, edge, pixel);
+            }
+        }
+        return "";
+    }
+};
+
 class RoundedRectTest : public BitmapTest
 {
 public:
@@ -1251,6 +1373,54 @@ public:
     }
 };
 
+class NestedClipRectTest : public BitmapTest
+{
+public:
+    NestedClipRectTest() : BitmapTest("clip rect (nested)", 15, 15) {}
+
+    std::string run() override
+    {
+        Color fg(1.0f, 0.0f, 1.0f, 1.0f);
+        auto dpi = mBitmap->dpi();
+        auto r = Rect::fromPixels(0, 0, mWidth, mHeight, dpi);
+        // Paths (unlike pixel-aligned rects) are drawn by the platform, which
+        // needs to honor the clip, too.
+        auto rectPath = [this](const Rect& rect) {
+            auto path = mBitmap->createBezierPath();
+            path->addRect(rect);
+            return path;
+        };
+
+        mBitmap->beginDraw();
+        mBitmap->fill(mBGColor);
+        mBitmap->setFillColor(fg);
+        mBitmap->save();
+        mBitmap->clipToRect(Rect::fromPixels(2, 2, 10, 10, dpi));
+        mBitmap->save();
+        mBitmap->translate(PicaPt::fromPixels(1, dpi), PicaPt::fromPixels(1, dpi));
+        mBitmap->clipToRect(Rect::fromPixels(3, 3, 10, 10, dpi));  // (4, 4) - (14, 14)
+        mBitmap->drawPath(rectPath(r), kPaintFill);
+        mBitmap->restore();
+        mBitmap->drawPath(rectPath(Rect::fromPixels(0, 0, 3, 3, dpi)), kPaintFill);  // (2, 2) only
+        mBitmap->restore();
+        mBitmap->drawPath(rectPath(Rect::fromPixels(0, 14, 1, 1, dpi)), kPaintFill);
+        mBitmap->endDraw();
+
+        for (int y = 0;  y < mHeight;  ++y) {
+            for (int x = 0;  x < mWidth;  ++x) {
+                bool inInner = (x >= 4 && x < 12 && y >= 4 && y < 12);
+                bool isFG = (inInner || (x == 2 && y == 2) || (x == 0 && y == 14));
+                auto expected = (isFG ? fg : mBGColor);
+                auto pixel = mBitmap->pixelAt(x, y);
+                if (pixel.toRGBA() != expected.toRGBA()) {
+                    return createPixelError("wrong pixel", x, y, expected, pixel);
+                }
+            }
+        }
+        return "";
+    }
+};
+
 class ClipPathTest : public BitmapTest
 {
 public:
@@ -1276,6 +1446,303 @@ public:
     }
 };
 
+class BezierPathGeometryTest : public BitmapTest
+{
+public:
+    BezierPathGeometryTest() : BitmapTest("bezier bounds/contains/flatten", 1, 1) {}
+
+    std::string run() override
+    {
+        auto fuzzyEqual = [](const PicaPt& a, float b) { return (std::abs(a.asFloat() - b) < 0.01f); };
+
+        // The control points of a circle are outside the circle, but the
+        // curve itself touches the bounding rect.
+        auto circle = mBitmap->createBezierPath();
+        circle->addCircle(Point(PicaPt(20.0f), PicaPt(30.0f)), PicaPt(10.0f));
+        auto bounds = circle->bounds();
+        if (!fuzzyEqual(bounds.x, 10.0f) || !fuzzyEqual(bounds.y, 20.0f) ||
+            !fuzzyEqual(bounds.width, 20.0f) || !fuzzyEqual(bounds.height, 20.0f)) {
+            return "circle: incorrect bounds()";
+        }
+        auto cbounds = circle->controlBounds();
+        if (cbounds.x > bounds.x || cbounds.y > bounds.y ||
+            cbounds.maxX() < bounds.maxX() || cbounds.maxY() < bounds.maxY()) {
+            return "circle: controlBounds() does not contain bounds()";
+        }
+        if (!circle->contains(Point(PicaPt(20.0f), PicaPt(30.0f)))) {
+            return "circle: center not contained";
+        }
+        if (!circle->contains(Point(PicaPt(29.5f), PicaPt(30.0f)))) {
+            return "circle: point near edge not contained";
+        }
+        if (circle->contains(Point(PicaPt(11.0f), PicaPt(21.0f)))) {
+            return "circle: point in corner of bounds is contained";
+        }
+
+        auto polys = circle->flatten(PicaPt(0.01f));
+        if (polys.size() != 1) {
+            return createFloatError("circle: wrong number of flattened subpaths", 1.0f, float(polys.size()));
+        }
+        if (polys[0].front() != polys[0].back()) {
+            return "circle: closed subpath does not end at its start";
+        }
+        for (auto &p : polys[0]) {
+            auto dx = p.x.asFloat() - 20.0f;
+            auto dy = p.y.asFloat() - 30.0f;
+            auto err = std::abs(std::sqrt(dx * dx + dy * dy) - 10.0f);
+            if (err > 0.03f) {  // 0.01 pt plus the approximation of a circle by beziers
+                return createFloatError("circle: flattened point too far from curve", 0.0f, err, "pt");
+            }
+        }
+
+        // Nested rects in the same direction: the winding rule includes the
+        // inner rect, even-odd does not.
+        auto rects = mBitmap->createBezierPath();
+        rects->addRect(Rect(PicaPt(0.0f), PicaPt(0.0f), PicaPt(10.0f), PicaPt(10.0f)));
+        rects->addRect(Rect(PicaPt(2.0f), PicaPt(2.0f), PicaPt(6.0f), PicaPt(6.0f)));
+        if (!rects->contains(Point(PicaPt(5.0f), PicaPt(5.0f)), kFillWinding)) {
+            return "nested rects: winding rule does not contain center";
+        }
+        if (rects->contains(Point(PicaPt(5.0f), PicaPt(5.0f)), kFillEvenOdd)) {
+            return "nested rects: even-odd rule contains center";
+        }
+        if (!rects->contains(Point(PicaPt(1.0f), PicaPt(5.0f)), kFillEvenOdd)) {
+            return "nested rects: even-odd rule does not contain outer band";
+        }
+
+        // Cached values must be invalidated when the path changes
+        rects->moveTo(Point(PicaPt(20.0f), PicaPt(20.0f)));
+        rects->lineTo(Point(PicaPt(30.0f), PicaPt(20.0f)));
+        rects->lineTo(Point(PicaPt(30.0f), PicaPt(30.0f)));
+        if (!fuzzyEqual(rects->bounds().maxX(), 30.0f)) {
+            return createFloatError("modified path: wrong bounds().maxX()", 30.0f, rects->bounds().maxX().asFloat());
+        }
+        if (!rects->contains(Point(PicaPt(28.0f), PicaPt(22.0f)))) {
+            return "modified path: open subpath is not implicitly closed";
+        }
+
+        return "";
+    }
+};
+
+class CullingTest : public BitmapTest
+{
+public:
+    CullingTest() : BitmapTest("culling", 20, 20) {}
+
+    std::string run() override
+    {
+        Color fg(1.0f, 0.0f, 1.0f, 1.0f);
+        auto dpi = mBitmap->dpi();
+
+        mBitmap->beginDraw();
+        mBitmap->fill(mBGColor);
+        mBitmap->setFillColor(fg);
+        mBitmap->setStrokeColor(fg);
+        mBitmap->save();
+        mBitmap->clipToRect(Rect::fromPixels(5, 5, 10, 10, dpi));
+        mBitmap->drawRect(Rect::fromPixels(16, 5, 3, 3, dpi), kPaintFill);  // culled
+        mBitmap->drawRect(Rect::fromPixels(0, 0, 6, 6, dpi), kPaintFill);  // overlaps clip
+        mBitmap->translate(PicaPt::fromPixels(100, dpi), PicaPt::kZero);
+        mBitmap->drawRect(Rect::fromPixels(0, 0, 5, 5, dpi), kPaintFill);  // culled
+        mBitmap->restore();
+        // The rect is outside, but the stroke is not
+        mBitmap->setStrokeWidth(PicaPt::fromPixels(4, dpi));
+        mBitmap->drawRect(Rect::fromPixels(-3, -3, 2, 2, dpi), kPaintStroke);
+        mBitmap->drawRect(Rect::fromPixels(100, 100, 5, 5, dpi), kPaintStroke);  // culled
+        mBitmap->endDraw();
+
+        // Backends are not required to cull, but if they do, they must
+        // cull the right things.
+        int nCulled = mBitmap->culledDrawCount();
+        if (nCulled != 0 && nCulled != 3) {
+            return createFloatError("wrong number of culled draws", 3.0f, float(nCulled));
+        }
+
+        struct { int x; int y; Color expected; const char *msg; } checks[] = {
+            { 16, 5, mBGColor, "drew outside clip" },
+            { 4, 4, mBGColor, "drew outside clip" },
+            { 5, 5, fg, "partially visible rect was not drawn" },
+            { 0, 0, fg, "stroke outside of rect was not drawn" },
+            { 19, 19, mBGColor, "drew off-screen rect" } };
+        for (auto &c : checks) {
+            auto pixel = mBitmap->pixelAt(c.x, c.y);
+            if (pixel.toRGBA() != c.expected.toRGBA()) {
+                return createPixelError(c.msg, c.x, c.y, c.expected, pixel);
+            }
+        }
+        return "";
+    }
+};
+
+class DirtyRegionTest : public BitmapTest
+{
+public:
+    DirtyRegionTest() : BitmapTest("dirty region", 20, 20) {}
+
+    std::string run() override
+    {
+        Color old(1.0f, 0.0f, 0.0f, 1.0f);
+        Color fg(0.0f, 0.0f, 1.0f, 1.0f);
+        auto dpi = mBitmap->dpi();
+
+        mBitmap->beginDraw();
+        mBitmap->fill(old);
+        mBitmap->endDraw();
+
+        // Overlapping rects, plus a separate one. These are on whole pixels,
+        // since partial pixels are rounded out to whole ones.
+        mBitmap->invalidate(Rect::fromPixels(2, 2, 4, 4, dpi));
+        mBitmap->invalidate(Rect::fromPixels(4, 4, 4, 4, dpi));
+        mBitmap->invalidate(Rect::fromPixels(12, 12, 2, 3, dpi));
+        auto dirty = mBitmap->dirtyRegion();
+
+        mBitmap->beginDraw(dirty);
+        mBitmap->fill(fg);
+        mBitmap->endDraw();
+
+        // After endDraw() the dirty clip must be gone
+        mBitmap->beginDraw();
+        mBitmap->setFillColor(fg);
+        mBitmap->drawRect(Rect::fromPixels(19, 0, 1, 1, dpi), kPaintFill);
+        mBitmap->endDraw();
+
+        auto isInDirty = [dirty, dpi](int x, int y) {
+            auto p = Point::fromPixels(float(x) + 0.5f, float(y) + 0.5f, dpi);
+            for (auto &r : dirty) {
+                if (r.contains(p)) {
+                    return true;
+                }
+            }
+            return false;
+        };
+        for (int y = 0;  y < mHeight;  ++y) {
+            for (int x = 0;  x < mWidth;  ++x) {
+                bool isInvalidated = ((x >= 2 && x < 6 && y >= 2 && y < 6) ||
+                                      (x >= 4 && x < 8 && y >= 4 && y < 8) ||
+                                      (x >= 12 && x < 14 && y >= 12 && y < 15));
+                if (isInvalidated && !isInDirty(x, y)) {
+                    return createPixelError("invalidated pixel not in dirtyRegion()", x, y, fg, old);
+                }
+                // Contexts are allowed to redraw more than necessary, but
+                // everything redrawn must be in the dirty region.
+                Color expected = (isInDirty(x, y) || (x == 19 && y == 0)) ? fg : old;
+                auto pixel = mBitmap->pixelAt(x, y);
+                if (pixel.toRGBA() != expected.toRGBA()) {
+                    return createPixelError("bad pixel", x, y, expected, pixel);
+                }
+            }
+        }
+        return "";
+    }
+};
+
+#if USING_X11
+class X11DoubleBufferedTest : public BitmapTest
+{
+public:
+    // The bitmap is unused; we only need the dpi
+    X11DoubleBufferedTest() : BitmapTest("X11 double-buffered window", 1, 1) {}
+
+    std::string run() override
+    {
+        const int width = 20, height = 20;
+        const unsigned int red = 0xff0000, blue = 0x0000ff;
+        auto dpi = mBitmap->dpi();
+        auto window = X11CreateWindow(width, height);
+        auto dc = DrawContext::fromX11DoubleBuffered(X11GetDisplay(), &window,
+                                                     width, height, dpi);
+        std::string err;
+
+        dc->beginDraw();
+        dc->fill(Color(1.0f, 0.0f, 0.0f));
+        if (X11GetPixel(window, 5, 5) == red) {
+            err = "window was drawn before endDraw()";
+        }
+        dc->endDraw();
+        if (err.empty() && X11GetPixel(window, 5, 5) != red) {
+            err = "window not updated by endDraw()";
+        }
+
+        if (err.empty()) {
+            dc->invalidate(Rect::fromPixels(2, 2, 4, 4, dpi));
+            dc->beginDraw(dc->dirtyRegion());
+            dc->fill(Color(0.0f, 0.0f, 1.0f));
+            dc->endDraw();
+            if (X11GetPixel(window, 3, 3) != blue) {
+                err = "dirty rect was not presented";
+            } else if (X11GetPixel(window, 10, 10) != red) {
+                err = "pixel outside of dirty rect changed";
+            }
+        }
+
+        dc.reset();
+        X11DestroyWindow(window);
+        return err;
+    }
+};
+
+class CPURectFillTest : public BitmapTest
+{
+public:
+    // The bitmap is unused, since the X11 bitmaps are not CPU bitmaps
+    CPURectFillTest() : BitmapTest("CPU bitmap pixel-aligned rects", 1, 1) {}
+
+    std::string run() override
+    {
+        const int width = 20, height = 20;
+        auto dpi = mBitmap->dpi();
+        auto window = X11CreateWindow(4, 4);
+        auto dc = DrawContext::fromX11DoubleBuffered(X11GetDisplay(), &window,
+                                                     4, 4, dpi);
+        // Bitmaps from a double-buffered context are on the CPU, so opaque
+        // pixel-aligned rects skip Cairo's rasterizer. The results need
+        // to be identical.
+        auto bitmap = dc->createBitmap(kBitmapRGBA, width, height, dpi);
+        Color fg(0.2f, 0.4f, 0.6f, 1.0f);
+        bitmap->beginDraw();
+        bitmap->fill(mBGColor);
+        bitmap->setFillColor(fg);
+        bitmap->save();
+        bitmap->translate(PicaPt::fromPixels(2, dpi), PicaPt::fromPixels(3, dpi));
+        bitmap->clipToRect(Rect::fromPixels(0, 0, 10, 10, dpi));
+        bitmap->drawRect(Rect::fromPixels(-5, -5, 8, 30, dpi), kPaintFill);
+        bitmap->restore();
+        // Not aligned, so uses Cairo
+        bitmap->drawRect(Rect::fromPixels(14.5f, 2, 3, 3, dpi), kPaintFill);
+        bitmap->endDraw();
+
+        std::string err;
+        for (int y = 0;  y < height && err.empty();  ++y) {
+            for (int x = 0;  x < width;  ++x) {
+                if (x >= 14 && x <= 17 && y >= 2 && y < 5) {
+                    continue;  // Cairo's rect, check separately
+                }
+                bool isFG = (x >= 2 && x < 5 && y >= 3 && y < 13);
+                Color expected = (isFG ? fg : mBGColor);
+                auto pixel = bitmap->pixelAt(x, y);
+                if (pixel.toRGBA() != expected.toRGBA()) {
+                    err = createPixelError("bad pixel", x, y, expected, pixel);
+                    break;
+                }
+            }
+        }
+        if (err.empty()) {
+            auto fast = bitmap->pixelAt(3, 5);
+            auto cairo = bitmap->pixelAt(15, 3);
+            if (fast.toRGBA() != cairo.toRGBA()) {
+                err = createColorError("fast path color differs from Cairo's", cairo, fast);
+            }
+        }
+
+        bitmap.reset();
+        dc.reset();
+        X11DestroyWindow(window);
+        return err;
+    }
+};
+#endif // USING_X11
+
 class SaveRestoreTest : public BitmapTest
 {
 public:
@@ -1362,6 +1829,95 @@ public:
     }
 };
 
+// SaveRestoreTest changes clips and dashes, which need Cairo's state to be
+// saved; this checks the state that is restored without it.
+class SaveRestoreTransformStrokeTest : public BitmapTest
+{
+public:
+    SaveRestoreTransformStrokeTest() : BitmapTest("save/restore (transform, stroke)", 13, 13) {}
+
+    std::string run() override
+    {
+        auto dpi = mBitmap->dpi();
+        Color fg = Color::kBlack;
+        mBitmap->beginDraw();
+        mBitmap->fill(mBGColor);
+        mBitmap->setStrokeColor(fg);
+        mBitmap->setStrokeWidth(PicaPt::fromPixels(2, dpi));
+        mBitmap->setStrokeEndCap(kEndCapButt);
+
+        mBitmap->save();
+        mBitmap->translate(PicaPt::fromPixels(3, dpi), PicaPt::fromPixels(3, dpi));
+        mBitmap->setStrokeWidth(PicaPt::fromPixels(4, dpi));
+        mBitmap->setStrokeEndCap(kEndCapSquare);
+        mBitmap->save();
+        mBitmap->rotate(45.0f);
+        mBitmap->setStrokeWidth(PicaPt::fromPixels(1, dpi));
+        mBitmap->setStrokeJoinStyle(kJoinRound);
+        // The clip changes Cairo's state after the stroke has changed
+        auto path = mBitmap->createBezierPath();
+        path->addRect(Rect::fromPixels(-20, -20, 40, 40, dpi));
+        mBitmap->clipToPath(path);
+        mBitmap->restore();
+        mBitmap->restore();
+
+        mBitmap->drawLines({ Point::fromPixels(2, 6, dpi), Point::fromPixels(11, 6, dpi) });
+        mBitmap->endDraw();
+
+        auto err = verifyFillRect(2, 5, 9, 2, mBGColor, fg);
+        if (err.empty() && mBitmap->strokeJoinStyle() != kJoinMiter) {
+            err = "strokeJoinStyle() was not restored";
+        }
+        return err;
+    }
+};
+
+class StateChangeTest : public BitmapTest
+{
+public:
+    StateChangeTest() : BitmapTest("redundant state changes", 15, 10) {}
+
+    std::string run() override
+    {
+        Color fg1(1.0f, 0.0f, 1.0f, 1.0f);
+        Color fg2(0.0f, 0.0f, 1.0f, 1.0f);
+        auto dpi = mBitmap->dpi();
+
+        mBitmap->beginDraw();
+        mBitmap->fill(mBGColor);
+        mBitmap->setStrokeColor(fg1);
+        mBitmap->setStrokeWidth(PicaPt::fromPixels(2, dpi));
+        mBitmap->drawLines({ Point::fromPixels(1, 2, dpi), Point::fromPixels(14, 2, dpi) });
+        // Nothing changes
+        mBitmap->setStrokeWidth(PicaPt::fromPixels(2, dpi));
+        mBitmap->drawLines({ Point::fromPixels(1, 5, dpi), Point::fromPixels(14, 5, dpi) });
+        // Only the color changes
+        mBitmap->setStrokeColor(fg2);
+        mBitmap->drawLines({ Point::fromPixels(1, 8, dpi), Point::fromPixels(14, 8, dpi) });
+        mBitmap->endDraw();
+
+        // Backends are not required to track this, but if they do, the
+        // second line needs no changes (color, width, cap, join, dashes)
+        // and the third only needs the color.
+        int nAvoided = mBitmap->avoidedStateChangeCount();
+        if (nAvoided != 0 && nAvoided != 9) {
+            return createFloatError("wrong number of avoided state changes", 9.0f, float(nAvoided));
+        }
+
+        auto err = verifyRect("bad first line pixel", 1, 1, 13, 2, fg1);
+        if (err.empty()) {
+            err = verifyRect("bad second line pixel", 1, 4, 13, 2, fg1);
+        }
+        if (err.empty()) {
+            err = verifyRect("bad third line pixel", 1, 7, 13, 2, fg2);
+        }
+        if (err.empty()) {
+            err = verifyRect("bad background pixel", 1, 3, 13, 1, mBGColor);
+        }
+        return err;
+    }
+};
+
 class GettersTest : public BitmapTest
 {
 public:
@@ -2002,6 +2558,27 @@ public:
             return "getGradient(stops) should always return the same object if the stops are the same";
         }
 
+        auto builder = GradientBuilder().addStop(Color::kBlack, 0.0f)
+                                        .addStop(Color::kRed, 1.0f);
+        if (dc->getGradient(builder).id() != gradientStop.id()) {
+            return "getGradient(GradientBuilder) should return the same object as getGradient(stops)";
+        }
+        if (dc->getGradient(builder).id() != gradientStop.id()) {
+            return "getGradient(GradientBuilder) should return the same object when cached";
+        }
+
+        std::vector<Gradient::Stop> manyStops;
+        for (int i = 0;  i <= 2 * GradientBuilder::kMaxInlineStops;  ++i) {
+            manyStops.push_back({ Color(i * 20, 0, 0), float(i) / float(2 * GradientBuilder::kMaxInlineStops) });
+        }
+        GradientBuilder manyBuilder(manyStops);
+        if (manyBuilder.size() != manyStops.size() || manyBuilder[manyStops.size() - 1].location != 1.0f) {
+            return "GradientBuilder has incorrect stops when there are more than kMaxInlineStops";
+        }
+        if (dc->getGradient(manyBuilder).id() != dc->getGradient(manyStops).id()) {
+            return "getGradient(GradientBuilder) with many stops does not return the same gradient as getGradient(stops)";
+        }
+
         auto &bad = dc->getGradient(0);
         if (bad.id() != 0) {
             return "getGradient(0) should return a bad gradient with id() = 0";
@@ -2048,6 +2625,217 @@ public:
     }
 };
 
+class GradientLookupTableTest : public GradientTest
+{
+public:
+    GradientLookupTableTest() : GradientTest("gradients (lookup table)", 33, 33) {}
+
+    std::string run() override
+    {
+        auto dpi = mBitmap->dpi();
+        auto rectAll = Rect::fromPixels(0, 0, mBitmap->width(), mBitmap->height(), dpi);
+
+        mBitmap->setGradientMode(kGradientLookupTable);
+
+        // black -> red, left to right
+        std::vector<Gradient::Stop> stops = { { Color::kBlack, 0.0f }, { Color::kRed, 1.0f } };
+        mBitmap->beginDraw();
+        mBitmap->fill(Color::kBlue);
+        auto path = mBitmap->createBezierPath();
+        path->addRect(rectAll);
+        Point end(PicaPt::fromPixels(mBitmap->width(), dpi), PicaPt::kZero);
+        mBitmap->drawLinearGradientPath(path, mBitmap->getGradient(stops), Point::kZero, end);
+        mBitmap->endDraw();
+
+        auto err = verifyHorizGradient(stops[0].color, stops[1].color,
+                                       0, 0, mBitmap->width(), mBitmap->height());
+        if (!err.empty()) {
+            return "left-to-right: " + err;
+        }
+
+        // Multiple stops, rotated, and radial gradients should look the same
+        // as the native ones.
+        std::vector<Gradient::Stop> multiStops = { { Color::kBlue, 0.0f },
+                                                   { Color::kGreen, 0.25f },
+                                                   { Color::kYellow, 0.75f },
+                                                   { Color::kRed, 1.0f } };
+        auto draw = [rectAll, &multiStops, dpi](DrawContext& dc) {
+            auto inset = PicaPt::fromPixels(3, dpi);
+            auto &gradient = dc.getGradient(multiStops);
+            dc.beginDraw();
+            dc.fill(Color::kWhite);
+            dc.save();
+            dc.translate(rectAll.midX(), rectAll.midY());
+            dc.rotate(30.0f);
+            dc.translate(-rectAll.midX(), -rectAll.midY());
+            auto path = dc.createBezierPath();
+            path->addRect(Rect(rectAll.x, rectAll.y, rectAll.width, 0.5f * rectAll.height));
+            dc.drawLinearGradientPath(path, gradient,
+                                      Point(rectAll.x + inset, rectAll.y),
+                                      Point(rectAll.maxX() - inset, rectAll.y));
+            dc.restore();
+            path = dc.createBezierPath();
+            path->addEllipse(Rect(rectAll.x + inset, rectAll.midY(),
+                                  rectAll.width - 2.0f * inset, 0.5f * rectAll.height));
+            dc.drawRadialGradientPath(path, gradient,
+                                      Point(rectAll.midX(), 0.75f * rectAll.height),
+                                      PicaPt::fromPixels(2, dpi),
+                                      0.5f * rectAll.width - inset);
+            dc.endDraw();
+        };
+        // Inside a layer the gradient is drawn into the layer's surface,
+        // which is offset from the bitmap's.
+        auto drawInLayer = [rectAll, &multiStops, dpi](DrawContext& dc) {
+            dc.beginDraw();
+            dc.fill(Color::kWhite);
+            dc.beginLayer(Rect::fromPixels(8, 8, 17, 17, dpi));
+            auto path = dc.createBezierPath();
+            path->addRect(rectAll);
+            dc.drawLinearGradientPath(path, dc.getGradient(multiStops),
+                                      Point::kZero, Point(rectAll.maxX(), PicaPt::kZero));
+            dc.endLayer();
+            dc.endDraw();
+        };
+
+        auto native = createBitmap(kBitmapRGBA, mBitmap->width(), mBitmap->height(), dpi);
+        native->setGradientMode(kGradientNative);
+        float maxErr = acceptableError();
+        struct { const char *msg; std::function<void(DrawContext&)> drawFunc; } cases[] = {
+            { "lookup table gradient differs from native", draw },
+            { "lookup table gradient in layer differs from native", drawInLayer } };
+        for (auto &c : cases) {
+            c.drawFunc(*native);
+            c.drawFunc(*mBitmap);
+            for (int y = 0;  y < mBitmap->height();  ++y) {
+                for (int x = 0;  x < mBitmap->width();  ++x) {
+                    auto expected = native->pixelAt(x, y);
+                    auto pixel = mBitmap->pixelAt(x, y);
+                    if (std::abs(pixel.red() - expected.red()) > maxErr ||
+                        std::abs(pixel.green() - expected.green()) > maxErr ||
+                        std::abs(pixel.blue() - expected.blue()) > maxErr ||
+                        std::abs(pixel.alpha() - expected.alpha()) > maxErr) {
+                        return createPixelError(c.msg, x, y, expected, pixel);
+                    }
+                }
+            }
+        }
+        return "";
+    }
+};
+
+class ConicGradientTest : public GradientTest
+{
+public:
+    ConicGradientTest() : GradientTest("conic gradient", 33, 33) {}
+
+    std::string run() override
+    {
+        auto dpi = mBitmap->dpi();
+        auto rectAll = Rect::fromPixels(0, 0, mBitmap->width(), mBitmap->height(), dpi);
+
+        // Red -> blue -> red so that there is no discontinuity at the start
+        std::vector<Gradient::Stop> stops = { { Color::kRed, 0.0f },
+                                              { Color::kBlue, 0.5f },
+                                              { Color::kRed, 1.0f } };
+        // The stops do not need to be sorted
+        std::vector<Gradient::Stop> unsorted(stops.rbegin(), stops.rend());
+        const float kPi = 3.14159265358979323846f;
+        const float maxErr = 0.05f;  // allow for approximating with wedges
+        const int r = 10;
+
+        for (auto *stopList : { &stops, &unsorted }) {
+            auto &gradient = mBitmap->getGradient(*stopList);
+            for (auto mode : { kGradientNative, kGradientLookupTable }) {
+                std::string modeStr = (mode == kGradientNative ? "native: " : "lookup table: ");
+                if (stopList == &unsorted) {
+                    modeStr = "unsorted stops, " + modeStr;
+                }
+                mBitmap->setGradientMode(mode);
+                for (float startAngle : { 0.0f, 90.0f }) {
+                    mBitmap->beginDraw();
+                    mBitmap->fill(Color::kWhite);
+                    auto path = mBitmap->createBezierPath();
+                    path->addRect(rectAll);
+                    mBitmap->drawConicGradientPath(path, gradient, rectAll.center(), startAngle);
+                    mBitmap->endDraw();
+
+                    int cx = mBitmap->width() / 2, cy = mBitmap->height() / 2;
+                    for (int degrees = 0;  degrees < 360;  degrees += 45) {
+                        float rad = float(degrees) * kPi / 180.0f;
+                        int x = cx + int(std::round(float(r) * std::cos(rad)));
+                        int y = cy - int(std::round(float(r) * std::sin(rad)));
+                        // angle of the pixel center, counterclockwise on the screen
+                        float angle = std::atan2(-(float(y) - float(cy)), float(x) - float(cx));
+                        float t = (angle - startAngle * kPi / 180.0f) / (2.0f * kPi);
+                        t = t - std::floor(t);
+                        float blueAmount = 1.0f - std::abs(2.0f * t - 1.0f);
+                        Color expected = Color::kRed.blend(Color::kBlue, blueAmount);
+                        auto pixel = mBitmap->pixelAt(x, y);
+                        if (std::abs(pixel.red() - expected.red()) > maxErr ||
+                            std::abs(pixel.green() - expected.green()) > maxErr ||
+                            std::abs(pixel.blue() - expected.blue()) > maxErr) {
+                            std::stringstream msg;
+                            msg << modeStr << "start " << startAngle << " deg: incorrect color";
+                            return createPixelError(msg.str(), x, y, expected, pixel);
+                        }
+                    }
+                }
+            }
+        }
+        return "";
+    }
+};
+
+class MeshGradientTest : public GradientTest
+{
+public:
+    MeshGradientTest() : GradientTest("mesh gradient", 32, 32) {}
+
+    std::string run() override
+    {
+        auto dpi = mBitmap->dpi();
+        auto rectAll = Rect::fromPixels(0, 0, mBitmap->width(), mBitmap->height(), dpi);
+        const float maxErr = 0.05f;  // allow for approximating with quads
+
+        // The patch covers the left 3/4; the rest should be untouched
+        auto patchRect = Rect::fromPixels(0, 0, 24, mBitmap->height(), dpi);
+        GradientMeshPatch patch;
+        patch.corners[0] = patchRect.upperLeft();
+        patch.corners[1] = patchRect.upperRight();
+        patch.corners[2] = patchRect.lowerRight();
+        patch.corners[3] = patchRect.lowerLeft();
+        patch.colors[0] = Color::kRed;
+        patch.colors[1] = Color::kGreen;
+        patch.colors[2] = Color::kBlue;
+        patch.colors[3] = Color::kBlack;
+
+        mBitmap->beginDraw();
+        mBitmap->fill(Color::kWhite);
+        auto path = mBitmap->createBezierPath();
+        path->addRect(rectAll);
+        mBitmap->drawMeshGradientPath(path, { patch });
+        mBitmap->endDraw();
+
+        for (int y = 0;  y < mBitmap->height();  y += 3) {
+            for (int x = 0;  x < 24;  x += 3) {
+                float u = (float(x) + 0.5f) / 24.0f;
+                float v = (float(y) + 0.5f) / float(mBitmap->height());
+                auto top = patch.colors[0].blend(patch.colors[1], u);
+                auto bottom = patch.colors[3].blend(patch.colors[2], u);
+                auto expected = top.blend(bottom, v);
+                auto pixel = mBitmap->pixelAt(x, y);
+                if (std::abs(pixel.red() - expected.red()) > maxErr ||
+                    std::abs(pixel.green() - expected.green()) > maxErr ||
+                    std::abs(pixel.blue() - expected.blue()) > maxErr) {
+                    return createPixelError("incorrect mesh color", x, y, expected, pixel);
+                }
+            }
+        }
+        return verifyRect("area outside mesh should not be drawn", 25, 0, 7, mBitmap->height(),
+                          Color::kWhite);
+    }
+};
+
 class FontTest : public BitmapTest
 {
     static constexpr int kMargin = 1;
@@ -3217,6 +4005,74 @@ public:
             return "setTextRun() should truncate length to text length";
         }
 
+        std::string words;
+        for (int i = 0;  i < 100;  ++i) {
+            words += "word ";
+        }
+        t = Text(words, Font(), Color::kBlack);
+        for (int i = 99;  i >= 0;  i -= 3) {  // out of order, to move the gap
+            t.setBold(5 * i, 4);
+        }
+        auto copy = t;
+        for (int i = 0;  i < 100;  i += 2) {
+            t.setColor(Color::kRed, 5 * i + 1, 2);
+        }
+        int lastEnd = 0;
+        for (auto &r : t.runs()) {
+            int charIdx = r.startIndex;
+            bool isBold = (charIdx % 5 != 4 && (charIdx / 5) % 3 == 0);
+            bool isRed = ((charIdx / 5) % 2 == 0 && (charIdx % 5 == 1 || charIdx % 5 == 2));
+            if (r.startIndex != lastEnd) {
+                return "setTextRun() split runs incorrectly";
+            }
+            if (r.bold.isSet != isBold || r.color.value.toRGBA() != (isRed ? redRGBA : Color::kBlack.toRGBA())) {
+                return "setTextRun() split runs with the wrong attributes at index " + std::to_string(charIdx);
+            }
+            lastEnd = r.startIndex + r.length;
+        }
+        if (lastEnd != int(t.text().size())) {
+            return "setTextRun() runs do not cover the text";
+        }
+        for (auto &r : copy.runs()) {
+            if (r.color.value.toRGBA() != Color::kBlack.toRGBA()) {
+                return "changing the runs of a Text changed a copy";
+            }
+        }
+
+        // applyTextRuns() should be the same as setTextRun() for each
+        std::vector<TextRun> highlights;
+        for (int i = 0;  i < 100;  i += 3) {
+            TextRun r;
+            r.startIndex = 5 * i + 2;
+            r.length = (i % 2 == 0 ? 5 : 2);  // crosses into the next word
+            if (i % 2 == 0) {
+                r.italic = true;
+            } else {
+                r.backgroundColor = Color::kBlue;
+            }
+            highlights.push_back(r);
+        }
+        auto individually = t;
+        for (auto &r : highlights) {
+            individually.setTextRun(r);
+        }
+        t.applyTextRuns(highlights);
+        if (t.runs().size() != individually.runs().size()) {
+            return "applyTextRuns() has " + std::to_string(t.runs().size())
+                   + " runs, expected " + std::to_string(individually.runs().size());
+        }
+        for (size_t i = 0;  i < t.runs().size();  ++i) {
+            auto &r = t.runs()[i];
+            auto &expected = individually.runs()[i];
+            if (r.startIndex != expected.startIndex || r.length != expected.length
+                || r.bold.isSet != expected.bold.isSet
+                || r.italic.isSet != expected.italic.isSet
+                || r.color.value.toRGBA() != expected.color.value.toRGBA()
+                || r.backgroundColor.isSet != expected.backgroundColor.isSet) {
+                return "applyTextRuns() run " + std::to_string(i) + " is different than from setTextRun()";
+            }
+        }
+
         return "";
     }
 };
@@ -3912,6 +4768,442 @@ public:
     }
 };
 
+class RecolorTextTest : public BitmapTest
+{
+    static constexpr int kPointSize = 13;
+public:
+    RecolorTextTest() : BitmapTest("recolor text layout", kPointSize + 3, 2 * kPointSize) {}
+
+    std::string run() override
+    {
+        const auto dpi = mBitmap->dpi();
+        const Font font("Arial", PicaPt::fromPixels(kPointSize, dpi), kStyleBold);
+
+        Text t("O", font, Color::kRed);
+        t.setBackgroundColor(Color::kRed);
+        auto layout = mBitmap->createTextLayout(t);
+
+        // The string must be the same
+        if (layout->recolor(Text("Q", font, Color::kRed))) {
+            return "recolor() should fail if the text differs";
+        }
+
+        // The runs must cover the same parts of the string, with the same fonts
+        Text split("OOO", font, Color::kRed);
+        split.setColor(Color::kBlue, 0, 1);
+        auto splitLayout = mBitmap->createTextLayout(split);
+        Text moved("OOO", font, Color::kRed);
+        moved.setColor(Color::kBlue, 0, 2);
+        if (moved.runs().size() == split.runs().size() && splitLayout->recolor(moved)) {
+            return "recolor() should fail if the runs have different ranges";
+        }
+        Text refont("OOO", font, Color::kRed);
+        refont.setColor(Color::kBlue, 0, 1);
+        refont.setFont(font.fontWithPointSize(font.pointSize() * 2.0f), 0, 1);
+        if (refont.runs().size() == split.runs().size() && splitLayout->recolor(refont)) {
+            return "recolor() should fail if the runs have different fonts";
+        }
+
+        // Background and text share a color, so they need to be split apart
+        t.setBackgroundColor(Color::kBlue);
+        t.setColor(Color::kGreen);
+        auto maybeErr = verify(layout, t, Color::kBlue, Color::kGreen);
+        if (!maybeErr.empty()) {
+            return maybeErr;
+        }
+
+        // Same draw commands, only the colors change
+        t.setBackgroundColor(Color::kGreen);
+        t.setColor(Color::kBlue);
+        maybeErr = verify(layout, t, Color::kGreen, Color::kBlue);
+        if (!maybeErr.empty()) {
+            return maybeErr;
+        }
+
+        // Transparent background draws nothing
+        t.setBackgroundColor(Color::kTransparent);
+        maybeErr = verify(layout, t, Color::kBlack, Color::kBlue);
+        if (!maybeErr.empty()) {
+            return maybeErr;
+        }
+
+        return "";
+    }
+
+private:
+    std::string verify(std::shared_ptr<TextLayout> layout, const Text& t,
+                       const Color& bg, const Color& fg)
+    {
+        if (!layout->recolor(t)) {
+            // Not required to be supported, but the results must be the same
+            layout = mBitmap->createTextLayout(t);
+        }
+        mBitmap->beginDraw();
+        mBitmap->fill(Color::kBlack);
+        mBitmap->drawText(*layout, Point::kZero);
+        mBitmap->endDraw();
+
+        if (mBitmap->pixelAt(0, 0).toRGBA() != bg.toRGBA()) {
+            return createColorError("incorrect background color at (0, 0)", bg, mBitmap->pixelAt(0, 0));
+        }
+        // The glyph will not necessarily have a fully covered pixel, so
+        // look for the pixel closest to the foreground color.
+        Color closest;
+        float closestDist = 1e9f;
+        for (int y = 0;  y < mBitmap->height();  ++y) {
+            for (int x = 0;  x < mBitmap->width();  ++x) {
+                auto c = mBitmap->pixelAt(x, y);
+                float dist = std::abs(c.red() - fg.red()) + std::abs(c.green() - fg.green())
+                             + std::abs(c.blue() - fg.blue());
+                if (dist < closestDist) {
+                    closest = c;
+                    closestDist = dist;
+                }
+            }
+        }
+        if (closestDist > 0.3f) {
+            return createColorError("incorrect text color", fg, closest);
+        }
+        return "";
+    }
+};
+
+class EditableTextLayoutTest : public BitmapTest
+{
+public:
+    EditableTextLayoutTest() : BitmapTest("editable text layout", 1, 1) {}
+
+    std::string run() override
+    {
+        // Text::replaceText()
+        Text t("hello world", Font(), Color::kBlack);
+        t.setBold(6, 5);
+        t.replaceText(8, 0, "XX");  // bold run grows
+        if (t.text() != "hello woXXrld" || t.runs().size() != 2
+            || t.runs()[0].length != 6 || t.runs()[1].length != 7) {
+            return "replaceText() did not extend run";
+        }
+        t.replaceText(0, 7, "");  // first run removed
+        if (t.text() != "oXXrld" || t.runs().size() != 1
+            || !t.runs()[0].bold.isSet || t.runs()[0].length != 6) {
+            return "replaceText() did not remove run";
+        }
+        t.setItalic(2, 2);  // "oX" "Xr" "ld"
+        for (int i = 0;  i < 3;  ++i) {
+            t.replaceText(3 + i, 0, "y");  // typing in the middle run
+        }
+        if (t.text() != "oXXyyyrld" || t.runs().size() != 3 || t.runs()[1].length != 5
+            || !t.runs()[1].italic.isSet || t.runs()[2].startIndex != 7) {
+            return "replaceText() did not extend the middle run";
+        }
+        auto inRange = t.runsInRange(1, 6);
+        if (inRange.size() != 2 || inRange[0].startIndex != 1 || inRange[0].length != 1
+            || inRange[1].startIndex != 2 || inRange[1].length != 5) {
+            return "runsInRange() returned the wrong runs";
+        }
+        t.replaceText(4, 0, "z");  // runAt() should not need runs()
+        auto at = t.runAt(5);
+        if (at.startIndex != 2 || at.length != 6 || !at.italic.isSet
+            || t.runAt(0).length != 2 || t.runAt(100).startIndex != 8) {
+            return "runAt() returned the wrong run";
+        }
+
+        Font font("Arial", PicaPt(12.0f));
+        PicaPt width = PicaPt(72.0f);
+        EditableTextLayout layout(*mBitmap, Text("one\ntwo\nthree", font, Color::kBlack),
+                                  width);
+        if (layout.paragraphCount() != 3) {
+            return "expected 3 paragraphs, got " + std::to_string(layout.paragraphCount());
+        }
+        layout.glyphs();  // so that the glyphs are patched
+
+        // Drawing through the base class must draw the paragraphs, not
+        // treat the layout as the context's own layout.
+        const TextLayout& baseLayout = layout;
+        mBitmap->beginDraw();
+        mBitmap->drawText(baseLayout, Point::kZero);
+        mBitmap->endDraw();
+
+        layout.insert(3, "\nand a line long enough that it will need to wrap");
+        layout.remove(0, 2);
+        layout.replace(long(layout.text().text().size()) - 5, 2, "TH");
+        std::string expected = "e\nand a line long enough that it will need to wrap\ntwo\nTHree";
+        if (layout.text().text() != expected) {
+            return "bad text after edits: '" + layout.text().text() + "'";
+        }
+
+        EditableTextLayout fresh(*mBitmap, Text(expected, font, Color::kBlack), width);
+        if (layout.paragraphCount() != fresh.paragraphCount()) {
+            return "edited layout has wrong paragraph count";
+        }
+        for (int i = 0;  i < fresh.paragraphCount();  ++i) {
+            if (layout.paragraphY(i) != fresh.paragraphY(i)) {
+                return createFloatError("paragraph " + std::to_string(i) + " has wrong y",
+                                        fresh.paragraphY(i).asFloat(), layout.paragraphY(i).asFloat());
+            }
+        }
+        auto &edited = layout.glyphs();
+        auto &glyphs = fresh.glyphs();
+        if (edited.size() != glyphs.size()) {
+            return createFloatError("edited layout has wrong number of glyphs",
+                                    float(glyphs.size()), float(edited.size()));
+        }
+        for (size_t i = 0;  i < glyphs.size();  ++i) {
+            if (edited[i].index != glyphs[i].index
+                || edited[i].indexOfNext != glyphs[i].indexOfNext
+                || edited[i].line != glyphs[i].line
+                || edited[i].frame.x != glyphs[i].frame.x
+                || edited[i].frame.y != glyphs[i].frame.y
+                || edited[i].frame.width != glyphs[i].frame.width
+                || edited[i].frame.height != glyphs[i].frame.height) {
+                return "glyph " + std::to_string(i) + " differs from a new layout";
+            }
+        }
+        if (glyphs[2].line != 1 || glyphs.back().line <= 3) {
+            return "expected the long line to wrap";
+        }
+        if (layout.metrics().height != fresh.metrics().height) {
+            return createFloatError("edited layout has wrong height",
+                                    fresh.metrics().height.asFloat(),
+                                    layout.metrics().height.asFloat());
+        }
+        return "";
+    }
+};
+
+class LongTextLayoutTest : public BitmapTest
+{
+public:
+    LongTextLayoutTest() : BitmapTest("long text layout (lazy)", 1, 1) {}
+
+    std::string run() override
+    {
+        std::string str;
+        for (int i = 0;  i < 1000;  ++i) {
+            str += "Paragraph " + std::to_string(i);
+            if (i % 10 == 0) {
+                str += " is long enough that it will need to wrap to another line";
+            }
+            str += "\n";
+        }
+        Text t(str, Font("Arial", PicaPt(12.0f)), Color::kBlack);
+        PicaPt width(144.0f);
+        EditableTextLayout eager(*mBitmap, t, width);
+        EditableTextLayout lazy(*mBitmap, t, width, Alignment::kLeft, kWrapWord, 10);
+
+        // Drawing (or querying) a paragraph lays it out, which fixes its height
+        mBitmap->beginDraw();
+        lazy.draw(*mBitmap, Point::kZero,
+                  Rect(PicaPt::kZero, lazy.paragraphY(500), width, PicaPt(72.0f)));
+        mBitmap->endDraw();
+        for (int i = 500;  i < 503;  ++i) {
+            if (lazy.paragraphHeight(i) != eager.paragraphHeight(i)) {
+                return createFloatError("drawn paragraph " + std::to_string(i) + " has wrong height",
+                                        eager.paragraphHeight(i).asFloat(),
+                                        lazy.paragraphHeight(i).asFloat());
+            }
+        }
+        auto lines = lazy.lineYs(510);
+        if (lines.size() != 2 || lines[1] <= lines[0]) {
+            return "expected paragraph 510 to have two lines";
+        }
+
+        // Hit-testing without glyphs() only needs the paragraph at the point,
+        // but should find the same glyph (in a lazy layout, the lines and
+        // positions of unmeasured paragraphs are estimates).
+        auto dy = PicaPt(1.0f);
+        TextLayout::Glyph copy, lazyCopy;
+        bool found = eager.glyphAtPoint(Point(PicaPt(1.0f), eager.paragraphY(510) + dy), &copy);
+        auto *eagerGlyph = eager.glyphAtPoint(Point(PicaPt(1.0f), eager.paragraphY(510) + dy));
+        if (!found || !eagerGlyph || copy.index != eagerGlyph->index
+            || copy.line != eagerGlyph->line || copy.frame.y != eagerGlyph->frame.y) {
+            return "glyphAtPoint() copied the wrong glyph";
+        }
+        if (!lazy.glyphAtPoint(Point(PicaPt(1.0f), lazy.paragraphY(510) + dy), &lazyCopy)
+            || lazyCopy.index != copy.index) {
+            return "glyphAtPoint() found the wrong glyph in a lazy layout";
+        }
+
+        // glyphs() lays out everything, so the positions should now be exact
+        if (lazy.glyphs().size() != eager.glyphs().size()) {
+            return createFloatError("wrong number of glyphs", float(eager.glyphs().size()),
+                                    float(lazy.glyphs().size()));
+        }
+        for (int i = 0;  i < eager.paragraphCount();  ++i) {
+            if (lazy.paragraphY(i) != eager.paragraphY(i)) {
+                return createFloatError("paragraph " + std::to_string(i) + " has wrong y",
+                                        eager.paragraphY(i).asFloat(), lazy.paragraphY(i).asFloat());
+            }
+        }
+        auto y = eager.paragraphY(700) + 0.5f * eager.paragraphHeight(700);
+        if (lazy.paragraphAtY(y) != 700) {
+            return createFloatError("wrong paragraph at y", 700.0f, float(lazy.paragraphAtY(y)));
+        }
+        if (lazy.metrics().height != eager.metrics().height) {
+            return createFloatError("wrong height", eager.metrics().height.asFloat(),
+                                    lazy.metrics().height.asFloat());
+        }
+        return "";
+    }
+};
+
+class GlyphAtPointTest : public BitmapTest
+{
+public:
+    GlyphAtPointTest() : BitmapTest("glyphAtPoint()", 1, 1) {}
+
+    std::string run() override
+    {
+        Font font("Arial", PicaPt(12.0f));
+        auto layout = mBitmap->createTextLayout("The quick brown fox\n\njumps over the lazy dog",
+                                                font, Color::kBlack,
+                                                Size(PicaPt(72.0f), PicaPt::kZero));
+        auto &glyphs = layout->glyphs();
+        auto &tm = layout->metrics();
+        // Use a grid that is not aligned with anything, plus the glyph edges
+        std::vector<Point> pts;
+        for (float y = -2.0f;  y < tm.height.asFloat() + 2.0f;  y += 0.7f) {
+            for (float x = -2.0f;  x < tm.width.asFloat() + 2.0f;  x += 0.7f) {
+                pts.emplace_back(PicaPt(x), PicaPt(y));
+            }
+        }
+        for (auto &g : glyphs) {
+            pts.push_back(g.frame.upperLeft());
+            pts.push_back(g.frame.lowerRight());
+        }
+        int nFound = 0;
+        for (auto &p : pts) {
+            const TextLayout::Glyph *expected = nullptr;
+            for (auto &g : glyphs) {
+                if (g.frame.contains(p)) {
+                    expected = &g;
+                    break;
+                }
+            }
+            auto *got = layout->glyphAtPoint(p);
+            if (got != expected) {
+                return "wrong glyph at (" + std::to_string(p.x.asFloat()) + ", "
+                       + std::to_string(p.y.asFloat()) + "): expected index "
+                       + std::to_string(expected ? expected->index : -1) + ", got "
+                       + std::to_string(got ? got->index : -1);
+            }
+            TextLayout::Glyph copy;
+            bool found = layout->glyphAtPoint(p, &copy);
+            if (found != (expected != nullptr)
+                || (found && (copy.index != expected->index || copy.frame.x != expected->frame.x
+                              || copy.frame.y != expected->frame.y))) {
+                return "wrong glyph copied at (" + std::to_string(p.x.asFloat()) + ", "
+                       + std::to_string(p.y.asFloat()) + "): expected index "
+                       + std::to_string(expected ? expected->index : -1) + ", got "
+                       + std::to_string(found ? copy.index : -1);
+            }
+            nFound += (got ? 1 : 0);
+        }
+        if (nFound == 0) {
+            return "glyphAtPoint() never found a glyph";
+        }
+        return "";
+    }
+};
+
+class GlyphRangeTest : public BitmapTest
+{
+public:
+    GlyphRangeTest() : BitmapTest("glyphRange()", 1, 1) {}
+
+    std::string run() override
+    {
+        Text text("The quick brown fox\n\njumps over the lazy dog\n",
+                  Font("Arial", PicaPt(12.0f)), Color::kBlack);
+        text.setFont(Font("Arial", PicaPt(20.0f)), 4, 5);
+        auto layout = mBitmap->createTextLayout(text, Size(PicaPt(72.0f), PicaPt::kZero));
+        auto range = layout->glyphRange();
+        auto &glyphs = layout->glyphs();
+        if (range.size() != long(glyphs.size())) {
+            return "glyphRange() has " + std::to_string(range.size())
+                   + " glyphs, glyphs() has " + std::to_string(glyphs.size());
+        }
+        auto sameFrame = [](const Rect& r1, const Rect& r2) {
+            return (r1.x == r2.x && r1.y == r2.y && r1.width == r2.width && r1.height == r2.height);
+        };
+        auto glyphStr = [](const TextLayout::Glyph& g) {
+            return "{" + std::to_string(g.index) + ", " + std::to_string(g.indexOfNext)
+                   + ", line " + std::to_string(g.line) + ", ("
+                   + std::to_string(g.frame.x.asFloat()) + ", "
+                   + std::to_string(g.frame.y.asFloat()) + ", "
+                   + std::to_string(g.frame.width.asFloat()) + ", "
+                   + std::to_string(g.frame.height.asFloat()) + ")}";
+        };
+        long i = 0;
+        for (auto g : range) {
+            auto &expected = glyphs[i];
+            auto g2 = range[i];
+            if (g.index != expected.index || g.indexOfNext != expected.indexOfNext
+                || g.line != expected.line || !sameFrame(g.frame, expected.frame)
+                || g2.index != g.index || !sameFrame(g2.frame, g.frame)) {
+                return "glyph " + std::to_string(i) + ": expected "
+                       + glyphStr(expected) + ", got " + glyphStr(g) + " / " + glyphStr(g2);
+            }
+            ++i;
+        }
+        if (i != long(glyphs.size())) {
+            return "iterator returned " + std::to_string(i) + " glyphs, expected "
+                   + std::to_string(glyphs.size());
+        }
+        return "";
+    }
+};
+
+class FontFallbackTest : public BitmapTest
+{
+public:
+    FontFallbackTest() : BitmapTest("font fallback", 1, 1) {}
+
+    std::string run() override
+    {
+        Font font("Arial", PicaPt(12.0f));
+        if (font.familyForCodePoint(*mBitmap, uint32_t('A')) != font.family()) {
+            return "familyForCodePoint('A') should be the font's family, got '"
+                   + font.familyForCodePoint(*mBitmap, uint32_t('A')) + "'";
+        }
+
+        std::string mixed = "abc \xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e \xce\xb1\xce\xb2\xce\xb3 abc";
+        // No other test uses this size, so its fallbacks are not cached yet
+        Font cold("Arial", PicaPt(11.875f));
+        auto coldLayout = mBitmap->createTextLayout(mixed.c_str(), cold, Color::kBlack);
+        auto beforePrewarm = coldLayout->glyphs();
+        // The CJK characters are not in Arial, so they need a fallback (which
+        // is what is cached)
+        for (uint32_t cjk : { 0x65e5u, 0x672cu, 0x8a9eu }) {
+            if (cold.familyForCodePoint(*mBitmap, cjk) == cold.family()) {
+                return "familyForCodePoint(U+" + std::to_string(cjk)
+                       + ") should be a fallback, not the font's family";
+            }
+        }
+
+        cold.prewarmFallbacks(*mBitmap, { mixed });
+        auto layout = mBitmap->createTextLayout(mixed.c_str(), cold, Color::kBlack);
+        auto &afterPrewarm = layout->glyphs();
+        // Each character except spaces should have been drawn with something
+        for (auto &g : afterPrewarm) {
+            if (mixed[g.index] != ' ' && g.frame.width <= PicaPt::kZero) {
+                return "glyph at index " + std::to_string(g.index) + " has no width";
+            }
+        }
+        // The layout should be the same when the fallbacks are cached
+        if (afterPrewarm.size() != beforePrewarm.size()) {
+            return "layout changed after fallbacks were cached";
+        }
+        for (size_t i = 0;  i < afterPrewarm.size();  ++i) {
+            if (afterPrewarm[i].index != beforePrewarm[i].index
+                || afterPrewarm[i].frame.width != beforePrewarm[i].frame.width) {
+                return "layout changed after fallbacks were cached";
+            }
+        }
+        return "";
+    }
+};
+
 class RenderedImageTest : public BitmapTest
 {
 public:
@@ -4263,6 +5555,54 @@ private:
     TestImage mTestImage = TestImage::kNone;
 };
 
+class FontHandleTest : public Test
+{
+public:
+    FontHandleTest() : Test("Font copy and compare") {}
+
+    std::string run() override
+    {
+        Font f1("Arial", PicaPt(12.0f));
+        Font f2("Arial", PicaPt(12.0f));
+        Font f3 = f1;
+        if (f1 != f2 || f1 != f3 || f1.hash() != f2.hash()) {
+            return "identical fonts should be equal";
+        }
+
+        f3.setPointSize(PicaPt(14.0f));
+        if (f1.pointSize() != PicaPt(12.0f)) {
+            return "setPointSize() on a copy changed the original";
+        }
+        if (f3 == f1) {
+            return "fonts with different point sizes should not be equal";
+        }
+        if (f3 != Font("Arial", PicaPt(14.0f))) {
+            return "modified font should equal a newly created identical font";
+        }
+
+        f3.setPointSize(PicaPt(12.0f));
+        if (f3 != f1 || f3.hash() != f1.hash()) {
+            return "font should be equal after changing back to the original size";
+        }
+
+        Font bold = f1;
+        bold.setBold(true);
+        if (bold == f1 || bold != f1.fontWithStyle(kStyleBold)
+            || bold.weight() != kWeightBold || f1.weight() != kWeightRegular) {
+            return "setBold() on a copy gave the wrong result";
+        }
+
+        if (Font() != Font("", PicaPt::kZero)) {
+            return "default fonts should be equal";
+        }
+
+        return "";
+    }
+
+    std::string debugImage() const override { return ""; }
+    void writeBitmapToFile(const std::string& path) const override {}
+};
+
 class ColorFuncTest : public Test
 {
 public:
@@ -4393,6 +5733,103 @@ public:
     }
 };
 
+class CurrentTransformTest : public BitmapTest
+{
+public:
+    CurrentTransformTest() : BitmapTest("currentTransform/setTransform/clipBounds", 16, 16) {}
+
+    std::string run() override
+    {
+        auto dpi = mBitmap->dpi();
+        auto px = [dpi](float p) { return PicaPt::fromPixels(p, dpi); };
+        Color fg = Color::kBlack;
+
+        mBitmap->beginDraw();
+        mBitmap->fill(mBGColor);
+
+        auto err = verifyTransform("initial", AffineTransform::kIdentity);
+        if (err.empty()) {
+            err = verifyClip("initial", Rect::fromPixels(0.0f, 0.0f, 16.0f, 16.0f, dpi));
+        }
+
+        mBitmap->scale(2.0f, 3.0f);
+        mBitmap->translate(px(1.0f), px(2.0f));
+        auto expected = AffineTransform::scaling(2.0f, 3.0f).translated(px(1.0f), px(2.0f));
+        if (err.empty()) {
+            err = verifyTransform("scale, translate", expected);
+        }
+        if (err.empty()) {  // (0, 0, 16, 16) in user coords is (-1, -2, 8, 5.333)
+            err = verifyClip("scale, translate",
+                             Rect::fromPixels(-1.0f, -2.0f, 8.0f, 16.0f / 3.0f, dpi));
+        }
+
+        mBitmap->save();
+        mBitmap->concatTransform(AffineTransform::rotation(30.0f));
+        if (err.empty()) {
+            err = verifyTransform("concatTransform", expected.rotated(30.0f));
+        }
+        mBitmap->setTransform(AffineTransform::translation(px(2.0f), px(3.0f)));
+        if (err.empty()) {
+            err = verifyTransform("setTransform",
+                                  AffineTransform::translation(px(2.0f), px(3.0f)));
+        }
+        mBitmap->clipToRect(Rect::fromPixels(1.0f, 1.0f, 8.0f, 4.0f, dpi));
+        if (err.empty()) {
+            err = verifyClip("clipToRect", Rect::fromPixels(1.0f, 1.0f, 8.0f, 4.0f, dpi));
+        }
+        mBitmap->setFillColor(fg);
+        mBitmap->drawRect(Rect::fromPixels(1.0f, 1.0f, 4.0f, 2.0f, dpi), kPaintFill);
+        mBitmap->restore();
+
+        if (err.empty()) {
+            err = verifyTransform("restore", expected);
+        }
+        mBitmap->endDraw();
+
+        if (err.empty()) {
+            err = verifyFillRect(3, 4, 4, 2, mBGColor, fg);
+        }
+        return err;
+    }
+
+private:
+    std::string verifyTransform(const std::string& msg, const AffineTransform& expected)
+    {
+        auto t = mBitmap->currentTransform();
+        const float kErr = 0.001f;
+        if (std::abs(t.a - expected.a) > kErr || std::abs(t.b - expected.b) > kErr ||
+            std::abs(t.c - expected.c) > kErr || std::abs(t.d - expected.d) > kErr ||
+            std::abs(t.tx.pt - expected.tx.pt) > kErr ||
+            std::abs(t.ty.pt - expected.ty.pt) > kErr) {
+            std::stringstream s;
+            s << msg << ": expected [" << expected.a << " " << expected.b << " "
+              << expected.c << " " << expected.d << " " << expected.tx.pt << " "
+              << expected.ty.pt << "], got [" << t.a << " " << t.b << " " << t.c
+              << " " << t.d << " " << t.tx.pt << " " << t.ty.pt << "]";
+            return s.str();
+        }
+        return "";
+    }
+
+    std::string verifyClip(const std::string& msg, const Rect& expected)
+    {
+        auto r = mBitmap->clipBounds();
+        const float kErr = 0.001f;
+        if (std::abs(r.x.pt - expected.x.pt) > kErr ||
+            std::abs(r.y.pt - expected.y.pt) > kErr ||
+            std::abs(r.width.pt - expected.width.pt) > kErr ||
+            std::abs(r.height.pt - expected.height.pt) > kErr) {
+            std::stringstream s;
+            s << msg << ": expected clipBounds() (" << expected.x.pt << ", "
+              << expected.y.pt << ", " << expected.width.pt << ", "
+              << expected.height.pt << "), got (" << r.x.pt << ", " << r.y.pt
+              << ", " << r.width.pt << ", " << r.height.pt << ")";
+            return s.str();
+        }
+        return "";
+    }
+};
+
 /*void TextDebug()
 {
     Font font("Arial", PicaPt(20));
@@ -4450,17 +5887,32 @@ int main(int argc, char *argv[])
         std::make_shared<RectStrokeAndFillTest>(1),
         std::make_shared<RectStrokeAndFillTest>(2),
         std::make_shared<AlphaBlendTest>(),
+        std::make_shared<LayerTest>(),
+        std::make_shared<ShadowTest>(),
         std::make_shared<TestTransform>(),
         std::make_shared<EllipseTest>(),
         std::make_shared<RoundedRectTest>(),
         // Don't need to test drawing a BezierPath, since rounded rects use that internally
         std::make_shared<ClipRectTest>(),
+        std::make_shared<NestedClipRectTest>(),
         std::make_shared<ClipPathTest>(),
+        std::make_shared<BezierPathGeometryTest>(),
+        std::make_shared<CullingTest>(),
+        std::make_shared<DirtyRegionTest>(),
+#if USING_X11
+        std::make_shared<X11DoubleBufferedTest>(),
+        std::make_shared<CPURectFillTest>(),
+#endif // USING_X11
         std::make_shared<SaveRestoreTest>(),
+        std::make_shared<SaveRestoreTransformStrokeTest>(),
+        std::make_shared<StateChangeTest>(),
         std::make_shared<GettersTest>(),
         std::make_shared<LinearGradientTest>(),
         std::make_shared<RadialGradientTest>(),
         std::make_shared<GradientMemoryTest>(),
+        std::make_shared<GradientLookupTableTest>(),
+        std::make_shared<ConicGradientTest>(),
+        std::make_shared<MeshGradientTest>(),
         std::make_shared<FontTest>("Arial", 20),
         std::make_shared<FontTest>("Georgia", 20),
         // std::make_shared<FontTest>("Courier New", 20),
@@ -4478,6 +5930,12 @@ int main(int argc, char *argv[])
         std::make_shared<BasicTextLayoutTest>(),
         std::make_shared<RichTextRunsTest>(),
         std::make_shared<RichTextTest>(),
+        std::make_shared<RecolorTextTest>(),
+        std::make_shared<EditableTextLayoutTest>(),
+        std::make_shared<LongTextLayoutTest>(),
+        std::make_shared<GlyphAtPointTest>(),
+        std::make_shared<GlyphRangeTest>(),
+        std::make_shared<FontFallbackTest>(),
         std::make_shared<RenderedImageTest>(),
         std::make_shared<RenderedImageCopyTest>(),
         std::make_shared<ImageTest>(kImageRGBA32),
@@ -4510,8 +5968,10 @@ int main(int argc, char *argv[])
         std::make_shared<ImageTest>("bad.jpg", kImageRGB24, TestImage::kJPEG_bad),
         std::make_shared<ImageTest>("test.gif", kImageRGB24, TestImage::kGIF),
         std::make_shared<ImageTest>("bad.gif", kImageRGB24, TestImage::kGIF_bad),
+        std::make_shared<FontHandleTest>(),
         std::make_shared<ColorFuncTest>(),
         std::make_shared<TransformTest>(),
+        std::make_shared<CurrentTransformTest>(),
     };
 
     const char *TERM = std::getenv("TERM");
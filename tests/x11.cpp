@@ -27,6 +27,7 @@
 // Xlib.h defines "Font", which interacts badly with our "Font", so we need
 // to quarantine the X stuff in its own header.
 #include <X11/Xlib.h>
+#include <X11/Xutil.h>
 
 static Display *gXDisplay = nullptr;
 
@@ -45,6 +46,33 @@ void X11Close()
     XCloseDisplay(gXDisplay);
 }
 
+unsigned long X11CreateWindow(int width, int height)
+{
+    Window window = XCreateSimpleWindow(gXDisplay, XDefaultRootWindow(gXDisplay),
+                                        0, 0, width, height, 0, 0, 0);
+    XMapWindow(gXDisplay, window);
+    XSync(gXDisplay, False);
+    return (unsigned long)window;
+}
+
+void X11DestroyWindow(unsigned long window)
+{
+    XDestroyWindow(gXDisplay, (Window)window);
+    XSync(gXDisplay, False);
+}
+
+unsigned int X11GetPixel(unsigned long window, int x, int y)
+{
+    XImage *image = XGetImage(gXDisplay, (Window)window, x, y, 1, 1,
+                              AllPlanes, ZPixmap);
+    if (!image) {
+        return 0xdeadbeef;  // not a valid 0xrrggbb value
+    }
+    unsigned int pixel = (unsigned int)(XGetPixel(image, 0, 0) & 0xffffff);
+    XDestroyImage(image);
+    return pixel;
+}
+
 #else
 // not using X11
 #endif
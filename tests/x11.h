@@ -27,4 +27,11 @@ void X11Open();
 void* X11GetDisplay();
 void X11Close();
 
+// Creates a mapped window. (Window is an unsigned long; we cannot include
+// Xlib.h here, see x11.cpp)
+unsigned long X11CreateWindow(int width, int height);
+void X11DestroyWindow(unsigned long window);
+// Returns the pixel in the window as 0xrrggbb
+unsigned int X11GetPixel(unsigned long window, int x, int y);
+
 #endif // ND_TEST_X11_H
@@ -24,6 +24,7 @@
 
 #include <string.h>  // for memset()
 #include <memory>
+#include <string>
 
 #include "../src/nativedraw.h"
 #include "timings.h"
@@ -44,9 +45,19 @@ int main(int argc, const char *argv[])
     XMapWindow(display, window);
     XSelectInput(display, window, ExposureMask);
 
+    // --double-buffered times drawing to a back buffer that is copied to the
+    // window in endDraw()
+    bool doubleBuffered = (argc > 1 && std::string(argv[1]) == "--double-buffered");
+
     auto timings = std::make_shared<Timings>();
-    auto dc = ND_NAMESPACE::DrawContext::fromX11(display, &window,
-                                                 kWidth, kHeight, 72.0f);
+    std::shared_ptr<ND_NAMESPACE::DrawContext> dc;
+    if (doubleBuffered) {
+        dc = ND_NAMESPACE::DrawContext::fromX11DoubleBuffered(display, &window,
+                                                              kWidth, kHeight, 72.0f);
+    } else {
+        dc = ND_NAMESPACE::DrawContext::fromX11(display, &window,
+                                                kWidth, kHeight, 72.0f);
+    }
 
     bool done = false;
     XEvent event;
@@ -69,11 +69,16 @@ void drawNothing(DrawContext& dc)
     dc.endDraw();
 }
 
-void drawRects(DrawContext& dc, int n, int objWidthPx, int objHeightPx, PaintMode mode)
+void drawRects(DrawContext& dc, int n, int objWidthPx, int objHeightPx, PaintMode mode,
+               bool alignToPixels = false)
 {
     auto w = PicaPt::fromPixels(objWidthPx, dc.dpi());
     auto h = PicaPt::fromPixels(objHeightPx, dc.dpi());
     LayoutInfo layout(dc, n, objWidthPx, objHeightPx);
+    if (alignToPixels) {
+        layout.dx = dc.roundToNearestPixel(layout.dx);
+        layout.dy = dc.roundToNearestPixel(layout.dy);
+    }
 
     auto x0 = PicaPt::fromPixels(1, dc.dpi());
     auto x = x0;
@@ -98,6 +103,36 @@ void drawRects(DrawContext& dc, int n, int objWidthPx, int objHeightPx, PaintMod
     dc.endDraw();
 }
 
+// Redraws the same scene as drawRects(), but only a caret-sized dirty rect.
+// The cost should not depend on the size of the window.
+void drawRectsDirty(DrawContext& dc, int n, int objWidthPx, int objHeightPx)
+{
+    auto w = PicaPt::fromPixels(objWidthPx, dc.dpi());
+    auto h = PicaPt::fromPixels(objHeightPx, dc.dpi());
+    LayoutInfo layout(dc, n, objWidthPx, objHeightPx);
+
+    auto x0 = PicaPt::fromPixels(1, dc.dpi());
+    auto x = x0;
+    auto y = PicaPt::fromPixels(1, dc.dpi());
+    int col = 0;
+
+    dc.invalidate(Rect::fromPixels(dc.width() / 2, dc.height() / 2, 2, 20, dc.dpi()));
+    dc.beginDraw(dc.dirtyRegion());
+    dc.fill(kBGColor);
+    dc.setFillColor(Color(0.5f, 0.5f, 0.5f, 1.0f));
+    for (int i = 0;  i < n;  ++i) {
+        dc.drawRect(Rect(x, y, w, h), kPaintFill);
+        x += layout.dx;
+        col++;
+        if (col >= layout.nCols) {
+            col = 0;
+            x = x0;
+            y += layout.dy;
+        }
+    }
+    dc.endDraw();
+}
+
 void drawColoredRects(DrawContext& dc, int n, int objWidthPx, int objHeightPx)
 {
     auto w = PicaPt::fromPixels(objWidthPx, dc.dpi());
@@ -166,6 +201,46 @@ void drawRoundedRects(DrawContext& dc, int n, int objWidthPx, int objHeightPx, i
     dc.endDraw();
 }
 
+void drawShadowedRoundedRects(DrawContext& dc, int n, int objWidthPx, int objHeightPx,
+                              int radiusPx, int blurPx)
+{
+    // The path is at the origin and moved with translate(), the way a
+    // widget would draw, so that the blurred shadow can be reused.
+    auto w = PicaPt::fromPixels(objWidthPx - 2 * blurPx, dc.dpi());
+    auto h = PicaPt::fromPixels(objHeightPx - 2 * blurPx, dc.dpi());
+    auto r = PicaPt::fromPixels(radiusPx, dc.dpi());
+    auto blur = PicaPt::fromPixels(blurPx, dc.dpi());
+    auto offset = Size(PicaPt(0.0f), PicaPt::fromPixels(2, dc.dpi()));
+    LayoutInfo layout(dc, n, objWidthPx, objHeightPx);
+
+    auto path = dc.createBezierPath();
+    path->addRoundedRect(Rect(PicaPt(0.0f), PicaPt(0.0f), w, h), r);
+
+    auto x0 = blur;
+    auto x = x0;
+    auto y = blur;
+    int col = 0;
+
+    dc.beginDraw();
+    dc.fill(kBGColor);
+    dc.setFillColor(Color(0.5f, 0.5f, 0.5f, 1.0f));
+    for (int i = 0;  i < n;  ++i) {
+        dc.save();
+        dc.translate(x, y);
+        dc.drawShadow(path, offset, blur, Color(0.0f, 0.0f, 0.0f, 0.5f));
+        dc.drawPath(path, kPaintFill);
+        dc.restore();
+        x += layout.dx;
+        col++;
+        if (col >= layout.nCols) {
+            col = 0;
+            x = x0;
+            y += layout.dy;
+        }
+    }
+    dc.endDraw();
+}
+
 void drawBezier(DrawContext& dc, int n,
                 std::function<std::shared_ptr<BezierPath>(DrawContext&, int, const Point&)> createPath,
                 int radiusPx, PaintMode mode)
@@ -196,6 +271,45 @@ void drawBezier(DrawContext& dc, int n,
     dc.endDraw();
 }
 
+void drawBezierLayer(DrawContext& dc, int n,
+                     std::function<std::shared_ptr<BezierPath>(DrawContext&, int, const Point&)> createPath,
+                     int radiusPx, PaintMode mode)
+{
+    // Like drawBezier(), but the path is drawn once into a retained layer,
+    // and each object is a copy of the layer.
+    auto r = PicaPt::fromPixels(radiusPx, dc.dpi());
+    LayoutInfo layout(dc, n, radiusPx, radiusPx);
+
+    auto layer = dc.createLayer(Size(2.0f * r + PicaPt::fromPixels(2, dc.dpi()),
+                                     2.0f * r + PicaPt::fromPixels(2, dc.dpi())));
+    auto &ldc = layer->beginDraw();
+    ldc.setStrokeColor(Color(0.0f, 0.0f, 0.0f, 1.0f));
+    ldc.setStrokeWidth(PicaPt::fromPixels(1, dc.dpi()));
+    ldc.setFillColor(Color(0.5f, 0.5f, 0.5f, 1.0f));
+    auto onePx = PicaPt::fromPixels(1, dc.dpi());
+    ldc.drawPath(createPath(ldc, radiusPx, Point(r + onePx, r + onePx)), mode);
+    layer->endDraw();
+
+    auto x0 = -onePx;
+    auto x = x0;
+    auto y = -onePx;
+    int col = 0;
+
+    dc.beginDraw();
+    dc.fill(kBGColor);
+    for (int i = 0;  i < n;  ++i) {
+        dc.drawLayer(layer, Point(x, y));
+        x += layout.dx;
+        col++;
+        if (col >= layout.nCols) {
+            col = 0;
+            x = x0;
+            y += layout.dy;
+        }
+    }
+    dc.endDraw();
+}
+
 void drawBezierTransformed(DrawContext& dc, int n,
                 std::function<std::shared_ptr<BezierPath>(DrawContext&, int, const Point&)> createPath,
                            int radiusPx, PaintMode mode)
@@ -286,6 +400,87 @@ void clipRects(DrawContext& dc, int n, int objWidthPx, int objHeightPx)
     dc.endDraw();
 }
 
+void clipRectsNested(DrawContext& dc, int n, int objWidthPx, int objHeightPx)
+{
+    // Like a table in a scroll view: the view clips, each cell clips, and
+    // the cell contents are usually inside the cell.
+    auto w = PicaPt::fromPixels(objWidthPx, dc.dpi());
+    auto h = PicaPt::fromPixels(objHeightPx, dc.dpi());
+    auto onePx = PicaPt::fromPixels(1, dc.dpi());
+    LayoutInfo layout(dc, n, objWidthPx, objHeightPx);
+
+    auto x0 = onePx;
+    auto x = x0;
+    auto y = onePx;
+    int col = 0;
+
+    dc.beginDraw();
+    dc.fill(kBGColor);
+    dc.setFillColor(Color(0.5f, 0.5f, 0.5f, 1.0f));
+    dc.save();
+    dc.clipToRect(Rect(x0, y, PicaPt::fromPixels(dc.width() - 2, dc.dpi()),
+                       PicaPt::fromPixels(dc.height() - 2, dc.dpi())));
+    for (int i = 0;  i < n;  ++i) {
+        dc.save();
+        dc.clipToRect(Rect(x, y, w, h));
+        dc.drawRect(Rect(x + onePx, y + onePx, w - 2.0f * onePx, h - 2.0f * onePx), kPaintFill);
+        dc.restore();
+        x += layout.dx;
+        col++;
+        if (col >= layout.nCols) {
+            col = 0;
+            x = x0;
+            y += layout.dy;
+        }
+    }
+    dc.restore();
+    dc.endDraw();
+}
+
+void saveRestoreNested(DrawContext& dc, int n, int objWidthPx, int objHeightPx)
+{
+    // Like a widget tree: each widget saves, moves to its frame, sets its
+    // colors, draws, draws its children, and restores.
+    const int kDepth = 4;
+    auto w = PicaPt::fromPixels(objWidthPx, dc.dpi());
+    auto h = PicaPt::fromPixels(objHeightPx, dc.dpi());
+    auto onePx = PicaPt::fromPixels(1, dc.dpi());
+    LayoutInfo layout(dc, n, objWidthPx, objHeightPx);
+
+    auto x0 = onePx;
+    auto x = x0;
+    auto y = onePx;
+    int col = 0;
+
+    dc.beginDraw();
+    dc.fill(kBGColor);
+    for (int i = 0;  i < n;  ++i) {
+        dc.save();
+        dc.translate(x, y);
+        for (int d = 0;  d < kDepth;  ++d) {
+            dc.save();
+            dc.translate(onePx, onePx);
+            dc.setFillColor(Color(0.5f, 0.5f, 0.5f + 0.1f * float(d), 1.0f));
+            dc.setStrokeWidth(onePx);
+        }
+        dc.drawRect(Rect(PicaPt::kZero, PicaPt::kZero,
+                         w - float(2 * kDepth) * onePx, h - float(2 * kDepth) * onePx),
+                    kPaintFill);
+        for (int d = 0;  d < kDepth;  ++d) {
+            dc.restore();
+        }
+        dc.restore();
+        x += layout.dx;
+        col++;
+        if (col >= layout.nCols) {
+            col = 0;
+            x = x0;
+            y += layout.dy;
+        }
+    }
+    dc.endDraw();
+}
+
 void clipBezier(DrawContext& dc, int n,
                 std::function<std::shared_ptr<BezierPath>(DrawContext&, int, const Point&)> createPath,
                 int radiusPx)
@@ -363,6 +558,235 @@ void drawText(DrawContext& dc, int n)
     dc.endDraw();
 }
 
+// Simulates a long scrolled list, where most of the rows are off-screen
+void drawScrolledList(DrawContext& dc, int n)
+{
+    const int rowHeightPx = 20;
+    auto rowHeight = PicaPt::fromPixels(rowHeightPx, dc.dpi());
+    auto margin = PicaPt::fromPixels(2, dc.dpi());
+    auto width = PicaPt::fromPixels(dc.width(), dc.dpi());
+    Font font("Arial", PicaPt(12.0f));
+
+    dc.beginDraw();
+    dc.fill(kBGColor);
+    dc.setFillColor(Color(0.9f, 0.9f, 0.9f, 1.0f));
+    // Scroll so that the visible rows are in the middle of the list
+    dc.translate(PicaPt::kZero, -float(n / 2) * rowHeight);
+    auto y = PicaPt::kZero;
+    for (int i = 0;  i < n;  ++i) {
+        if (i % 2 == 0) {
+            dc.setFillColor(Color(0.9f, 0.9f, 0.9f, 1.0f));
+            dc.drawRect(Rect(PicaPt::kZero, y, width, rowHeight), kPaintFill);
+        }
+        dc.setFillColor(Color(0.0f, 0.0f, 0.0f, 1.0f));
+        dc.drawText("row", Point(margin, y + margin), font, kPaintFill);
+        y += rowHeight;
+    }
+    dc.translate(PicaPt::kZero, float(n / 2) * rowHeight);
+    dc.endDraw();
+}
+
+std::shared_ptr<EditableTextLayout> createLongText(const DrawContext& dc, int nLines)
+{
+    std::string text;
+    for (int i = 0;  i < nLines;  ++i) {
+        text += "Line " + std::to_string(i) + ": the quick brown fox jumps over the lazy dog\n";
+    }
+    Font font("Arial", PicaPt(12.0f));
+    return std::make_shared<EditableTextLayout>(
+                dc, Text(text, font, Color(0.0f, 0.0f, 0.0f, 1.0f)),
+                PicaPt::fromPixels(dc.width(), dc.dpi()));
+}
+
+std::shared_ptr<TextLayout> create100kCharLayout(const DrawContext& dc)
+{
+    std::string text;
+    while (text.size() < 100000) {
+        text += "The quick brown fox jumps over the lazy dog. ";
+    }
+    Font font("Arial", PicaPt(12.0f));
+    return dc.createTextLayout(text.c_str(), font, Color(0.0f, 0.0f, 0.0f, 1.0f),
+                               Size(PicaPt::fromPixels(dc.width(), dc.dpi()), PicaPt::kZero));
+}
+
+// Simulates mouse hit-testing over a large document
+void hitTestText(DrawContext& dc, const TextLayout& layout, int n)
+{
+    auto &tm = layout.metrics();
+    long nHits = 0;
+    TextLayout::Glyph glyph;
+    for (int i = 0;  i < n;  ++i) {
+        // Spread the points deterministically over the layout
+        float fx = float((i * 7919) % 1000) / 1000.0f;
+        float fy = float((i * 104729) % 1000) / 1000.0f;
+        if (layout.glyphAtPoint(Point(fx * tm.width, fy * tm.height), &glyph)) {
+            nHits++;
+        }
+    }
+    if (nHits == 0) {
+        std::cout << "[ERROR] glyphAtPoint() did not find any glyphs" << std::endl;
+    }
+}
+
+// Simulates syntax highlighting: mostly copying and comparing fonts
+void buildRichText(DrawContext& dc, int n)
+{
+    std::string str;
+    for (int i = 0;  i < 1000;  ++i) {
+        str += "word ";
+    }
+    Font font("Courier New", PicaPt(12.0f));
+    Font bold = font.fontWithStyle(kStyleBold);
+    Font italic = font.fontWithStyle(kStyleItalic);
+    for (int i = 0;  i < n;  ++i) {
+        Text text(str, font, Color(0.0f, 0.0f, 0.0f, 1.0f));
+        for (int w = 0;  w < 1000;  w += 2) {
+            text.setFont((w % 4 == 0) ? bold : italic, 5 * w, 4);
+        }
+        if (text.runs().size() < 1000) {
+            std::cout << "[ERROR] rich text has too few runs" << std::endl;
+        }
+    }
+}
+
+// Simulates a UI with labels in many languages
+void drawMultilingualText(DrawContext& dc, int n)
+{
+    static const std::vector<std::string> kStrings = {
+        "Hello, world",
+        "\xe3\x81\x93\xe3\x82\x93\xe3\x81\xab\xe3\x81\xa1\xe3\x81\xaf\xe4\xb8\x96\xe7\x95\x8c",  // Japanese
+        "\xec\x95\x88\xeb\x85\x95\xed\x95\x98\xec\x84\xb8\xec\x9a\x94",  // Korean
+        "\xd0\x9f\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82 \xce\x93\xce\xb5\xce\xb9\xce\xac",  // Russian, Greek
+        "\xd9\x85\xd8\xb1\xd8\xad\xd8\xa8\xd8\xa7 \xd7\xa9\xd7\x9c\xd7\x95\xd7\x9d",  // Arabic, Hebrew
+        "\xe0\xa4\xa8\xe0\xa4\xae\xe0\xa4\xb8\xe0\xa5\x8d\xe0\xa4\xa4\xe0\xa5\x87",  // Hindi
+        "Done \xf0\x9f\x98\x80\xf0\x9f\x91\x8d\xf0\x9f\x8e\x89",  // emoji
+    };
+    Font font("Arial", PicaPt(12.0f));
+    dc.beginDraw();
+    dc.fill(kBGColor);
+    dc.setFillColor(Color(0.0f, 0.0f, 0.0f, 1.0f));
+    auto lineHeight = PicaPt(14.0f);
+    auto y = PicaPt::kZero;
+    auto maxY = PicaPt::fromPixels(dc.height(), dc.dpi());
+    for (int i = 0;  i < n;  ++i) {
+        // Different sizes so that each layout needs a new font
+        auto f = font.fontWithPointSize(PicaPt(10.0f + float(i % 8)));
+        dc.drawText(kStrings[i % kStrings.size()].c_str(), Point(PicaPt::kZero, y), f, kPaintFill);
+        y += lineHeight;
+        if (y > maxY) {
+            y = PicaPt::kZero;
+        }
+    }
+    dc.endDraw();
+}
+
+// Simulates a UI creating fonts on startup. Each call uses sizes that have
+// not been used before, so that nothing is cached.
+void measureNewFonts(DrawContext& dc, int n)
+{
+    static int gNextSize = 0;
+    PicaPt total;
+    for (int i = 0;  i < n;  ++i) {
+        Font font("Arial", PicaPt(6.0f + 0.01f * float(gNextSize++)));
+        total += font.metrics(dc).capHeight;
+    }
+    if (total == PicaPt::kZero) {
+        std::cout << "[ERROR] font metrics are zero" << std::endl;
+    }
+}
+
+std::vector<TextRun> createHighlights(const std::string& text)
+{
+    static const Color kColors[] = { Color(0.5f, 0.0f, 0.5f, 1.0f),
+                                     Color(0.0f, 0.5f, 0.0f, 1.0f),
+                                     Color(0.0f, 0.0f, 0.8f, 1.0f) };
+    std::vector<TextRun> runs;
+    int start = 0;
+    for (int i = 0;  i < int(text.size());  ++i) {
+        if (text[i] == ' ') {
+            runs.emplace_back();
+            runs.back().startIndex = start;
+            runs.back().length = i - start;
+            runs.back().color = kColors[runs.size() % 3];
+            start = i + 1;
+        }
+    }
+    return runs;
+}
+
+// Simulates syntax highlighting 50k tokens, one token at a time
+void highlightTokens(DrawContext& dc, const std::string& text, int n)
+{
+    auto highlights = createHighlights(text);
+    Font font("Courier New", PicaPt(12.0f));
+    for (int i = 0;  i < n;  ++i) {
+        Text t(text, font, Color(0.0f, 0.0f, 0.0f, 1.0f));
+        for (auto &r : highlights) {
+            t.setTextRun(r);
+        }
+    }
+}
+
+// Simulates syntax highlighting 50k tokens with applyTextRuns()
+void highlightTokensBatch(DrawContext& dc, const std::string& text, int n)
+{
+    auto highlights = createHighlights(text);
+    Font font("Courier New", PicaPt(12.0f));
+    for (int i = 0;  i < n;  ++i) {
+        Text t(text, font, Color(0.0f, 0.0f, 0.0f, 1.0f));
+        t.applyTextRuns(highlights);
+    }
+}
+
+// Simulates finding the caret positions in a newly laid out document
+void iterateGlyphs(DrawContext& dc, int n)
+{
+    PicaPt maxX;
+    for (int i = 0;  i < n;  ++i) {
+        auto layout = create100kCharLayout(dc);
+        for (auto g : layout->glyphRange()) {
+            maxX = std::max(maxX, g.frame.maxX());
+        }
+    }
+    if (maxX == PicaPt::kZero) {
+        std::cout << "[ERROR] glyphRange() did not return any glyphs" << std::endl;
+    }
+}
+
+// Simulates opening a large log file and showing the middle of it
+void openLongText(DrawContext& dc, const std::string& text, int n)
+{
+    Font font("Arial", PicaPt(12.0f));
+    auto width = PicaPt::fromPixels(dc.width(), dc.dpi());
+    auto height = PicaPt::fromPixels(dc.height(), dc.dpi());
+    dc.beginDraw();
+    dc.fill(kBGColor);
+    for (int i = 0;  i < n;  ++i) {
+        EditableTextLayout layout(dc, Text(text, font, Color(0.0f, 0.0f, 0.0f, 1.0f)),
+                                  width, Alignment::kLeft, kWrapWord, 100);
+        auto y = layout.paragraphY(layout.paragraphCount() / 2);
+        layout.draw(dc, Point(PicaPt::kZero, -y), Rect(PicaPt::kZero, y, width, height));
+    }
+    dc.endDraw();
+}
+
+// Simulates typing (and deleting) in the middle of a long document
+void typeInLongText(DrawContext& dc, EditableTextLayout& layout, int n)
+{
+    long idx = long(layout.text().text().size() / 2);
+    for (int i = 0;  i < n;  ++i) {
+        if (i % 2 == 0) {
+            layout.insert(idx, "x");
+        } else {
+            layout.remove(idx, 1);
+        }
+    }
+    dc.beginDraw();
+    dc.fill(kBGColor);
+    dc.drawText(layout, Point::kZero);
+    dc.endDraw();
+}
+
 void drawTextLayout(DrawContext& dc, int n)
 {
     int dx = 10;
@@ -392,7 +816,8 @@ void drawTextLayout(DrawContext& dc, int n)
     dc.endDraw();
 }
 
-void drawLinearGradient(DrawContext& dc, int n, int sizePx)
+void drawLinearGradient(DrawContext& dc, int n, int sizePx,
+                        GradientMode mode = kGradientNative)
 {
     int dx = 10;
     int dy = 10;
@@ -405,6 +830,8 @@ void drawLinearGradient(DrawContext& dc, int n, int sizePx)
     int col = 0;
 
     auto &gradient = dc.getGradient({ { Color::kGreen, 0.0f }, { Color::kBlue, 1.0f } });
+    auto oldMode = dc.gradientMode();
+    dc.setGradientMode(mode);
 
     dc.beginDraw();
     dc.fill(kBGColor);
@@ -421,9 +848,11 @@ void drawLinearGradient(DrawContext& dc, int n, int sizePx)
         }
     }
     dc.endDraw();
+    dc.setGradientMode(oldMode);
 }
 
-void drawRadialGradient(DrawContext& dc, int n, int sizePx)
+void drawRadialGradient(DrawContext& dc, int n, int sizePx,
+                        GradientMode mode = kGradientNative)
 {
     int dx = 10;
     int dy = 10;
@@ -436,6 +865,8 @@ void drawRadialGradient(DrawContext& dc, int n, int sizePx)
     int col = 0;
 
     auto &gradient = dc.getGradient({ { Color::kYellow, 0.0f }, { Color::kGreen, 1.0f } });
+    auto oldMode = dc.gradientMode();
+    dc.setGradientMode(mode);
 
     dc.beginDraw();
     dc.fill(kBGColor);
@@ -452,6 +883,42 @@ void drawRadialGradient(DrawContext& dc, int n, int sizePx)
         }
     }
     dc.endDraw();
+    dc.setGradientMode(oldMode);
+}
+
+void drawConicGradient(DrawContext& dc, int n, int sizePx,
+                       GradientMode mode = kGradientNative)
+{
+    int dx = 10;
+    int dy = 10;
+    LayoutInfo layout(dc, n, dx, dy);
+
+    auto x0 = PicaPt::fromPixels(dx, dc.dpi());
+    auto x = x0;
+    auto y = PicaPt::fromPixels(dy, dc.dpi());
+    auto size = PicaPt::fromPixels(sizePx, dc.dpi());
+    int col = 0;
+
+    auto &gradient = dc.getGradient({ { Color::kRed, 0.0f }, { Color::kYellow, 0.5f }, { Color::kGreen, 1.0f } });
+    auto oldMode = dc.gradientMode();
+    dc.setGradientMode(mode);
+
+    dc.beginDraw();
+    dc.fill(kBGColor);
+    for (int i = 0;  i < n;  ++i) {
+        auto path = dc.createBezierPath();
+        path->addEllipse(Rect(x, y, size, size));
+        dc.drawConicGradientPath(path, gradient, Point(x + 0.5f * size, y + 0.5f * size), 90.0f);
+        x += layout.dx;
+        col++;
+        if (col >= layout.nCols) {
+            col = 0;
+            x = x0;
+            y += layout.dy;
+        }
+    }
+    dc.endDraw();
+    dc.setGradientMode(oldMode);
 }
 
 std::shared_ptr<BezierPath> createSquare100(DrawContext& dc, int nPts, const Point& center)
@@ -504,6 +971,45 @@ std::shared_ptr<BezierPath> createStar10(DrawContext& dc, int radiusPx, const Po
     return createStar(dc, 10, radiusPx, center);
 }
 
+std::vector<std::shared_ptr<BezierPath>> createStarGrid(DrawContext& dc, int n, int radiusPx)
+{
+    std::vector<std::shared_ptr<BezierPath>> stars;
+    stars.reserve(n);
+    LayoutInfo layout(dc, n, 2 * radiusPx, 2 * radiusPx);
+    auto r = PicaPt::fromPixels(radiusPx, dc.dpi());
+    for (int i = 0;  i < n;  ++i) {
+        Point center(float(i % layout.nCols) * layout.dx + r,
+                     float(i / layout.nCols) * layout.dy + r);
+        stars.push_back(createStar10(dc, radiusPx, center));
+    }
+    return stars;
+}
+
+// Tests the center of each path (inside, so needs the full test) and a point
+// slightly outside the star's tip (usually rejected by the bounds).
+void hitTestPaths(DrawContext& dc, const std::vector<std::shared_ptr<BezierPath>>& paths,
+                  int radiusPx)
+{
+    auto offset = PicaPt::fromPixels(float(radiusPx) + 1.0f, dc.dpi());
+    int nHits = 0;
+    dc.beginDraw();
+    dc.fill(kBGColor);
+    for (auto &path : paths) {
+        auto center = path->controlBounds().center();
+        if (path->contains(center)) {
+            ++nHits;
+        }
+        if (path->contains(Point(center.x + offset, center.y))) {
+            ++nHits;
+        }
+    }
+    if (nHits != int(paths.size())) {
+        std::cout << "[ERROR] contains() expected " << paths.size() << " hits, got "
+                  << nHits << std::endl;
+    }
+    dc.endDraw();
+}
+
 std::shared_ptr<DrawableImage> createImage(DrawContext& dc, int w, int h, float dpi)
 {
     auto imgDC = dc.createBitmap(BitmapType::kBitmapRGB, w, h);
@@ -537,6 +1043,29 @@ Timings::Timings()
                       if (!this->mImg100) {
                           this->mImg100 = createImage(dc, 100, 100, 72.0f);
                       }
+                      if (this->mStars10k.empty()) {
+                          this->mStars10k = createStarGrid(dc, 10000, 3);
+                      }
+                      if (this->mLog100k.empty()) {
+                          for (int i = 0;  i < 100000;  ++i) {
+                              this->mLog100k += "[" + std::to_string(i) + "] INFO some event happened\n";
+                          }
+                      }
+                      if (this->mTokens50k.empty()) {
+                          static const char *kTokens[] = { "if", "(x", "==", "nullptr)", "return", "0;" };
+                          for (int i = 0;  i < 50000;  ++i) {
+                              this->mTokens50k += kTokens[i % 6];
+                              this->mTokens50k += ((i % 12 == 11) ? "\n " : " ");
+                          }
+                      }
+                      if (!this->mText100k) {
+                          this->mText100k = create100kCharLayout(dc);
+                          this->mText100k->glyphs();  // not part of the hit-testing
+                      }
+                      if (this->mLines10kDC != &dc) {
+                          this->mLines10k = createLongText(dc, 10000);
+                          this->mLines10kDC = &dc;
+                      }
                   } },
               // some platforms like Direct2D take some time to create everything for the
               // first draw. Since we subtract off the timing for kBaseRunName, we need
@@ -547,6 +1076,11 @@ Timings::Timings()
               Run{"rects (fill)", kNObjs,
                   [](DrawContext& dc, int nObjs) { drawRects(dc, nObjs, 100, 100,
                                                              PaintMode::kPaintFill); } },
+              // Opaque, pixel-aligned fills can take a fast path on CPU
+              // surfaces (e.g. cairo-x11 with --double-buffered)
+              Run{"rects (fill, pixel-aligned)", kNObjs,
+                  [](DrawContext& dc, int nObjs) { drawRects(dc, nObjs, 100, 100,
+                                                             PaintMode::kPaintFill, true); } },
               Run{"rects (stroke)", kNObjs,
                   [](DrawContext& dc, int nObjs) { drawRects(dc, nObjs, 100, 100,
                                                              PaintMode::kPaintStroke); } },
@@ -562,6 +1096,9 @@ Timings::Timings()
               Run{"rounded rects (stroke+fill)", kNObjs,
                   [](DrawContext& dc, int nObjs) { drawRoundedRects(dc, nObjs, 100, 100, 10,
                                                              PaintMode::kPaintStrokeAndFill); } },
+              Run{"rounded rects (shadow+fill)", kNObjs,
+                  [](DrawContext& dc, int nObjs) { drawShadowedRoundedRects(dc, nObjs, 100, 100,
+                                                                            10, 8); } },
               Run{"bezier rects (fill)", kNObjs,
                   [radiusPx](DrawContext& dc, int nObjs) {
                       drawBezier(dc, nObjs, createSquare100, radiusPx, PaintMode::kPaintFill); } },
@@ -590,21 +1127,58 @@ Timings::Timings()
                   [radiusPx](DrawContext& dc, int nObjs) {
                       drawBezierTransformed(dc, nObjs, createStar10, radiusPx,
                                             PaintMode::kPaintStrokeAndFill); } },
+              Run{"star (stroke+fill, retained layer)", kNObjs,
+                  [radiusPx](DrawContext& dc, int nObjs) {
+                      drawBezierLayer(dc, nObjs, createStar10, radiusPx,
+                                      PaintMode::kPaintStrokeAndFill); } },
               Run{"images", kNObjs,
                   [this](DrawContext& dc, int nObjs) {
                       drawImages(dc, nObjs, this->mImg100); } },
+              Run{"rects (fill, 2x20 px dirty)", kNObjs,
+                  [](DrawContext& dc, int nObjs) { drawRectsDirty(dc, nObjs, 100, 100); } },
               Run{"colored rect", kNObjs,
                   [](DrawContext& dc, int nObjs) { drawColoredRects(dc, nObjs, 100, 100); } },
               Run{"clip rect", kNObjs,
                   [](DrawContext& dc, int nObjs) { clipRects(dc, nObjs, 100, 100); } },
+              Run{"clip rect (nested)", kNObjs,
+                  [](DrawContext& dc, int nObjs) { clipRectsNested(dc, nObjs, 100, 100); } },
+              Run{"save/restore (nested)", kNObjs,
+                  [](DrawContext& dc, int nObjs) { saveRestoreNested(dc, nObjs, 100, 100); } },
               Run{"clip bezier", kNObjs,
                   [radiusPx](DrawContext& dc, int nObjs) { clipBezier(dc, nObjs, createStar10,
                                                            radiusPx); } },
+              Run{"path contains (10k paths)", 10000,
+                  [this](DrawContext& dc, int nObjs) { hitTestPaths(dc, this->mStars10k, 3); } },
 
               Run{"text (no caching)", kNObjs,
                   [](DrawContext& dc, int nObjs) { drawText(dc, nObjs); } },
               Run{"text (cached with TextLayout)", kNObjs,
                   [](DrawContext& dc, int nObjs) { drawText(dc, nObjs); } },
+              Run{"edit text (10k lines)", 100,
+                  [this](DrawContext& dc, int nObjs) {
+                      typeInLongText(dc, *this->mLines10k, nObjs); } },
+              Run{"open text (100k lines, lazy)", 1,
+                  [this](DrawContext& dc, int nObjs) {
+                      openLongText(dc, this->mLog100k, nObjs); } },
+              Run{"glyphAtPoint (100k chars)", 10000,
+                  [this](DrawContext& dc, int nObjs) {
+                      hitTestText(dc, *this->mText100k, nObjs); } },
+              Run{"text (multilingual)", kNObjs,
+                  [](DrawContext& dc, int nObjs) { drawMultilingualText(dc, nObjs); } },
+              Run{"font metrics (new sizes)", 100,
+                  [](DrawContext& dc, int nObjs) { measureNewFonts(dc, nObjs); } },
+              Run{"rich text (1k runs)", 10,
+                  [](DrawContext& dc, int nObjs) { buildRichText(dc, nObjs); } },
+              Run{"highlight (50k tokens)", 1,
+                  [this](DrawContext& dc, int nObjs) {
+                      highlightTokens(dc, this->mTokens50k, nObjs); } },
+              Run{"highlight (50k tokens, batch)", 1,
+                  [this](DrawContext& dc, int nObjs) {
+                      highlightTokensBatch(dc, this->mTokens50k, nObjs); } },
+              Run{"glyphs (100k chars)", 10,
+                  [](DrawContext& dc, int nObjs) { iterateGlyphs(dc, nObjs); } },
+              Run{"scrolled list (mostly culled)", kNObjs,
+                  [](DrawContext& dc, int nObjs) { drawScrolledList(dc, nObjs); } },
 
               Run{"linear gradient (10 px)", kNObjs,
                   [](DrawContext& dc, int nObjs) { drawLinearGradient(dc, nObjs, 100); } },
@@ -614,6 +1188,18 @@ Timings::Timings()
                   [](DrawContext& dc, int nObjs) { drawRadialGradient(dc, nObjs, 10); } },
               Run{"radial gradient (50 px)", kNObjs,
                   [](DrawContext& dc, int nObjs) { drawRadialGradient(dc, nObjs, 50); } },
+              Run{"conic gradient (50 px)", kNObjs,
+                  [](DrawContext& dc, int nObjs) { drawConicGradient(dc, nObjs, 50); } },
+              Run{"linear gradient (10 px, lookup table)", kNObjs,
+                  [](DrawContext& dc, int nObjs) { drawLinearGradient(dc, nObjs, 100, kGradientLookupTable); } },
+              Run{"linear gradient (50 px, lookup table)", kNObjs,
+                  [](DrawContext& dc, int nObjs) { drawLinearGradient(dc, nObjs, 50, kGradientLookupTable); } },
+              Run{"radial gradient (10 px, lookup table)", kNObjs,
+                  [](DrawContext& dc, int nObjs) { drawRadialGradient(dc, nObjs, 10, kGradientLookupTable); } },
+              Run{"radial gradient (50 px, lookup table)", kNObjs,
+                  [](DrawContext& dc, int nObjs) { drawRadialGradient(dc, nObjs, 50, kGradientLookupTable); } },
+              Run{"conic gradient (50 px, lookup table)", kNObjs,
+                  [](DrawContext& dc, int nObjs) { drawConicGradient(dc, nObjs, 50, kGradientLookupTable); } },
         };
 }
 
@@ -32,8 +32,11 @@
 #endif // ND_NAMESPACE
 
 namespace ND_NAMESPACE {
+class BezierPath;
 class DrawableImage;
 class DrawContext;
+class EditableTextLayout;
+class TextLayout;
 }
 
 // Because drawing might be GPU-accelerated we cannot just time how
@@ -60,6 +63,12 @@ private:
     int mRunIdx = 0;
 
     std::shared_ptr<ND_NAMESPACE::DrawableImage> mImg100;
+    std::vector<std::shared_ptr<ND_NAMESPACE::BezierPath>> mStars10k;
+    std::shared_ptr<ND_NAMESPACE::EditableTextLayout> mLines10k;
+    const ND_NAMESPACE::DrawContext *mLines10kDC = nullptr;
+    std::string mLog100k;
+    std::shared_ptr<ND_NAMESPACE::TextLayout> mText100k;
+    std::string mTokens50k;
 
     struct Result {
         int n = 0;